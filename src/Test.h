@@ -4,6 +4,11 @@
 #include "ObjWriter.h"
 #include "MarchingCubes.h"
 
+#include "sim/Scene.h"
+#include "sim/SPH.h"
+
+#include <sstream>
+
 namespace pbs {
 
 namespace test {
@@ -39,6 +44,34 @@ static void marchingCubes() {
 
 }
 
+// Resuming from a checkpoint written after checkpointSteps steps has to continue exactly like the
+// uninterrupted simulation (steps are only reproducible in deterministic mode)
+static bool checkpointRoundTrip(const std::string &filename, int checkpointSteps, int steps) {
+    DBG("Checkpoint round trip ...");
+
+    Scene scene = Scene::load(filename, json11::Json::object { { "deterministic", true } });
+
+    SPH reference(scene);
+    for (int i = 0; i < steps; ++i) {
+        reference.updateStep();
+    }
+
+    std::unique_ptr<SPH> sph(new SPH(scene));
+    for (int i = 0; i < checkpointSteps; ++i) {
+        sph->updateStep();
+    }
+    std::stringstream checkpoint;
+    sph->writeCheckpoint(checkpoint);
+    sph.reset(new SPH(scene, &checkpoint));
+    for (int i = checkpointSteps; i < steps; ++i) {
+        sph->updateStep();
+    }
+
+    bool equal = sph->time() == reference.time() && sph->fluidPositions() == reference.fluidPositions();
+    DBG("Checkpoint round trip %s (time = %f, reference time = %f)", equal ? "passed" : "failed", sph->time(), reference.time());
+    return equal;
+}
+
 } // namespace test
 
 } // namespace pbs
@@ -2,6 +2,9 @@
 
 #include <sstream>
 #include <iomanip>
+#include <atomic>
+#include <new>
+#include <cstdlib>
 
 namespace pbs {
 
@@ -123,5 +126,94 @@ std::string indent(const std::string &string, int amount) {
     return oss.str();
 }
 
+static thread_local bool g_deterministic = false;
+
+DeterministicScope::DeterministicScope(bool enabled) :
+    _previous(g_deterministic)
+{
+    g_deterministic = enabled;
+}
+
+DeterministicScope::~DeterministicScope() {
+    g_deterministic = _previous;
+}
+
+bool isDeterministic() {
+    return g_deterministic;
+}
+
+static std::atomic<size_t> g_allocationCount(0);
+static thread_local int g_ignoreAllocations = 0;
+static std::atomic<bool> g_allocationChecks(true);
+
+size_t allocationCount() {
+    return g_allocationCount.load();
+}
+
+void setAllocationChecks(bool enabled) {
+    g_allocationChecks = enabled;
+}
+
+bool allocationChecks() {
+    return g_allocationChecks;
+}
+
+IgnoreAllocations::IgnoreAllocations() {
+    ++g_ignoreAllocations;
+}
+
+IgnoreAllocations::~IgnoreAllocations() {
+    --g_ignoreAllocations;
+}
+
+static inline void *countedAllocate(size_t size) {
+    if (g_ignoreAllocations == 0) {
+        ++g_allocationCount;
+    }
+    void *ptr = std::malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+static thread_local ParallelBusyTime *g_parallelBusyTime = nullptr;
+
+int parallelConcurrency() {
+#if USE_TBB
+    return tbb::this_task_arena::max_concurrency();
+#else
+    return 1;
+#endif
+}
+
+ParallelBusyTime *ParallelBusyTime::current() {
+    return g_parallelBusyTime;
+}
+
+ParallelBusyTimeScope::ParallelBusyTimeScope(ParallelBusyTime *busyTime) :
+    _previous(g_parallelBusyTime)
+{
+    g_parallelBusyTime = busyTime;
+}
+
+ParallelBusyTimeScope::~ParallelBusyTimeScope() {
+    g_parallelBusyTime = _previous;
+}
+
+double parallelBusyTime() {
+    return g_parallelBusyTime ? g_parallelBusyTime->elapsed() : 0.0;
+}
+
 
 } // namespace pbs
+
+#if COUNT_ALLOCATIONS
+
+// Replace global allocation functions to count heap allocations
+void *operator new(size_t size) { return pbs::countedAllocate(size); }
+void *operator new[](size_t size) { return pbs::countedAllocate(size); }
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+
+#endif // COUNT_ALLOCATIONS
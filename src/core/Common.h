@@ -1,11 +1,21 @@
 #pragma once
 
+#include "DomainArenas.h"
+
 #include <Eigen/Core>
 
 #include <tinyformat.h>
 
 #include <tbb/parallel_for.h>
-
+#include <tbb/parallel_reduce.h>
+#include <tbb/blocked_range.h>
+#include <tbb/partitioner.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/task_arena.h>
+
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 #include <cmath>
 #include <exception>
 #include <string>
@@ -14,6 +24,15 @@
 // Enable TBB parallelization
 #define USE_TBB 1
 
+// Count heap allocations (debug builds only)
+#ifndef COUNT_ALLOCATIONS
+#ifdef NDEBUG
+#define COUNT_ALLOCATIONS 0
+#else
+#define COUNT_ALLOCATIONS 1
+#endif
+#endif
+
 namespace pbs {
 
 // Types ----------------------------------------------------------------------
@@ -111,18 +130,224 @@ std::string indent(const std::string &string, int amount = 2);
 
 // Threading
 
+// Number of threads available to parallel loops
+int parallelConcurrency();
+
+// Thread time spent in parallel loop bodies, accumulated per simulation instance.
+// Loops account to the counter of the thread launching them (see ParallelBusyTimeScope), which is passed on to
+// the threads running the loop bodies, so concurrently running simulations (e.g. ensemble variants) don't mix.
+class ParallelBusyTime {
+public:
+    ParallelBusyTime() : _nanoseconds(0) {}
+
+    // Accumulated time in milliseconds
+    double elapsed() const { return _nanoseconds.load(std::memory_order_relaxed) * 1e-6; }
+
+    void add(std::chrono::steady_clock::duration duration) {
+        _nanoseconds.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(), std::memory_order_relaxed);
+    }
+
+    // Counter loops launched by the calling thread account to (nullptr if there is none)
+    static ParallelBusyTime *current();
+
+private:
+    std::atomic<int64_t> _nanoseconds;
+};
+
+// Loops launched by the calling thread account to busyTime while an instance is alive
+class ParallelBusyTimeScope {
+public:
+    ParallelBusyTimeScope(ParallelBusyTime *busyTime);
+    ~ParallelBusyTimeScope();
+
+private:
+    ParallelBusyTime *_previous;
+};
+
+// Busy time of the current counter of the calling thread in milliseconds (0 if there is none).
+// Together with the wall time of a phase this gives the idle time of threads waiting at barriers.
+double parallelBusyTime();
+
+typedef tbb::blocked_range<size_t> ParallelRange;
+
+// Partitioning strategy of parallelForRange
+// - Auto: recursive splitting on demand (irregular work, e.g. neighbour loops)
+// - Static: one chunk per thread (uniform work with low per-element cost)
+// - Affinity: like Auto but replays the mapping of chunks to threads of the last loop, which
+//   improves cache reuse for loops repeatedly run over the same data. The partitioner has to
+//   outlive the loops and must not be used by concurrent loops.
+// Loops of a partitioner using domain arenas are split into one contiguous part per slab, each statically
+// partitioned among the threads of its arena (the type is ignored).
+class Partitioner {
+public:
+    enum Type {
+        Auto,
+        Static,
+        Affinity,
+    };
+
+    Partitioner(Type type = Auto) : _type(type) {}
+
+    Type type() const { return _type; }
+    tbb::affinity_partitioner &affinity() { return _affinity; }
+
+    DomainArenas *domains() const { return _domains; }
+    void useDomains(DomainArenas *domains) { _domains = domains; }
+
+private:
+    Type _type;
+    tbb::affinity_partitioner _affinity;
+    DomainArenas *_domains = nullptr;
+};
+
+// iterate over sub-ranges of begin..end-1 (of at least grain elements) calling func(range)
+template<typename Func>
+inline void parallelForRange(size_t begin, size_t end, size_t grain, Func func, Partitioner &partitioner) {
+#if USE_TBB
+    ParallelRange range(begin, end, std::max(size_t(1), grain));
+    ParallelBusyTime *busyTime = ParallelBusyTime::current();
+    auto body = [&func, busyTime] (const ParallelRange &range) {
+        // Nested loops launched by the body account to the same counter
+        ParallelBusyTimeScope scope(busyTime);
+        auto start = std::chrono::steady_clock::now();
+        func(range);
+        if (busyTime) {
+            busyTime->add(std::chrono::steady_clock::now() - start);
+        }
+    };
+    if (partitioner.domains()) {
+        partitioner.domains()->parallelFor(begin, end, [&] (int slab, size_t slabBegin, size_t slabEnd) {
+            tbb::parallel_for(ParallelRange(slabBegin, slabEnd, range.grainsize()), body, tbb::static_partitioner());
+        });
+        return;
+    }
+    switch (partitioner.type()) {
+    case Partitioner::Auto: tbb::parallel_for(range, body, tbb::auto_partitioner()); break;
+    case Partitioner::Static: tbb::parallel_for(range, body, tbb::static_partitioner()); break;
+    case Partitioner::Affinity: tbb::parallel_for(range, body, partitioner.affinity()); break;
+    }
+#else
+    if (begin < end) { func(ParallelRange(begin, end)); }
+#endif
+}
+
+template<typename Func>
+inline void parallelForRange(size_t begin, size_t end, size_t grain, Func func, Partitioner::Type type = Partitioner::Auto) {
+    Partitioner partitioner(type);
+    parallelForRange(begin, end, grain, func, partitioner);
+}
+
+// iterate over sub-ranges of begin..end-1 calling func(range, scratch) with thread-local scratch data
+template<typename Scratch, typename Func>
+inline void parallelForRange(size_t begin, size_t end, size_t grain, tbb::enumerable_thread_specific<Scratch> &scratch, Func func, Partitioner &partitioner) {
+    parallelForRange(begin, end, grain, [&scratch, &func] (const ParallelRange &range) {
+        func(range, scratch.local());
+    }, partitioner);
+}
+
+template<typename Scratch, typename Func>
+inline void parallelForRange(size_t begin, size_t end, size_t grain, tbb::enumerable_thread_specific<Scratch> &scratch, Func func, Partitioner::Type type = Partitioner::Auto) {
+    Partitioner partitioner(type);
+    parallelForRange(begin, end, grain, scratch, func, partitioner);
+}
+
 // iterate i=0..count-1 calling func(i)
+// Runs on blocked sub-ranges of parallelForRange, so per-loop work (e.g. busy time accounting) is done per range.
 template<typename Func>
 inline void parallelFor(size_t count, Func func) {
+    parallelForRange(0, count, 1, [&func] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) { func(i); }
+    });
+}
+
+// Deterministic parallel execution (e.g. deterministic reductions in parallelReduce) of loops launched by the
+// calling thread while an instance is alive. Simulations enable it per instance, so it does not leak into others.
+class DeterministicScope {
+public:
+    DeterministicScope(bool enabled);
+    ~DeterministicScope();
+
+private:
+    bool _previous;
+};
+
+bool isDeterministic();
+
+// reduce i=begin..end-1 calling func(i, value) to accumulate into partial values, which are combined using reduce(a, b)
+// In deterministic mode the range is split into fixed blocks whose partial values are combined
+// in a fixed tree order, so the result does not depend on the thread schedule or the number of threads.
+template<typename T, typename Func, typename Reduce>
+inline T parallelReduceRange(size_t begin, size_t end, const T &identity, Func func, Reduce reduce) {
 #if USE_TBB
-    tbb::parallel_for(0ul, count, 1ul, [func] (size_t i) { func(i); });
+    ParallelBusyTime *busyTime = ParallelBusyTime::current();
+    auto body = [&func, busyTime] (const tbb::blocked_range<size_t> &range, const T &init) {
+        ParallelBusyTimeScope scope(busyTime);
+        auto start = std::chrono::steady_clock::now();
+        T value = init;
+        for (size_t i = range.begin(); i < range.end(); ++i) { func(i, value); }
+        if (busyTime) {
+            busyTime->add(std::chrono::steady_clock::now() - start);
+        }
+        return value;
+    };
+    if (isDeterministic()) {
+        return tbb::parallel_deterministic_reduce(tbb::blocked_range<size_t>(begin, end, 256), identity, body, reduce);
+    } else {
+        return tbb::parallel_reduce(tbb::blocked_range<size_t>(begin, end), identity, body, reduce);
+    }
 #else
-    for (size_t i = 0; i < count; ++i) { func(i); }
+    T value = identity;
+    for (size_t i = begin; i < end; ++i) { func(i, value); }
+    return value;
+#endif
+}
+
+// reduce i=0..count-1 (see parallelReduceRange)
+template<typename T, typename Func, typename Reduce>
+inline T parallelReduce(size_t count, const T &identity, Func func, Reduce reduce) {
+    return parallelReduceRange(0, count, identity, func, reduce);
+}
+
+// reduce i=0..count-1 over the same slabs as the loops of a partitioner using domain arenas: each slab is
+// reduced in its own arena and the partial values of the slabs are combined in slab order, so deterministic
+// mode gives the same result for a fixed number of slabs
+template<typename T, typename Func, typename Reduce>
+inline T parallelReduce(size_t count, const T &identity, Func func, Reduce reduce, Partitioner &partitioner) {
+#if USE_TBB
+    DomainArenas *domains = partitioner.domains();
+    if (!domains) {
+        return parallelReduce(count, identity, func, reduce);
+    }
+    T partials[DomainArenas::MaxCount];
+    domains->parallelFor(0, count, [&] (int slab, size_t slabBegin, size_t slabEnd) {
+        partials[slab] = parallelReduceRange(slabBegin, slabEnd, identity, func, reduce);
+    });
+    T value = identity;
+    for (int slab = 0; slab < domains->count(); ++slab) {
+        value = reduce(value, partials[slab]);
+    }
+    return value;
+#else
+    return parallelReduce(count, identity, func, reduce);
 #endif
 }
 
 // Debugging ------------------------------------------------------------------
 
+// Number of heap allocations (operator new) done so far by all threads (always 0 if COUNT_ALLOCATIONS is disabled)
+size_t allocationCount();
+
+// Allocation counts are shared by all threads, so checks are disabled while several simulations run concurrently
+void setAllocationChecks(bool enabled);
+bool allocationChecks();
+
+// Allocations of the calling thread are not counted while an instance is alive (e.g. for logging)
+class IgnoreAllocations {
+public:
+    IgnoreAllocations();
+    ~IgnoreAllocations();
+};
+
 class Exception : public std::runtime_error {
 public:
     template<typename... Args>
@@ -133,12 +358,14 @@ public:
 
 template<typename... Args>
 static inline void DBG(const char *fmt, const Args &... args) {
+    IgnoreAllocations ignoreAllocations;
     std::cout << tfm::format(fmt, args...) << std::endl;
 }
 
 template<typename... Args>
 static inline void handleAssert(bool cond, const char *fmt, const Args &... args) {
     if (!cond) {
+        IgnoreAllocations ignoreAllocations;
         std::string msg = tfm::format(fmt, args...);
         std::cout << msg << std::endl;
         throw std::runtime_error(msg);
@@ -1,15 +1,28 @@
 #include "DebugMonitor.h"
 
+#include <algorithm>
+
 namespace pbs {
 
-std::vector<DebugMonitor::Item> DebugMonitor::_items;
+thread_local std::vector<DebugMonitor::Item> DebugMonitor::_items;
+thread_local DebugMonitor::FixedBuffer DebugMonitor::_buffer;
+thread_local std::ostream DebugMonitor::_stream(&DebugMonitor::_buffer);
 
 void DebugMonitor::clear() {
-    _items.clear();
+    for (auto &item : _items) {
+        item.active = false;
+    }
 }
 
-void DebugMonitor::addItem(const std::string &name, const std::string &value) {
-    _items.emplace_back(Item({name, value}));
+void DebugMonitor::setItem(const char *name, const char *value, size_t length) {
+    auto item = std::find_if(_items.begin(), _items.end(), [name] (const Item &item) { return item.name == name; });
+    if (item == _items.end()) {
+        _items.emplace_back(Item({name, std::string(), false}));
+        item = _items.end() - 1;
+        item->value.reserve(32);
+    }
+    item->value.assign(value, length);
+    item->active = true;
 }
 
 } // namespace pbs
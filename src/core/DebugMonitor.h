@@ -4,27 +4,51 @@
 
 #include <string>
 #include <vector>
+#include <streambuf>
+#include <ostream>
 
 namespace pbs {
 
+// Monitor for displaying debug values.
+// Items persist between clear() calls (only items added since the last clear() are active),
+// so that updating values once per step does not allocate memory.
+// Items are stored per thread, so simulations running concurrently on different threads keep separate items.
 class DebugMonitor {
 public:
     struct Item {
         std::string name;
         std::string value;
+        bool active;
     };
 
     static void clear();
-    static void addItem(const std::string &name, const std::string &value);
     static const std::vector<Item> &items() { return _items; }
 
     template<typename... Args>
-    static inline void addItem(const std::string &name, const char *fmt, const Args &... args) {
-        addItem(name, tfm::format(fmt, args...));
+    static inline void addItem(const char *name, const char *fmt, const Args &... args) {
+        _buffer.reset();
+        _stream.clear();
+        tfm::format(_stream, fmt, args...);
+        setItem(name, _buffer.data(), _buffer.size());
     }
 
 private:
-    static std::vector<Item> _items;
+    static void setItem(const char *name, const char *value, size_t length);
+
+    // Stream buffer writing into a fixed size array (output is truncated)
+    class FixedBuffer : public std::streambuf {
+    public:
+        FixedBuffer() { reset(); }
+        void reset() { setp(_data, _data + sizeof(_data)); }
+        const char *data() const { return pbase(); }
+        size_t size() const { return size_t(pptr() - pbase()); }
+    private:
+        char _data[256];
+    };
+
+    static thread_local std::vector<Item> _items;
+    static thread_local FixedBuffer _buffer;
+    static thread_local std::ostream _stream;
 };
 
 } // namespace pbs
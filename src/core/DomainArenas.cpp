@@ -0,0 +1,270 @@
+#include "DomainArenas.h"
+#include "Common.h"
+
+#include <tbb/task_group.h>
+#include <tbb/task_scheduler_observer.h>
+
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#define USE_NUMA 1
+#else
+#define USE_NUMA 0
+#endif
+
+namespace pbs {
+
+struct NumaNode {
+    int id;                                 ///< Node id (-1 if there is no NUMA information)
+    std::vector<int> cpus;
+};
+
+#if USE_NUMA
+
+// Parse a sysfs list (e.g. "0-3,8-11")
+static std::vector<int> parseList(const std::string &str) {
+    std::vector<int> result;
+    for (const auto &token : tokenize(str, ",")) {
+        auto range = tokenize(token, "-");
+        if (range.empty()) {
+            continue;
+        }
+        int first = std::stoi(range[0]);
+        int last = range.size() > 1 ? std::stoi(range[1]) : first;
+        for (int i = first; i <= last; ++i) {
+            result.emplace_back(i);
+        }
+    }
+    return result;
+}
+
+// NUMA nodes with the CPUs the process may run on
+static std::vector<NumaNode> numaNodes() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    std::vector<NumaNode> nodes;
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string line;
+    if (std::getline(online, line)) {
+        for (int id : parseList(line)) {
+            NumaNode node { id, {} };
+            std::ifstream is(tfm::format("/sys/devices/system/node/node%d/cpulist", id));
+            if (std::getline(is, line)) {
+                for (int cpu : parseList(line)) {
+                    if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                        node.cpus.emplace_back(cpu);
+                    }
+                }
+            }
+            if (!node.cpus.empty()) {
+                nodes.emplace_back(node);
+            }
+        }
+    }
+    if (nodes.empty()) {
+        NumaNode node { -1, {} };
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                node.cpus.emplace_back(cpu);
+            }
+        }
+        nodes.emplace_back(node);
+    }
+    return nodes;
+}
+
+// Affinity masks saved by the pinning observers of the arenas a thread is in (arenas can be nested)
+struct AffinityStack {
+    static const int MaxDepth = 4;
+    cpu_set_t saved[MaxDepth];
+    int depth = 0;
+};
+static thread_local AffinityStack g_affinityStack;
+
+// Pins threads to the CPUs of a slab while they work in its arena, the previous affinity is restored on exit
+class PinningObserver : public tbb::task_scheduler_observer {
+public:
+    PinningObserver(tbb::task_arena &arena, const std::vector<int> &cpus) :
+        tbb::task_scheduler_observer(arena)
+    {
+        CPU_ZERO(&_cpus);
+        for (int cpu : cpus) {
+            CPU_SET(cpu, &_cpus);
+        }
+        observe(true);
+    }
+
+    ~PinningObserver() {
+        observe(false);
+    }
+
+    void on_scheduler_entry(bool) override {
+        auto &stack = g_affinityStack;
+        if (stack.depth < AffinityStack::MaxDepth) {
+            pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), &stack.saved[stack.depth]);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &_cpus);
+        }
+        ++stack.depth;
+    }
+
+    void on_scheduler_exit(bool) override {
+        auto &stack = g_affinityStack;
+        --stack.depth;
+        if (stack.depth < AffinityStack::MaxDepth) {
+            pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &stack.saved[stack.depth]);
+        }
+    }
+
+private:
+    cpu_set_t _cpus;
+};
+
+#else // USE_NUMA
+
+static std::vector<NumaNode> numaNodes() {
+    NumaNode node { -1, {} };
+    for (unsigned int cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) {
+        node.cpus.emplace_back(cpu);
+    }
+    return { node };
+}
+
+#endif // USE_NUMA
+
+struct DomainArenas::Domain {
+    int node = -1;                          ///< NUMA node of the slab (-1 if the CPUs are not on a single node)
+    std::vector<int> cpus;
+    std::unique_ptr<tbb::task_arena> arena;
+    tbb::task_group group;
+#if USE_NUMA
+    std::unique_ptr<PinningObserver> observer;
+#endif
+};
+
+// Part of a list assigned to one of parts consumers (at least one element)
+static std::vector<int> slice(const std::vector<int> &list, size_t part, size_t parts) {
+    size_t begin = list.size() * part / parts;
+    size_t end = list.size() * (part + 1) / parts;
+    if (begin == end) {
+        return { list[part % list.size()] };
+    }
+    return std::vector<int>(list.begin() + begin, list.begin() + end);
+}
+
+DomainArenas::DomainArenas(int count) {
+    auto nodes = numaNodes();
+    if (count <= 0) {
+        count = int(nodes.size());
+    }
+    count = std::min(count, MaxCount);
+
+    // Slabs are spread evenly over the NUMA nodes if possible, otherwise over all CPUs
+    std::vector<int> allCpus;
+    for (const auto &node : nodes) {
+        allCpus.insert(allCpus.end(), node.cpus.begin(), node.cpus.end());
+    }
+    int slabsPerNode = count % int(nodes.size()) == 0 ? count / int(nodes.size()) : 0;
+
+    for (int i = 0; i < count; ++i) {
+        std::unique_ptr<Domain> domain(new Domain());
+        if (slabsPerNode > 0) {
+            const auto &node = nodes[i / slabsPerNode];
+            domain->node = node.id;
+            domain->cpus = slice(node.cpus, i % slabsPerNode, slabsPerNode);
+        } else {
+            domain->cpus = slice(allCpus, i, count);
+        }
+
+        // The calling thread runs the first slab itself, so only the first arena reserves a slot for it
+        domain->arena.reset(new tbb::task_arena(int(domain->cpus.size()), i == 0 ? 1 : 0));
+        domain->arena->initialize();
+#if USE_NUMA
+        domain->observer.reset(new PinningObserver(*domain->arena, domain->cpus));
+#endif
+        _domains.emplace_back(std::move(domain));
+    }
+
+    for (const auto &domain : _domains) {
+        _numa |= domain->node >= 0 && domain->node != _domains.front()->node;
+    }
+}
+
+DomainArenas::~DomainArenas() {
+}
+
+int DomainArenas::numaNodeCount() {
+    return int(numaNodes().size());
+}
+
+void DomainArenas::run(size_t begin, size_t end, void (*func)(const void *, int, size_t, size_t), const void *context) {
+    for (int i = 1; i < count(); ++i) {
+        Domain &domain = *_domains[i];
+        size_t slabBegin = this->slabBegin(begin, end, i);
+        size_t slabEnd = this->slabBegin(begin, end, i + 1);
+        domain.arena->execute([&] () {
+            domain.group.run([func, context, i, slabBegin, slabEnd] () {
+                func(context, i, slabBegin, slabEnd);
+            });
+        });
+    }
+
+    _domains.front()->arena->execute([&] () {
+        func(context, 0, slabBegin(begin, end, 0), slabBegin(begin, end, 1));
+    });
+
+    for (int i = 1; i < count(); ++i) {
+        Domain &domain = *_domains[i];
+        domain.arena->execute([&] () {
+            domain.group.wait();
+        });
+    }
+}
+
+void DomainArenas::place(const void *data, size_t count, size_t elementSize) const {
+#if USE_NUMA && defined(SYS_mbind)
+    if (!_numa) {
+        return;
+    }
+    const uintptr_t pageSize = uintptr_t(sysconf(_SC_PAGESIZE));
+    for (int i = 0; i < this->count(); ++i) {
+        int node = _domains[i]->node;
+        if (node < 0 || node >= 63) {
+            continue;
+        }
+        // Only whole pages within the slab are moved
+        uintptr_t begin = uintptr_t(data) + slabBegin(0, count, i) * elementSize;
+        uintptr_t end = uintptr_t(data) + slabBegin(0, count, i + 1) * elementSize;
+        begin = (begin + pageSize - 1) & ~(pageSize - 1);
+        end &= ~(pageSize - 1);
+        if (begin >= end) {
+            continue;
+        }
+        unsigned long mask = 1ul << node;
+        syscall(SYS_mbind, begin, end - begin, MPOL_PREFERRED, &mask, sizeof(mask) * 8, MPOL_MF_MOVE);
+    }
+#endif
+}
+
+std::string DomainArenas::toString() const {
+    std::ostringstream oss;
+    for (int i = 0; i < count(); ++i) {
+        const auto &domain = *_domains[i];
+        oss << tfm::format("slab %d: node = %d, threads = %d, cpus = [", i, domain.node, domain.cpus.size());
+        for (size_t j = 0; j < domain.cpus.size(); ++j) {
+            oss << (j > 0 ? " " : "") << domain.cpus[j];
+        }
+        oss << "]" << (i + 1 < count() ? "\n" : "");
+    }
+    return oss.str();
+}
+
+} // namespace pbs
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <tbb/task_arena.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace pbs {
+
+// Domain decomposition of particle loops into slabs, each run in its own task arena.
+// The index range of a loop is split into one contiguous part per slab. Particles sorted by a grid whose
+// slowest varying axis is the slab axis (see Grid::init()) are ordered along that axis, so the parts are
+// slabs of the domain holding equal numbers of particles. Particles migrate between slabs when the grid
+// is updated, and neighbours in adjacent slabs (the ghost layer) are read directly from shared memory.
+// On Linux, the threads of each arena are pinned to the CPUs of one NUMA node (or an equal share of the
+// CPUs if there are fewer nodes than slabs) and place() moves buffer pages to the nodes of their slabs.
+class DomainArenas {
+public:
+    static const int MaxCount = 64;         ///< Max. number of slabs
+
+    // Creates count slabs (at most MaxCount), or one slab per NUMA node if count is 0
+    DomainArenas(int count);
+    ~DomainArenas();
+
+    int count() const { return int(_domains.size()); }
+
+    // Number of NUMA nodes with CPUs the process may run on (at least 1)
+    static int numaNodeCount();
+
+    // First index of a slab within begin..end-1
+    size_t slabBegin(size_t begin, size_t end, int slab) const {
+        return begin + (end - begin) * size_t(slab) / _domains.size();
+    }
+
+    // Call func(slab, slabBegin, slabEnd) for each slab of begin..end-1, concurrently in the arenas of the slabs
+    template<typename Func>
+    void parallelFor(size_t begin, size_t end, const Func &func) {
+        run(begin, end, [] (const void *context, int slab, size_t begin, size_t end) {
+            (*static_cast<const Func *>(context))(slab, begin, end);
+        }, &func);
+    }
+
+    // Move the pages of a particle buffer to the NUMA nodes of the slabs owning them (no-op without NUMA nodes)
+    template<typename T, typename Allocator>
+    void place(const std::vector<T, Allocator> &buffer) const {
+        place(buffer.data(), buffer.size(), sizeof(T));
+    }
+
+    std::string toString() const;
+
+private:
+    void run(size_t begin, size_t end, void (*func)(const void *, int, size_t, size_t), const void *context);
+    void place(const void *data, size_t count, size_t elementSize) const;
+
+    struct Domain;
+    std::vector<std::unique_ptr<Domain>> _domains;
+    bool _numa = false;                     ///< Slabs are on different NUMA nodes
+};
+
+} // namespace pbs
@@ -4,6 +4,7 @@
 #include "StringUtils.h"
 
 #include <cassert>
+#include <cstdio>
 #include <cstring>
 #include <fstream>
 #include <string>
@@ -159,6 +160,15 @@ static bool deleteFile(const std::string &filename) {
 #endif
 }
 
+// Rename a file, replacing an existing file at the destination (std::rename fails on Windows in that case)
+static bool replaceFile(const std::string &from, const std::string &to) {
+#ifdef __WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
 static bool deleteDir(const std::string &dirname) {
 #ifdef __WIN32
     return RemoveDirectory(dirname.c_str());
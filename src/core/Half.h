@@ -0,0 +1,191 @@
+#pragma once
+
+#include "Common.h"
+#include "Vector.h"
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+// F16C half float conversions (GCC and Clang define __F16C__ with -mf16c, MSVC always provides the intrinsics)
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(USE_F16C))
+#define HALF_F16C 1
+#else
+#define HALF_F16C 0
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || HALF_F16C
+#define HALF_SSE2 1
+#include <immintrin.h>
+#else
+#define HALF_SSE2 0
+#endif
+
+namespace pbs {
+
+// 16 bit floating point formats
+enum HalfFormat {
+    Float16,                                ///< IEEE 754 half precision (11 bit mantissa, max. 65504)
+    BFloat16,                               ///< bfloat16 (8 bit mantissa, same range as float)
+};
+
+namespace detail {
+
+inline uint32_t floatBits(float f) { uint32_t u; std::memcpy(&u, &f, sizeof(u)); return u; }
+inline float bitsFloat(uint32_t u) { float f; std::memcpy(&f, &u, sizeof(f)); return f; }
+
+} // namespace detail
+
+// Convert float to IEEE half float (round to nearest even)
+inline uint16_t floatToHalf(float f) {
+#if HALF_F16C
+    return uint16_t(_cvtss_sh(f, 0));
+#else
+    uint32_t x = detail::floatBits(f);
+    uint32_t sign = x & 0x80000000u;
+    x ^= sign;
+    uint32_t h;
+    if (x >= (143u << 23)) {
+        // Overflow, infinity or nan
+        h = x > (255u << 23) ? 0x7e00 : 0x7c00;
+    } else if (x < (113u << 23)) {
+        // Subnormal or zero, let the FPU do the rounding
+        const uint32_t magic = 126u << 23;
+        h = detail::floatBits(detail::bitsFloat(x) + detail::bitsFloat(magic)) - magic;
+    } else {
+        uint32_t odd = (x >> 13) & 1;
+        x += (uint32_t(15 - 127) << 23) + 0xfff + odd;
+        h = x >> 13;
+    }
+    return uint16_t(h | (sign >> 16));
+#endif
+}
+
+// Convert IEEE half float to float
+inline float halfToFloat(uint16_t h) {
+#if HALF_F16C
+    return _cvtsh_ss(h);
+#else
+    const uint32_t shiftedExp = 0x7c00u << 13;
+    uint32_t x = (h & 0x7fffu) << 13;
+    uint32_t exp = x & shiftedExp;
+    x += uint32_t(127 - 15) << 23;
+    if (exp == shiftedExp) {
+        // Infinity or nan
+        x += uint32_t(128 - 16) << 23;
+    } else if (exp == 0) {
+        // Subnormal or zero
+        x += 1u << 23;
+        x = detail::floatBits(detail::bitsFloat(x) - detail::bitsFloat(113u << 23));
+    }
+    return detail::bitsFloat(x | (uint32_t(h & 0x8000u) << 16));
+#endif
+}
+
+// Convert float to bfloat16 (round to nearest even)
+inline uint16_t floatToBFloat16(float f) {
+    uint32_t x = detail::floatBits(f);
+    if ((x & 0x7fffffffu) > 0x7f800000u) {
+        return uint16_t((x >> 16) | 0x40);
+    }
+    x += 0x7fffu + ((x >> 16) & 1);
+    return uint16_t(x >> 16);
+}
+
+// Convert bfloat16 to float
+inline float bfloat16ToFloat(uint16_t h) {
+    return detail::bitsFloat(uint32_t(h) << 16);
+}
+
+// Buffer of scalar or 3d vector attributes stored as 16 bit floats.
+// Values are normalized by the max. absolute value, which keeps half floats from overflowing.
+// Vectors are padded to 4 components so that they are converted with a single SIMD load.
+class HalfBuffer {
+public:
+    HalfFormat format() const { return _format; }
+    void setFormat(HalfFormat format) { _format = format; }
+
+    size_t memoryUsage() const { return _data.size() * sizeof(uint16_t); }
+
+    // Reserve storage for count values (scalars or vectors)
+    void reserve(size_t count) { _data.reserve(4 * count); }
+
+    // Store values, returns the max. conversion error (relative to the max. absolute value).
+    // Passes run with the partitioner of the loops computing the values.
+    float store(const std::vector<float> &values, Partitioner &partitioner) {
+        _data.resize(values.size());
+        float invScale = computeScale(values.size(), [&values] (size_t i) { return std::abs(values[i]); }, partitioner);
+        return parallelReduce(values.size(), 0.f, [&] (size_t i, float &error) {
+            float x = values[i] * invScale;
+            _data[i] = encode(x);
+            error = std::max(error, std::abs(decode(_data[i]) - x));
+        }, maxReduce, partitioner);
+    }
+
+    float store(const std::vector<Vector3f> &values, Partitioner &partitioner) {
+        _data.resize(4 * values.size());
+        float invScale = computeScale(values.size(), [&values] (size_t i) { return values[i].cwiseAbs().maxCoeff(); }, partitioner);
+        return parallelReduce(values.size(), 0.f, [&] (size_t i, float &error) {
+            for (int k = 0; k < 3; ++k) {
+                float x = values[i][k] * invScale;
+                _data[4 * i + k] = encode(x);
+                error = std::max(error, std::abs(decode(_data[4 * i + k]) - x));
+            }
+            _data[4 * i + 3] = 0;
+        }, maxReduce, partitioner);
+    }
+
+    inline float scalar(size_t i) const {
+        return decode(_data[i]) * _scale;
+    }
+
+    inline Vector3f vector(size_t i) const {
+#if HALF_SSE2
+        __m128i h = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(&_data[4 * i]));
+        __m128 v;
+        if (_format == BFloat16) {
+            v = _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), h));
+        } else {
+#if HALF_F16C
+            v = _mm_cvtph_ps(h);
+#else
+            const uint16_t *p = &_data[4 * i];
+            v = _mm_setr_ps(halfToFloat(p[0]), halfToFloat(p[1]), halfToFloat(p[2]), 0.f);
+#endif
+        }
+        alignas(16) float f[4];
+        _mm_store_ps(f, _mm_mul_ps(v, _mm_set1_ps(_scale)));
+        return Vector3f(f[0], f[1], f[2]);
+#else
+        const uint16_t *p = &_data[4 * i];
+        return Vector3f(decode(p[0]), decode(p[1]), decode(p[2])) * _scale;
+#endif
+    }
+
+private:
+    static float maxReduce(float a, float b) { return std::max(a, b); }
+
+    // Computes the normalization scale from the max. absolute value, returns the inverse scale
+    template<typename Func>
+    float computeScale(size_t count, Func absValue, Partitioner &partitioner) {
+        float max = parallelReduce(count, 0.f, [&absValue] (size_t i, float &max) {
+            max = std::max(max, absValue(i));
+        }, maxReduce, partitioner);
+        _scale = std::max(max, 1e-20f);
+        return 1.f / _scale;
+    }
+
+    inline uint16_t encode(float x) const {
+        return _format == BFloat16 ? floatToBFloat16(x) : floatToHalf(x);
+    }
+
+    inline float decode(uint16_t h) const {
+        return _format == BFloat16 ? bfloat16ToFloat(h) : halfToFloat(h);
+    }
+
+    HalfFormat _format = Float16;
+    float _scale = 1.f;
+    std::vector<uint16_t> _data;
+};
+
+} // namespace pbs
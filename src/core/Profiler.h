@@ -4,50 +4,67 @@
 #include "Timer.h"
 
 #include <string>
-#include <deque>
+#include <array>
 #include <vector>
 #include <numeric>
+#include <algorithm>
 
 namespace pbs {
 
 // Simple profiler.
+// Besides the wall time, each item tracks the idle time, i.e. the thread time that was not spent
+// in parallel loop bodies while the item was active (threads waiting at barriers or for serial work).
+// Items are stored per thread, so simulations running concurrently on different threads are profiled separately.
 class Profiler {
 public:
     struct Item {
+        static const int HistorySize = 10;
+
         std::string name;
         double avg;
-        std::deque<double> history;
+        double idle;
+        std::array<double, HistorySize> history;
+        std::array<double, HistorySize> idleHistory;
 
-        Item(const std::string &name) : name(name), avg(0.0) {}
+        Item(const char *name) : name(name), avg(0.0), idle(0.0) {}
 
         void enter() {
             timer.reset();
+            busyTime = parallelBusyTime();
             active = true;
         }
 
         void leave() {
             if (active) {
-                history.emplace_back(timer.elapsed());
-                while (history.size() > 10) { history.pop_front(); }
-                avg = std::accumulate(history.begin(), history.end(), 0.0) / history.size();
+                double elapsed = timer.elapsed();
+                double busy = parallelBusyTime() - busyTime;
+                history[historyIndex] = elapsed;
+                idleHistory[historyIndex] = std::max(0.0, elapsed * parallelConcurrency() - busy);
+                historyIndex = (historyIndex + 1) % HistorySize;
+                historyCount = std::min(historyCount + 1, HistorySize);
+                avg = std::accumulate(history.begin(), history.begin() + historyCount, 0.0) / historyCount;
+                idle = std::accumulate(idleHistory.begin(), idleHistory.begin() + historyCount, 0.0) / historyCount;
             }
             active = false;
         }
 
     private:
         Timer timer;
+        double busyTime;
+        int historyIndex = 0;
+        int historyCount = 0;
         bool active = false;
     };
 
-    static void enter(const std::string &name) {
+    static void enter(const char *name) {
         item(name).enter();
     }
-    static void leave(const std::string &name) {
+    static void leave(const char *name) {
         item(name).leave();
     }
 
     template<typename Func>
-    static void profile(const std::string &name, Func func) {
+    static void profile(const char *name, Func func) {
         enter(name);
         func();
         leave(name);
@@ -59,22 +76,24 @@ public:
 
     static void dump() {
         double totalTime = 0.0;
+        double totalIdle = 0.0;
         for (const auto &item : _items) {
-            DBG("%-20s %.1f ms", item.name, item.avg);
+            DBG("%-20s %.1f ms (idle %.1f ms)", item.name, item.avg, item.idle);
             totalTime += item.avg;
+            totalIdle += item.idle;
         }
-        DBG("%-20s %.1f ms", "Total", totalTime);
+        DBG("%-20s %.1f ms (idle %.1f ms)", "Total", totalTime, totalIdle);
     }
 
 private:
-    static Item &item(const std::string &name);
-    static std::vector<Item> _items;
+    static Item &item(const char *name);
+    static thread_local std::vector<Item> _items;
 };
 
 // Profiles the time spent within the current scope.
 class ProfileScope {
 public:
-    ProfileScope(const std::string &name) : _name(name) {
+    ProfileScope(const char *name) : _name(name) {
         Profiler::enter(_name);
     }
 
@@ -83,7 +102,7 @@ public:
     }
 
 private:
-    std::string _name;
+    const char *_name;
 };
 
 } // namespace pbs
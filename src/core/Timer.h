@@ -20,8 +20,7 @@ public:
     // Returns elapsed milliseconds
     double elapsed() const {
         auto now = std::chrono::system_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now - _start);
-        return double(duration.count());
+        return std::chrono::duration<double, std::milli>(now - _start).count();
     }
 
     // Returns elapsed time as a string
@@ -0,0 +1,164 @@
+#include "Ensemble.h"
+
+#include "core/FileUtils.h"
+#include "core/Timer.h"
+#include "sim/Cache.h"
+
+#include <tbb/task_arena.h>
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+
+namespace pbs {
+
+// Setting value as used in file names (strings without quotes)
+static std::string valueTag(const json11::Json &value) {
+    return value.is_string() ? value.string_value() : value.dump();
+}
+
+Ensemble::Ensemble(const EnsembleSettings &settings) :
+    _settings(settings)
+{
+    for (const auto &sweep : _settings.sweeps) {
+        if (sweep.second.empty()) {
+            throw Exception("No values given for '%s'", sweep.first);
+        }
+    }
+
+    DBG("Loading scene from '%s' ...", _settings.filename);
+    Scene scene = Scene::load(_settings.filename, _settings.sceneSettings);
+    DBG("%s", scene.toString());
+    _basename = FileUtils::splitExtension(_settings.filename).first;
+
+    // Variants are the cartesian product of the swept values (first sweep varies fastest)
+    size_t count = 1;
+    for (const auto &sweep : _settings.sweeps) {
+        count *= sweep.second.size();
+    }
+    _variants.resize(count);
+
+    std::vector<json11::Json::object> groups;
+    for (size_t i = 0; i < count; ++i) {
+        Variant &variant = _variants[i];
+        auto values = scene.settings.json().object_items();
+        size_t index = i;
+        for (const auto &sweep : _settings.sweeps) {
+            const auto &value = sweep.second[index % sweep.second.size()];
+            index /= sweep.second.size();
+            values[sweep.first] = value;
+            variant.tag += (variant.tag.empty() ? "" : "_") + sweep.first + "-" + valueTag(value);
+        }
+        variant.scene = scene;
+        variant.scene.settings = Properties(json11::Json(values));
+
+        // Variants with equal boundary settings share the boundary data
+        json11::Json::object group;
+        for (const auto &name : SPH::Boundary::settingNames()) {
+            auto it = values.find(name);
+            if (it != values.end()) {
+                group[name] = it->second;
+            }
+        }
+        auto it = std::find(groups.begin(), groups.end(), group);
+        variant.group = it - groups.begin();
+        if (it == groups.end()) {
+            groups.emplace_back(group);
+        }
+    }
+    _boundaries.resize(groups.size());
+
+    DBG("Ensemble of %d variants sharing %d boundaries", _variants.size(), _boundaries.size());
+}
+
+void Ensemble::run() {
+    Timer timer;
+
+    int concurrency = tbb::this_task_arena::max_concurrency();
+    int jobs = _settings.jobs > 0 ? _settings.jobs : std::max(1, concurrency / 4);
+    jobs = std::max(1, std::min(jobs, int(_variants.size())));
+    int threads = std::max(1, concurrency / jobs);
+    DBG("Running %d variants at a time with %d threads each", jobs, threads);
+
+    // Allocation counts are global, steps of concurrent variants would report each other's allocations
+    setAllocationChecks(jobs == 1);
+
+    // The first variant of each group builds the shared boundary (using the whole machine)
+    for (auto &variant : _variants) {
+        if (!_boundaries[variant.group]) {
+            variant.sph.reset(new SPH(variant.scene));
+            _boundaries[variant.group] = variant.sph->boundary();
+        }
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<int> failed(0);
+    std::vector<std::thread> workers;
+    for (int job = 0; job < jobs; ++job) {
+        workers.emplace_back([&] () {
+            tbb::task_arena arena(threads);
+            for (size_t i = next++; i < _variants.size(); i = next++) {
+                try {
+                    arena.execute([&] () { runVariant(_variants[i]); });
+                } catch (const std::exception &e) {
+                    std::lock_guard<std::mutex> lock(_outputMutex);
+                    std::cerr << tfm::format("Variant '%s' failed: %s", _variants[i].tag, e.what()) << std::endl;
+                    _variants[i].sph.reset();
+                    ++failed;
+                }
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    setAllocationChecks(true);
+
+    if (failed > 0) {
+        throw Exception("%d of %d variants failed", int(failed), _variants.size());
+    }
+    DBG("Ensemble took %s", timer.elapsedString());
+}
+
+// Simulates a variant and writes particles of each frame to its cache (frames are handled as in the simulator)
+void Ensemble::runVariant(Variant &variant) {
+    Timer timer;
+
+    if (!variant.sph) {
+        variant.sph.reset(new SPH(variant.scene, nullptr, _boundaries[variant.group]));
+    }
+    SPH &sph = *variant.sph;
+
+    std::string cachePath = (variant.tag.empty() ? _basename : _basename + "-" + variant.tag) + ".cache";
+    Cache cache(cachePath);
+    cache.clear();
+
+    float frameInterval = _settings.timescale / _settings.framerate;
+    float frameTime = 0.f;
+    int frameIndex = 0;
+    while (true) {
+        if (sph.time() >= frameTime) {
+            cache.setFrame(frameIndex);
+            cache.writeParticles(sph.fluidPositions());
+            frameTime += frameInterval;
+            ++frameIndex;
+        }
+        if (sph.time() >= _settings.duration) {
+            break;
+        }
+        sph.updateStep();
+    }
+
+    cache.setFrameCount(frameIndex);
+    cache.commit();
+
+    // Free the particle buffers, the boundary is kept alive by the other variants of the group
+    variant.sph.reset();
+
+    std::lock_guard<std::mutex> lock(_outputMutex);
+    std::cout << tfm::format("Finished variant '%s' (%d frames) in %s -> %s", variant.tag, frameIndex, timer.elapsedString(), cachePath) << std::endl;
+}
+
+} // namespace pbs
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "core/Common.h"
+#include "sim/Scene.h"
+#include "sim/SPH.h"
+
+#include <json11.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace pbs {
+
+struct EnsembleSettings {
+    std::string filename;
+    float duration = 10.f;
+    float timescale = 1.f;
+    int framerate = 30;
+    int jobs = 0;                           ///< Number of variants simulated concurrently (0 = automatic)
+    json11::Json sceneSettings;             ///< Settings applied to all variants
+    std::vector<std::pair<std::string, std::vector<json11::Json>>> sweeps;  ///< Swept settings and their values
+};
+
+// Runs variants of a scene (the cartesian product of all swept settings) in one process.
+// The scene is loaded once. Variants with equal boundary settings share the static boundary data
+// of the first variant built (see SPH::Boundary). Variants are simulated concurrently, each in its
+// own TBB arena with an equal share of the machine, and write their particles to <scene>-<tag>.cache.
+class Ensemble {
+public:
+    Ensemble(const EnsembleSettings &settings);
+
+    void run();
+
+private:
+    struct Variant {
+        std::string tag;
+        Scene scene;
+        size_t group;                       ///< Index of the boundary shared with other variants
+        std::unique_ptr<SPH> sph;
+    };
+
+    void runVariant(Variant &variant);
+
+    EnsembleSettings _settings;
+    std::string _basename;
+    std::vector<Variant> _variants;
+    std::vector<std::shared_ptr<SPH::Boundary>> _boundaries;
+    std::mutex _outputMutex;
+};
+
+} // namespace pbs
@@ -0,0 +1,130 @@
+#include "Ensemble.h"
+
+#include <tinyformat.h>
+#include <cxxopts.h>
+#include <json11.h>
+
+// Parse a value as JSON, or as a string if it is not valid JSON
+static bool parseValue(const std::string &name, const std::string &value, json11::Json &result) {
+    std::string error;
+    auto json = json11::Json::parse(tfm::format("{\"%s\":%s}", name, value), error);
+    if (json == json11::Json()) {
+        json = json11::Json::parse(tfm::format("{\"%s\":\"%s\"}", name, value), error);
+        if (json == json11::Json()) {
+            std::cerr << tfm::format("Invalid value '%s' for '%s' (JSON error: %s)", value, name, error) << std::endl;
+            return false;
+        }
+    }
+    result = json[name];
+    return true;
+}
+
+// Split a comma separated list of values (commas within brackets belong to the value, e.g. [0,-9.81,0])
+static std::vector<std::string> splitValues(const std::string &str) {
+    std::vector<std::string> values;
+    std::string value;
+    int depth = 0;
+    for (char c : str) {
+        if (c == '[' || c == '{') {
+            ++depth;
+        } else if (c == ']' || c == '}') {
+            --depth;
+        }
+        if (c == ',' && depth == 0) {
+            values.emplace_back(value);
+            value.clear();
+        } else {
+            value += c;
+        }
+    }
+    values.emplace_back(value);
+    return values;
+}
+
+int main(int argc, char *argv[]) {
+
+    cxxopts::Options options(argv[0], " - Fluid Ensemble Runner");
+
+    pbs::EnsembleSettings settings;
+
+    options.add_options()
+    ("h,help", "Print help")
+    ("duration", tfm::format("Duration (default: %.1f s)", settings.duration), cxxopts::value<float>(settings.duration), "s")
+    ("timescale", tfm::format("Time Scaling (default: %.1f)", settings.timescale), cxxopts::value<float>(settings.timescale), "")
+    ("framerate", tfm::format("Frame Rate (default: %d)", settings.framerate), cxxopts::value<int>(settings.framerate), "")
+    ("jobs", tfm::format("Number of variants simulated concurrently (default: %d, 0 = automatic)", settings.jobs), cxxopts::value<int>(settings.jobs), "N")
+    ("D,define", "Parameter definition (all variants)", cxxopts::value<std::vector<std::string>>(), "name=value")
+    ("S,sweep", "Parameter sweep (one variant per value)", cxxopts::value<std::vector<std::string>>(), "name=value,value,...")
+    ("input", "Input files", cxxopts::value<std::vector<std::string>>())
+    ;
+
+    options.parse_positional("input");
+
+    // Parse command line arguments
+    try {
+        options.parse(argc, argv);
+    } catch (const std::exception &e) {
+        std::cerr << "Error during command line parsing: " << e.what() << std::endl;
+        return -1;
+    }
+
+    // Show help if requested
+    if (options.count("help")) {
+        std::cout << options.help() << std::endl;
+        return 0;
+    }
+
+    // Parse definitions
+    json11::Json::object definitionValues;
+    if (options.count("D")) {
+        const auto &definitions = options["D"].as<std::vector<std::string>>();
+        for (const auto &definition : definitions) {
+            auto tokens = pbs::tokenize(definition, "=");
+            if (tokens.size() != 2) {
+                std::cerr << tfm::format("Invalid definition '%s' (needs to be in the form of 'name=value')", definition) << std::endl;
+                return -1;
+            }
+            if (!parseValue(tokens[0], tokens[1], definitionValues[tokens[0]])) {
+                return -1;
+            }
+        }
+    }
+    settings.sceneSettings = json11::Json(definitionValues);
+
+    // Parse sweeps
+    if (options.count("S")) {
+        const auto &sweeps = options["S"].as<std::vector<std::string>>();
+        for (const auto &sweep : sweeps) {
+            auto tokens = pbs::tokenize(sweep, "=");
+            if (tokens.size() != 2) {
+                std::cerr << tfm::format("Invalid sweep '%s' (needs to be in the form of 'name=value,value,...')", sweep) << std::endl;
+                return -1;
+            }
+            std::vector<json11::Json> values;
+            for (const auto &value : splitValues(tokens[1])) {
+                values.emplace_back();
+                if (!parseValue(tokens[0], value, values.back())) {
+                    return -1;
+                }
+            }
+            settings.sweeps.emplace_back(tokens[0], values);
+        }
+    }
+
+    if (options.count("input") != 1) {
+        std::cerr << "Provide a scene file!" << std::endl << std::endl;
+        std::cout << options.help() << std::endl;
+        return 0;
+    }
+    settings.filename = options["input"].as<std::vector<std::string>>().front();
+
+    try {
+        pbs::Ensemble ensemble(settings);
+        ensemble.run();
+    } catch (const std::exception &e) {
+        std::cerr << "Runtime error: " << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -164,41 +164,47 @@ ParticleGenerator::Boundary ParticleGenerator::generateBoundaryMesh(const Mesh &
     Grid grid;
     grid.init(bounds, bounds.extents().maxCoeff() / 128.f);
 
+    std::vector<Vector3f> displacements(result.positions.size());
     for (int iteration = 0; iteration < 10; ++iteration) {
-        int count = 0;
-        std::vector<Vector3f> velocities(result.positions.size(), Vector3f());
         grid.update(result.positions, [&] (size_t i, size_t j) {
             std::swap(result.positions[i], result.positions[j]);
         });
-        // Relax positions
-        for (size_t i = 0; i < result.positions.size(); ++i) {
-            grid.lookup(result.positions[i], radius, [&] (size_t j) {
-                if (i == j) { return true; };
-                Vector3f r = result.positions[j] - result.positions[i];
-                float r2 = r.squaredNorm();
-                if (r2 < radius2) {
-                    r *= (1.f / std::sqrt(r2));
-                    float weight = 0.002f * cube(1.f - r2 / radius2); // TODO use a proper kernel
-                    velocities[i] -= weight * r;
-                    ++count;
-                }
-                return true;
-            });
-            result.positions[i] += velocities[i];
-        }
-        // Reproject to surface
-        for (size_t i = 0; i < result.positions.size(); ++i) {
-            Vector3f p = sdf.toVoxelSpace(result.positions[i]);
-            Vector3f n = sdf.gradient(p).normalized();
-            result.positions[i] -= sdf.trilinear(p) * n;
-        }
+        // Relax positions (displacements are computed from the positions of the last iteration)
+        parallelForRange(0, result.positions.size(), 64, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                Vector3f displacement;
+                grid.lookup(result.positions[i], radius, [&] (size_t j) {
+                    if (i == j) { return true; };
+                    Vector3f r = result.positions[j] - result.positions[i];
+                    float r2 = r.squaredNorm();
+                    if (r2 < radius2) {
+                        r *= (1.f / std::sqrt(r2));
+                        float weight = 0.002f * cube(1.f - r2 / radius2); // TODO use a proper kernel
+                        displacement -= weight * r;
+                    }
+                    return true;
+                });
+                displacements[i] = displacement;
+            }
+        });
+        // Move and reproject to surface
+        parallelForRange(0, result.positions.size(), 256, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                Vector3f position = result.positions[i] + displacements[i];
+                Vector3f p = sdf.toVoxelSpace(position);
+                Vector3f n = sdf.gradient(p).normalized();
+                result.positions[i] = position - sdf.trilinear(p) * n;
+            }
+        });
     }
 
     // Compute normals
     result.normals.resize(result.positions.size());
-    for (size_t i = 0; i < result.positions.size(); ++i) {
-        result.normals[i] = sdf.gradient(sdf.toVoxelSpace(result.positions[i])).normalized();
-    }
+    parallelForRange(0, result.positions.size(), 256, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            result.normals[i] = sdf.gradient(sdf.toVoxelSpace(result.positions[i])).normalized();
+        }
+    });
 
     DBG("Took %s", timer.elapsedString());
 
@@ -34,10 +34,12 @@ public:
     {
         // Compute particle bounds
         std::vector<Box3i> particleBounds(positions.cols());
-        parallelFor(positions.cols(), [this, func, &positions, &particleBounds] (size_t i) {
-            Box3f box = func(positions.col(i));
-            particleBounds[i] = Box3i(index(box.min).cwiseMax(0), index(box.max).cwiseMin(_cells - Vector3i(1)));
-        });
+        parallelForRange(0, positions.cols(), 64, [this, func, &positions, &particleBounds] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                Box3f box = func(positions.col(i));
+                particleBounds[i] = Box3i(index(box.min).cwiseMax(0), index(box.max).cwiseMin(_cells - Vector3i(1)));
+            }
+        }, Partitioner::Static);
 
 #if USE_TBB
         std::atomic<size_t> *cellCount = new std::atomic<size_t>[_cells.prod()];
@@ -53,10 +55,12 @@ public:
         _cellOffset.resize(_cells.prod() + 1);
 
         // Count number of particles per cell
-        parallelFor(particleBounds.size(), [this, &particleBounds, &cellCount] (size_t i) {
-            iterate(particleBounds[i], [&] (const Vector3i &index) {
-                ++cellCount[linearize(index)];
-            });
+        parallelForRange(0, particleBounds.size(), 64, [this, &particleBounds, &cellCount] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                iterate(particleBounds[i], [&] (const Vector3i &index) {
+                    ++cellCount[linearize(index)];
+                });
+            }
         });
 
         // Initialize cell indices & offsets
@@ -70,10 +74,12 @@ public:
 
         // Put particles into cells
         _indices.resize(_cellOffset.back());
-        parallelFor(particleBounds.size(), [this, &particleBounds, &cellIndex] (size_t i) {
-            iterate(particleBounds[i], [&] (const Vector3i &index) {
-                _indices[cellIndex[linearize(index)]++] = i;
-            });
+        parallelForRange(0, particleBounds.size(), 64, [this, &particleBounds, &cellIndex] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                iterate(particleBounds[i], [&] (const Vector3i &index) {
+                    _indices[cellIndex[linearize(index)]++] = i;
+                });
+            }
         });
 
 #if USE_TBB
@@ -148,15 +154,17 @@ Mesh ParticleMesher::createMeshIsotropic(const MatrixXf &positions, const Box3f
     kernel.init(kernelRadius);
     timer.reset();
     std::vector<float> densities(positions.cols());
-    parallelFor(positions.cols(), [&] (size_t i) {
-        float density = 0;
-        grid.lookup(positions.col(i), [&] (size_t j) {
-            float r2 = (positions.col(i) - positions.col(j)).squaredNorm();
-            if (r2 < kernelRadius2) {
-                density += kernel.poly6(r2);
-            }
-        });
-        densities[i] = params.particleMass * kernel.poly6Constant * density;
+    parallelForRange(0, positions.cols(), 64, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            float density = 0;
+            grid.lookup(positions.col(i), [&] (size_t j) {
+                float r2 = (positions.col(i) - positions.col(j)).squaredNorm();
+                if (r2 < kernelRadius2) {
+                    density += kernel.poly6(r2);
+                }
+            });
+            densities[i] = params.particleMass * kernel.poly6Constant * density;
+        }
     });
     DBG("Took %s", timer.elapsedString());
 
@@ -165,19 +173,21 @@ Mesh ParticleMesher::createMeshIsotropic(const MatrixXf &positions, const Box3f
     VoxelGridf voxelGrid(cells + Vector3i(1));
     Vector3f min = bounds.min;
     Vector3f extents = bounds.extents();
-    parallelFor((cells + Vector3i(1)).prod(), [&] (size_t i) {
-        int x = i % (cells.x() + 1);
-        int y = (i / (cells.x() + 1)) % (cells.y() + 1);
-        int z = (i / ((cells.x() + 1) * (cells.y() + 1))) % (cells.z() + 1);
-        Vector3f p = Vector3f(float(x) / cells.x(), float(y) / cells.y(), float(z) / cells.z()).cwiseProduct(extents) + min;
-        float c = 0.f;
-        grid.lookup(p, [&] (size_t j) {
-            float r2 = (p - positions.col(j)).squaredNorm();
-            if (r2 < kernelRadius2) {
-                c += kernel.poly6(r2) / densities[j];
-            }
-        });
-        voxelGrid(x, y, z) = c * params.particleMass * kernel.poly6Constant;
+    parallelForRange(0, (cells + Vector3i(1)).prod(), 256, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            int x = i % (cells.x() + 1);
+            int y = (i / (cells.x() + 1)) % (cells.y() + 1);
+            int z = (i / ((cells.x() + 1) * (cells.y() + 1))) % (cells.z() + 1);
+            Vector3f p = Vector3f(float(x) / cells.x(), float(y) / cells.y(), float(z) / cells.z()).cwiseProduct(extents) + min;
+            float c = 0.f;
+            grid.lookup(p, [&] (size_t j) {
+                float r2 = (p - positions.col(j)).squaredNorm();
+                if (r2 < kernelRadius2) {
+                    c += kernel.poly6(r2) / densities[j];
+                }
+            });
+            voxelGrid(x, y, z) = c * params.particleMass * kernel.poly6Constant;
+        }
     });
     DBG("Took %s", timer.elapsedString());
 
@@ -218,21 +228,23 @@ Mesh ParticleMesher::createMeshAnisotropic(const MatrixXf &positions_, const Box
 
         DBG("Smoothing particle positions ...");
         timer.reset();
-        parallelFor(positions_.cols(), [&] (size_t i) {
-            Vector3f x = positions_.col(i);
-            Vector3f xh;
-            float totalWeight = 0.f;
-            grid.lookup(x, [&] (size_t j) {
-                Vector3f r = positions_.col(j) - x;
-                float r2 = r.squaredNorm();
-                if (r2 < kernelRadius2) {
-                    float weight = cube(kernelRadius2 - r2);
-                    xh += weight * positions_.col(j);
-                    totalWeight += weight;
-                }
-            });
-            xh *= (1.f / totalWeight);
-            positions.col(i) = lerp(lambda, x, xh);
+        parallelForRange(0, positions_.cols(), 64, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                Vector3f x = positions_.col(i);
+                Vector3f xh;
+                float totalWeight = 0.f;
+                grid.lookup(x, [&] (size_t j) {
+                    Vector3f r = positions_.col(j) - x;
+                    float r2 = r.squaredNorm();
+                    if (r2 < kernelRadius2) {
+                        float weight = cube(kernelRadius2 - r2);
+                        xh += weight * positions_.col(j);
+                        totalWeight += weight;
+                    }
+                });
+                xh *= (1.f / totalWeight);
+                positions.col(i) = lerp(lambda, x, xh);
+            }
         });
         DBG("Took %s", timer.elapsedString());
 
@@ -240,15 +252,17 @@ Mesh ParticleMesher::createMeshAnisotropic(const MatrixXf &positions_, const Box
         Kernel kernel;
         kernel.init(kernelRadius);
         timer.reset();
-        parallelFor(positions.cols(), [&] (size_t i) {
-            float density = 0;
-            grid.lookup(positions.col(i), [&] (size_t j) {
-                float r2 = (positions.col(i) - positions.col(j)).squaredNorm();
-                if (r2 < kernelRadius2) {
-                    density += kernel.poly6(r2);
-                }
-            });
-            densities[i] = params.particleMass * kernel.poly6Constant * density;
+        parallelForRange(0, positions.cols(), 64, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                float density = 0;
+                grid.lookup(positions.col(i), [&] (size_t j) {
+                    float r2 = (positions.col(i) - positions.col(j)).squaredNorm();
+                    if (r2 < kernelRadius2) {
+                        density += kernel.poly6(r2);
+                    }
+                });
+                densities[i] = params.particleMass * kernel.poly6Constant * density;
+            }
         });
         DBG("Took %s", timer.elapsedString());
     }
@@ -275,72 +289,74 @@ Mesh ParticleMesher::createMeshAnisotropic(const MatrixXf &positions_, const Box
 
         DBG("Estimating kernels ...");
         timer.reset();
-        parallelFor(positions.cols(), [&] (size_t i) {
-            // Compute mass center and number of neighbors for early out
-            Vector3f x = positions.col(i);
-            Vector3f xm;
-            int N = 0;
-            grid.lookup(positions.col(i), [&] (size_t j) {
-                Vector3f r = positions.col(j) - x;
-                float r2 = r.squaredNorm();
-                if (r2 < kernelRadius2) {
-                    xm += x;
-                    ++N;
-                }
-            });
-            xm *= (1.f / N);
-
-            // Classify particle as surface or interior
-            if (float(N - Ns) / Ns > 0.1f || (x - xm).squaredNorm() / sqr(2.f * params.particleRadius) > 0.1f) {
-                // Surface particle -> compute kernel
-                ++Nsurface;
-                // Compute weighted mean
-                Vector3f xw;
-                float totalWeight = 0.f;
-                grid.lookup(positions.col(i), [&] (size_t j) {
-                    Vector3f r = positions.col(j) - x;
-                    if (r.squaredNorm() < kernelRadius2) {
-                        float weight = kernel(r, kernelRadius);
-                        xw += weight * x;
-                        totalWeight += weight;
-                    }
-                });
-                xw *= (1.f / totalWeight);
-
-                // Compute weighted covariance matrix
-                Matrix3f C = Matrix3f::Zero();
+        parallelForRange(0, positions.cols(), 64, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                // Compute mass center and number of neighbors for early out
+                Vector3f x = positions.col(i);
+                Vector3f xm;
+                int N = 0;
                 grid.lookup(positions.col(i), [&] (size_t j) {
                     Vector3f r = positions.col(j) - x;
-                    if (r.squaredNorm() < kernelRadius2) {
-                        float weight = kernel(r, kernelRadius);
-                        Vector3f d(positions.col(j) - xw);
-                        C += weight * d * d.transpose();
+                    float r2 = r.squaredNorm();
+                    if (r2 < kernelRadius2) {
+                        xm += x;
+                        ++N;
                     }
                 });
-                C.array() *= (1.f / totalWeight);
-
-                // Compute SVD
-                float kr = 4.f;
-                float ks = 1400.f;
-
-                Eigen::JacobiSVD<Matrix3f> svd(C, Eigen::ComputeFullU);
-                const auto &R = svd.matrixU();
-
-                Vector3f sigma = svd.singularValues();
-                sigma.y() = std::max(sigma.y(), sigma.x() / kr);
-                sigma.z() = std::max(sigma.z(), sigma.x() / kr);
-                sigma *= ks;
-
-                Matrix3f G = (R * DiagonalMatrix3f(sigma.cwiseInverse()) * R.transpose()) * (1.f / kernelRadius);
-
-                kernels[i] = G;
-                determinants[i] = G.determinant();
-
-            } else {
-                // Interior particle -> use isotropic kernel
-                float kn = 0.5f;
-                kernels[i] = Matrix3f::Identity() * (kn / kernelRadius);
-                determinants[i] = cube(kn / kernelRadius);
+                xm *= (1.f / N);
+
+                // Classify particle as surface or interior
+                if (float(N - Ns) / Ns > 0.1f || (x - xm).squaredNorm() / sqr(2.f * params.particleRadius) > 0.1f) {
+                    // Surface particle -> compute kernel
+                    ++Nsurface;
+                    // Compute weighted mean
+                    Vector3f xw;
+                    float totalWeight = 0.f;
+                    grid.lookup(positions.col(i), [&] (size_t j) {
+                        Vector3f r = positions.col(j) - x;
+                        if (r.squaredNorm() < kernelRadius2) {
+                            float weight = kernel(r, kernelRadius);
+                            xw += weight * x;
+                            totalWeight += weight;
+                        }
+                    });
+                    xw *= (1.f / totalWeight);
+
+                    // Compute weighted covariance matrix
+                    Matrix3f C = Matrix3f::Zero();
+                    grid.lookup(positions.col(i), [&] (size_t j) {
+                        Vector3f r = positions.col(j) - x;
+                        if (r.squaredNorm() < kernelRadius2) {
+                            float weight = kernel(r, kernelRadius);
+                            Vector3f d(positions.col(j) - xw);
+                            C += weight * d * d.transpose();
+                        }
+                    });
+                    C.array() *= (1.f / totalWeight);
+
+                    // Compute SVD
+                    float kr = 4.f;
+                    float ks = 1400.f;
+
+                    Eigen::JacobiSVD<Matrix3f> svd(C, Eigen::ComputeFullU);
+                    const auto &R = svd.matrixU();
+
+                    Vector3f sigma = svd.singularValues();
+                    sigma.y() = std::max(sigma.y(), sigma.x() / kr);
+                    sigma.z() = std::max(sigma.z(), sigma.x() / kr);
+                    sigma *= ks;
+
+                    Matrix3f G = (R * DiagonalMatrix3f(sigma.cwiseInverse()) * R.transpose()) * (1.f / kernelRadius);
+
+                    kernels[i] = G;
+                    determinants[i] = G.determinant();
+
+                } else {
+                    // Interior particle -> use isotropic kernel
+                    float kn = 0.5f;
+                    kernels[i] = Matrix3f::Identity() * (kn / kernelRadius);
+                    determinants[i] = cube(kn / kernelRadius);
+                }
             }
         });
         DBG("Took %s", timer.elapsedString());
@@ -363,23 +379,25 @@ Mesh ParticleMesher::createMeshAnisotropic(const MatrixXf &positions_, const Box
     VoxelGridf voxelGrid(cells + Vector3i(1));
     Vector3f min = bounds.min;
     Vector3f extents = bounds.extents();
-    parallelFor((cells + Vector3i(1)).prod(), [&] (size_t i) {
-        int x = i % (cells.x() + 1);
-        int y = (i / (cells.x() + 1)) % (cells.y() + 1);
-        int z = (i / ((cells.x() + 1) * (cells.y() + 1))) % (cells.z() + 1);
-        Vector3f p = Vector3f(float(x) / cells.x(), float(y) / cells.y(), float(z) / cells.z()).cwiseProduct(extents) + min;
-        float c = 0.f;
-        grid.lookup(p, [&] (size_t j) {
-            Vector3f r = p - positions.col(j);
-            float r2 = r.squaredNorm();
-            if (r2 < kernelRadius2) {
-                const auto &G = kernels[j];
-                const auto &det = determinants[j];
-                c += kernel.poly6((G * r).squaredNorm()) * det / densities[j];
-            }
-        });
-        //voxelGrid(x, y, z) = params.particleMass * c;
-        voxelGrid(x, y, z) = params.particleMass * kernel.poly6Constant * c;
+    parallelForRange(0, (cells + Vector3i(1)).prod(), 256, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            int x = i % (cells.x() + 1);
+            int y = (i / (cells.x() + 1)) % (cells.y() + 1);
+            int z = (i / ((cells.x() + 1) * (cells.y() + 1))) % (cells.z() + 1);
+            Vector3f p = Vector3f(float(x) / cells.x(), float(y) / cells.y(), float(z) / cells.z()).cwiseProduct(extents) + min;
+            float c = 0.f;
+            grid.lookup(p, [&] (size_t j) {
+                Vector3f r = p - positions.col(j);
+                float r2 = r.squaredNorm();
+                if (r2 < kernelRadius2) {
+                    const auto &G = kernels[j];
+                    const auto &det = determinants[j];
+                    c += kernel.poly6((G * r).squaredNorm()) * det / densities[j];
+                }
+            });
+            //voxelGrid(x, y, z) = params.particleMass * c;
+            voxelGrid(x, y, z) = params.particleMass * kernel.poly6Constant * c;
+        }
     });
     DBG("Took %s", timer.elapsedString());
 
@@ -2,6 +2,7 @@
 
 #include "core/Common.h"
 #include "core/Vector.h"
+#include "core/Serialize.h"
 
 #include <vector>
 
@@ -118,6 +119,23 @@ public:
     // raw data
     const T *data() const { return _voxels.data(); }
 
+    // binary serialization
+    void write(std::ostream &os) const {
+        Serialize::write(os, _size);
+        Serialize::write(os, _origin);
+        Serialize::write(os, _cellSize);
+        Serialize::writeVector(os, _voxels);
+    }
+
+    void read(std::istream &is) {
+        Vector3i size;
+        Serialize::read(is, size);
+        resize(size);
+        Serialize::read(is, _origin);
+        Serialize::read(is, _cellSize);
+        Serialize::readVector(is, _voxels);
+    }
+
 private:
     inline size_t linearize(const Vector3i &index) const {
         return index.z() * _xy + index.y() * _x + index.x();
@@ -29,7 +29,8 @@ struct Settings {
 
 void run(const std::string &filename, const Settings &settings) {
     DBG("Loading scene from '%s' ...", filename);
-    Scene scene = Scene::load(filename);
+    // Only simulation parameters are needed, skip relaxing the initial state
+    Scene scene = Scene::load(filename, json11::Json::object { { "initialRelaxation", "none" } });
     DBG("%s", scene.toString());
     SPH sph(scene);
     std::string cachePath = FileUtils::splitExtension(filename).first + ".cache";
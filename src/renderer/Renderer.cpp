@@ -18,7 +18,8 @@ Renderer::Renderer(const RendererSettings &settings) :
 {
     setVisible(true);
 
-    _engine.loadScene(settings.filenameScene);
+    // Frames are read from the cache, the initial state is not needed
+    _engine.loadScene(settings.filenameScene, json11::Json::object { { "initialRelaxation", "none" } });
     _engine.viewOptions().showDebug = false;
 
     _animationScene = Scene::load(settings.filenameAnimation);
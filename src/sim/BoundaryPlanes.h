@@ -0,0 +1,324 @@
+#pragma once
+
+#include "Kernel.h"
+
+#include "core/Common.h"
+#include "core/Vector.h"
+#include "core/Box.h"
+
+#include <vector>
+#include <algorithm>
+
+namespace pbs {
+
+// Analytic boundary for the inner faces of a box (e.g. the world bounds).
+// Each face stands in for a layer of boundary particles [4]. Their contributions only depend on the
+// distance to the face and are tabulated once: the density sum_b m_b W(x - x_b) and the normal
+// component of the density gradient sum_b m_b grad W(x - x_b) of an infinite plane of boundary
+// particles, averaged over the lateral position within the particle lattice.
+// Near edges and corners, infinite planes overlap and boundary particle masses are reduced. Two more
+// tables hold the difference between the actual boundary particles and the planes (and edges) as a
+// function of the distances to the two (three) faces.
+class BoundaryPlanes {
+public:
+    // Faces are only modelled by the closest face per axis, so the tables of opposite faces must not overlap
+    static bool supports(const Box3f &box, const Kernel &kernel) {
+        return box.extents().minCoeff() >= 2.f * TableRange * kernel.h;
+    }
+
+    // box = location of the boundary particle layers, spacing = spacing of the boundary particles
+    void init(const Box3f &box, const Kernel &kernel, float spacing, float restDensity) {
+        if (!supports(box, kernel)) {
+            throw Exception("Box extents (%f, %f, %f) are too small for boundary planes (min. %f)",
+                            box.extents().x(), box.extents().y(), box.extents().z(), 2.f * TableRange * kernel.h);
+        }
+        _box = box;
+        _h = kernel.h;
+        _invStep = TableSize / kernel.h;
+        _edgeScale = EdgeTableSize / (TableRange * kernel.h);
+        _cornerScale = CornerTableSize / (TableRange * kernel.h);
+
+        // Boundary particles interact up to n lattice steps
+        const int n = int(std::ceil(kernel.h / spacing));
+
+        // Boundary particles of a corner at the origin (lattice points with at least one zero coordinate),
+        // edges and planes are the same lattice with some of the coordinates unbounded
+        const int extent = (TableRange + 1) * n + 1;
+        auto isBoundary = [] (int x, int y, int z) {
+            return std::min(x, std::min(y, z)) == 0;
+        };
+
+        // Mass of a boundary particle based on [4] equation 4 and 5 (same as SPH::updateBoundaryMasses)
+        // (coordinates along which the lattice is unbounded are passed as -1)
+        auto computeMass = [&] (int x, int y, int z) {
+            float weight = 0.f;
+            for (int i = -n; i <= n; ++i) {
+                for (int j = -n; j <= n; ++j) {
+                    for (int k = -n; k <= n; ++k) {
+                        int x2 = x + i, y2 = y + j, z2 = z + k;
+                        if ((x < 0 || x2 >= 0) && (y < 0 || y2 >= 0) && (z < 0 || z2 >= 0) &&
+                            isBoundary(x < 0 ? 1 : x2, y < 0 ? 1 : y2, z < 0 ? 1 : z2)) {
+                            float r2 = (sqr(i) + sqr(j) + sqr(k)) * sqr(spacing);
+                            if (r2 < kernel.h2) {
+                                weight += kernel.poly6(r2);
+                            }
+                        }
+                    }
+                }
+            }
+            return restDensity / (kernel.poly6Constant * weight) / 1.17f;
+        };
+
+        // Accumulate density and density gradient of a boundary particle at lattice point (x, y, z)
+        auto accumulate = [&] (const Vector3f &p, int x, int y, int z, float mass, double &density, Vector3d &gradient) {
+            Vector3f r = p - Vector3f(x, y, z) * spacing;
+            float r2 = r.squaredNorm();
+            if (r2 >= kernel.h2) {
+                return;
+            }
+            density += mass * kernel.poly6Constant * kernel.poly6(r2);
+            if (r2 > 1e-10f) {
+                gradient += (mass * kernel.spikyGradConstant * kernel.spikyGrad(r, std::sqrt(r2))).cast<double>();
+            }
+        };
+
+        // Infinite plane z = 0 (averaged over lateral offsets)
+        float planeMass = computeMass(-1, -1, 0);
+        _density.resize(TableSize + 1);
+        _gradient.resize(TableSize + 1);
+        for (int k = 0; k <= TableSize; ++k) {
+            double density = 0.0;
+            Vector3d gradient(0.0);
+            for (int ox = 0; ox < LateralSamples; ++ox) {
+                for (int oy = 0; oy < LateralSamples; ++oy) {
+                    Vector3f p(float(ox) / LateralSamples * spacing, float(oy) / LateralSamples * spacing, k / _invStep);
+                    for (int x = -n - 1; x <= n + 1; ++x) {
+                        for (int y = -n - 1; y <= n + 1; ++y) {
+                            accumulate(p, x, y, 0, planeMass, density, gradient);
+                        }
+                    }
+                }
+            }
+            _density[k] = float(density / sqr(LateralSamples));
+            _gradient[k] = float(gradient.z() / sqr(LateralSamples));
+        }
+        _density[TableSize] = 0.f;
+        _gradient[TableSize] = 0.f;
+
+        // The gradient of the layer vanishes at the face. Keep it at its peak closer to the face, so that
+        // particles pushed onto (or through) the face are still pushed back (PBF divides by the gradient).
+        int peak = int(std::min_element(_gradient.begin(), _gradient.end()) - _gradient.begin());
+        std::fill(_gradient.begin(), _gradient.begin() + peak, _gradient[peak]);
+
+        // Edge of planes x = 0 and y = 0 along the z axis (averaged over offsets along the edge),
+        // stored as the difference to the planes
+        std::vector<float> edgeMasses(sqr(extent + 1));
+        for (int x = 0; x <= extent; ++x) {
+            for (int y = 0; y <= extent; ++y) {
+                if (isBoundary(x, y, 1)) {
+                    edgeMasses[x * (extent + 1) + y] = computeMass(x, y, -1);
+                }
+            }
+        }
+        _edgeDensity.resize(sqr(EdgeTableSize + 1));
+        _edgeGradient.resize(sqr(EdgeTableSize + 1));
+        for (int a = 0; a <= EdgeTableSize; ++a) {
+            for (int b = 0; b <= EdgeTableSize; ++b) {
+                double density = 0.0;
+                Vector3d gradient(0.0);
+                for (int oz = 0; oz < LateralSamples; ++oz) {
+                    Vector3f p(a / _edgeScale, b / _edgeScale, float(oz) / LateralSamples * spacing);
+                    for (int x = 0; x <= extent; ++x) {
+                        for (int y = 0; y <= extent; ++y) {
+                            if (!isBoundary(x, y, 1)) {
+                                continue;
+                            }
+                            for (int z = -n - 1; z <= n + 1; ++z) {
+                                accumulate(p, x, y, z, edgeMasses[x * (extent + 1) + y], density, gradient);
+                            }
+                        }
+                    }
+                }
+                Vector3f p(a / _edgeScale, b / _edgeScale, 0.f);
+                density /= LateralSamples;
+                gradient /= LateralSamples;
+                _edgeDensity[a * (EdgeTableSize + 1) + b] = float(density) - planeLookup(_density, p.x()) - planeLookup(_density, p.y());
+                _edgeGradient[a * (EdgeTableSize + 1) + b] = float(gradient.x()) - planeLookup(_gradient, p.x());
+            }
+        }
+
+        // Corner of planes x = 0, y = 0 and z = 0, stored as the difference to the planes and edges
+        // (evaluated at the min. corner of the box, which is larger than the table range, see supports())
+        std::vector<float> cornerMasses(cube(extent + 1));
+        for (int x = 0; x <= extent; ++x) {
+            for (int y = 0; y <= extent; ++y) {
+                for (int z = 0; z <= extent; ++z) {
+                    if (isBoundary(x, y, z)) {
+                        cornerMasses[(x * (extent + 1) + y) * (extent + 1) + z] = computeMass(x, y, z);
+                    }
+                }
+            }
+        }
+        _cornerDensity.resize(cube(CornerTableSize + 1));
+        _cornerGradient.resize(cube(CornerTableSize + 1));
+        for (int a = 0; a <= CornerTableSize; ++a) {
+            for (int b = 0; b <= CornerTableSize; ++b) {
+                for (int c = 0; c <= CornerTableSize; ++c) {
+                    Vector3f p(a / _cornerScale, b / _cornerScale, c / _cornerScale);
+                    double density = 0.0;
+                    Vector3d gradient(0.0);
+                    for (int x = 0; x <= extent; ++x) {
+                        for (int y = 0; y <= extent; ++y) {
+                            for (int z = 0; z <= extent; ++z) {
+                                if (isBoundary(x, y, z)) {
+                                    accumulate(p, x, y, z, cornerMasses[(x * (extent + 1) + y) * (extent + 1) + z], density, gradient);
+                                }
+                            }
+                        }
+                    }
+                    size_t index = (a * (CornerTableSize + 1) + b) * (CornerTableSize + 1) + c;
+                    _cornerDensity[index] = float(density) - planeEdgeDensity(_box.min + p);
+                    _cornerGradient[index] = float(gradient.x()) - planeEdgeGradient(_box.min + p).x();
+                }
+            }
+        }
+    }
+
+    const Box3f &box() const { return _box; }
+
+    // Density contribution of the boundary at p
+    inline float density(const Vector3f &p) const {
+        float result = planeEdgeDensity(p);
+        iterateCorner(p, [&] (const Vector3f &d, const Vector3f &sign) {
+            result += cornerLookup(_cornerDensity, d.x(), d.y(), d.z());
+        });
+        return result;
+    }
+
+    // Density gradient contribution of the boundary at p
+    inline Vector3f gradient(const Vector3f &p) const {
+        Vector3f result = planeEdgeGradient(p);
+        iterateCorner(p, [&] (const Vector3f &d, const Vector3f &sign) {
+            // The corner is symmetric, gradient components are found by permuting the distances
+            result.x() += sign.x() * cornerLookup(_cornerGradient, d.x(), d.y(), d.z());
+            result.y() += sign.y() * cornerLookup(_cornerGradient, d.y(), d.x(), d.z());
+            result.z() += sign.z() * cornerLookup(_cornerGradient, d.z(), d.y(), d.x());
+        });
+        return result;
+    }
+
+private:
+    static const int TableSize = 64;        ///< Number of plane table intervals over the kernel support
+    static const int TableRange = 2;        ///< Edge and corner tables extend over two kernel supports
+    static const int EdgeTableSize = 64;    ///< Number of edge table intervals (per axis)
+    static const int CornerTableSize = 32;  ///< Number of corner table intervals (per axis)
+    static const int LateralSamples = 4;    ///< Number of lateral positions (per axis) averaged in the tables
+
+    // Distances to the closest faces (clamped to zero outside) and their inward normal directions
+    inline void closestFaces(const Vector3f &p, Vector3f &d, Vector3f &sign) const {
+        Vector3f dMin = (p - _box.min).cwiseMax(Vector3f(0.f));
+        Vector3f dMax = (_box.max - p).cwiseMax(Vector3f(0.f));
+        for (int axis = 0; axis < 3; ++axis) {
+            d[axis] = std::min(dMin[axis], dMax[axis]);
+            sign[axis] = dMin[axis] <= dMax[axis] ? 1.f : -1.f;
+        }
+    }
+
+    inline float planeEdgeDensity(const Vector3f &p) const {
+        Vector3f d, sign;
+        closestFaces(p, d, sign);
+        float result = 0.f;
+        for (int a = 0; a < 3; ++a) {
+            result += planeLookup(_density, d[a]);
+            for (int b = a + 1; b < 3; ++b) {
+                if (isEdge(d[a], d[b])) {
+                    result += edgeLookup(_edgeDensity, d[a], d[b]);
+                }
+            }
+        }
+        return result;
+    }
+
+    inline Vector3f planeEdgeGradient(const Vector3f &p) const {
+        Vector3f d, sign;
+        closestFaces(p, d, sign);
+        Vector3f result;
+        for (int a = 0; a < 3; ++a) {
+            result[a] += sign[a] * planeLookup(_gradient, d[a]);
+            for (int b = a + 1; b < 3; ++b) {
+                if (isEdge(d[a], d[b])) {
+                    result[a] += sign[a] * edgeLookup(_edgeGradient, d[a], d[b]);
+                    result[b] += sign[b] * edgeLookup(_edgeGradient, d[b], d[a]);
+                }
+            }
+        }
+        return result;
+    }
+
+    inline bool isEdge(float dA, float dB) const {
+        return std::min(dA, dB) < _h && std::max(dA, dB) < TableRange * _h;
+    }
+
+    // Calls func(d, sign) if p is within the range of the corner table of the closest corner
+    template<typename Func>
+    inline void iterateCorner(const Vector3f &p, Func func) const {
+        Vector3f d, sign;
+        closestFaces(p, d, sign);
+        if (d.minCoeff() < _h && d.maxCoeff() < TableRange * _h) {
+            func(d, sign);
+        }
+    }
+
+    inline float planeLookup(const std::vector<float> &table, float d) const {
+        float t = std::min(d * _invStep, float(TableSize));
+        int i = std::min(int(t), TableSize - 1);
+        float f = t - i;
+        return (1.f - f) * table[i] + f * table[i + 1];
+    }
+
+    inline float edgeLookup(const std::vector<float> &table, float dA, float dB) const {
+        const int N = EdgeTableSize;
+        float tA = std::min(dA * _edgeScale, float(N));
+        float tB = std::min(dB * _edgeScale, float(N));
+        int a = std::min(int(tA), N - 1);
+        int b = std::min(int(tB), N - 1);
+        float fA = tA - a;
+        float fB = tB - b;
+        const float *v = &table[a * (N + 1) + b];
+        return (1.f - fA) * ((1.f - fB) * v[0] + fB * v[1]) +
+               fA * ((1.f - fB) * v[N + 1] + fB * v[N + 2]);
+    }
+
+    inline float cornerLookup(const std::vector<float> &table, float dA, float dB, float dC) const {
+        const int N = CornerTableSize;
+        float tA = std::min(dA * _cornerScale, float(N));
+        float tB = std::min(dB * _cornerScale, float(N));
+        float tC = std::min(dC * _cornerScale, float(N));
+        int a = std::min(int(tA), N - 1);
+        int b = std::min(int(tB), N - 1);
+        int c = std::min(int(tC), N - 1);
+        float fA = tA - a;
+        float fB = tB - b;
+        float fC = tC - c;
+        const size_t strideA = sqr(N + 1);
+        const size_t strideB = N + 1;
+        const float *v = &table[a * strideA + b * strideB + c];
+        auto lerpC = [&] (const float *w) { return (1.f - fC) * w[0] + fC * w[1]; };
+        auto lerpB = [&] (const float *w) { return (1.f - fB) * lerpC(w) + fB * lerpC(w + strideB); };
+        return (1.f - fA) * lerpB(v) + fA * lerpB(v + strideA);
+    }
+
+    Box3f _box;
+    float _h = 0.f;
+    float _invStep = 0.f;
+    float _edgeScale = 0.f;
+    float _cornerScale = 0.f;
+    std::vector<float> _density;            ///< Plane density over the distance to the face
+    std::vector<float> _gradient;           ///< Plane density gradient (along the inward normal)
+    std::vector<float> _edgeDensity;        ///< Edge corrections over the distances to both faces
+    std::vector<float> _edgeGradient;       ///< (gradient along the normal of the first face)
+    std::vector<float> _cornerDensity;      ///< Corner corrections over the distances to all three faces
+    std::vector<float> _cornerGradient;     ///< (gradient along the normal of the first face)
+};
+
+} // namespace pbs
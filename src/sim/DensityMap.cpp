@@ -0,0 +1,126 @@
+#include "DensityMap.h"
+#include "Grid.h"
+
+#include "core/Timer.h"
+#include "core/Serialize.h"
+
+#include "geometry/SDF.h"
+
+namespace pbs {
+
+void DensityMap::build(const Mesh &mesh, const Kernel &kernel, float restDensity, float particleRadius, float cellSize) {
+    Timer timer;
+    DBG("Building density map ...");
+
+    // Signed distance field, sampled at half the particle radius (the quadrature resolution of the surface integral)
+    const float sampleSpacing = 0.5f * particleRadius;
+    const float bandWidth = 1.5f * sampleSpacing;
+    Box3f sdfBounds = mesh.computeBounds().expanded(2.f * bandWidth);
+    Vector3i sdfSize(
+        int(std::ceil(sdfBounds.extents().x() / sampleSpacing)) + 1,
+        int(std::ceil(sdfBounds.extents().y() / sampleSpacing)) + 1,
+        int(std::ceil(sdfBounds.extents().z() / sampleSpacing)) + 1
+    );
+    VoxelGrid<float> sdf(sdfSize);
+    sdf.setOrigin(sdfBounds.min);
+    sdf.setCellSize(sampleSpacing);
+    SDF::build(mesh, sdf, 2);
+
+    // Quadrature samples of the surface integral: SDF samples within the band around the surface, weighted by
+    // a smoothed delta function of the distance (the gradient of an SDF has unit length)
+    std::vector<Vector3f> positions;
+    std::vector<float> areas;
+    for (int z = 0; z < sdfSize.z(); ++z) {
+        for (int y = 0; y < sdfSize.y(); ++y) {
+            for (int x = 0; x < sdfSize.x(); ++x) {
+                float d = sdf(x, y, z);
+                if (std::abs(d) < bandWidth) {
+                    float delta = (0.5f / bandWidth) * (1.f + std::cos(float(M_PI) * d / bandWidth));
+                    positions.emplace_back(sdf.toWorldSpace(Vector3f(x, y, z)));
+                    areas.emplace_back(delta * cube(sampleSpacing));
+                }
+            }
+        }
+    }
+
+    Box3f particleBounds;
+    for (const auto &p : positions) {
+        particleBounds.expandBy(p);
+    }
+
+    Grid grid;
+    grid.init(particleBounds, kernel.h);
+    grid.update(positions, [&] (size_t i, size_t j) {
+        std::swap(positions[i], positions[j]);
+        std::swap(areas[i], areas[j]);
+    });
+
+    // Areal mass based on [4] equation 4 and 5 (same as SPH::updateBoundaryMasses), with the sum over neighbouring
+    // boundary particles replaced by the surface integral of the kernel around each sample
+    std::vector<float> masses(positions.size());
+    parallelForRange(0, positions.size(), 64, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            float weight = 0.f;
+            grid.lookup(positions[i], kernel.h, [&] (size_t j) {
+                float r2 = (positions[i] - positions[j]).squaredNorm();
+                if (r2 < kernel.h2) {
+                    weight += areas[j] * kernel.poly6(r2);
+                }
+                return true;
+            });
+            masses[i] = areas[i] * restDensity / (kernel.poly6Constant * weight);
+            masses[i] /= 1.17f;
+        }
+    });
+
+    // Map covers everything within the kernel support of the boundary particles
+    _bounds = particleBounds.expanded(kernel.h);
+    Vector3i size(
+        int(std::ceil(_bounds.extents().x() / cellSize)),
+        int(std::ceil(_bounds.extents().y() / cellSize)),
+        int(std::ceil(_bounds.extents().z() / cellSize))
+    );
+    _map.resize(size);
+    _map.setOrigin(_bounds.min);
+    _map.setCellSize(cellSize);
+
+    parallelForRange(0, size.z(), 1, [&] (const ParallelRange &range) {
+        for (int z = int(range.begin()); z < int(range.end()); ++z) {
+            for (int y = 0; y < size.y(); ++y) {
+                for (int x = 0; x < size.x(); ++x) {
+                    Vector3f p = _map.toWorldSpace(Vector3f(x + 0.5f, y + 0.5f, z + 0.5f));
+                    float density = 0.f;
+                    Vector3f gradient;
+                    grid.lookup(p, kernel.h, [&] (size_t j) {
+                        Vector3f r = p - positions[j];
+                        float r2 = r.squaredNorm();
+                        if (r2 < kernel.h2) {
+                            density += masses[j] * kernel.poly6(r2);
+                            if (r2 > 1e-10f) {
+                                gradient += masses[j] * kernel.spikyGrad(r, std::sqrt(r2));
+                            }
+                        }
+                        return true;
+                    });
+                    density *= kernel.poly6Constant;
+                    gradient *= kernel.spikyGradConstant;
+                    _map(x, y, z) = Vector4f(density, gradient.x(), gradient.y(), gradient.z());
+                }
+            }
+        }
+    });
+
+    DBG("Built density map: size = %s, cellSize = %f, memory = %.1f MB, took %s", size, cellSize, memoryUsage() / (1024.f * 1024.f), timer.elapsedString());
+}
+
+void DensityMap::write(std::ostream &os) const {
+    Serialize::write(os, _bounds);
+    _map.write(os);
+}
+
+void DensityMap::read(std::istream &is) {
+    Serialize::read(is, _bounds);
+    _map.read(is);
+}
+
+} // namespace pbs
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "Kernel.h"
+
+#include "core/Common.h"
+#include "core/Vector.h"
+#include "core/Box.h"
+
+#include "geometry/Mesh.h"
+#include "geometry/VoxelGrid.h"
+
+namespace pbs {
+
+// Boundary density map in the style of Koschier and Bender (Density Maps for Improved SPH Boundary Handling).
+// Stores the density sum_b m_b W(x - x_b) and density gradient sum_b m_b grad W(x - x_b) of a boundary on
+// a regular grid. The sums are evaluated as integrals over the mesh surface, taken directly from its signed
+// distance field: the layer of boundary particles the particle model uses (masses based on [4]) is replaced
+// by its areal mass, so both models match without sampling the surface with particles. Sampling the map
+// replaces the neighbour sums over the boundary particles by a single trilinear lookup.
+class DensityMap {
+public:
+    // particleRadius = radius of the boundary particles the map stands in for
+    void build(const Mesh &mesh, const Kernel &kernel, float restDensity, float particleRadius, float cellSize);
+
+    void write(std::ostream &os) const;
+    void read(std::istream &is);
+
+    const Box3f &bounds() const { return _bounds; }
+    size_t memoryUsage() const { return size_t(_map.size().prod()) * sizeof(Vector4f); }
+
+    // Density contribution at p
+    inline float density(const Vector3f &p) const {
+        return _bounds.contains(p) ? _map.trilinear(_map.toVoxelSpace(p)).x() : 0.f;
+    }
+
+    // Density gradient contribution at p
+    inline Vector3f gradient(const Vector3f &p) const {
+        if (!_bounds.contains(p)) {
+            return Vector3f(0.f);
+        }
+        Vector4f value = _map.trilinear(_map.toVoxelSpace(p));
+        return Vector3f(value.y(), value.z(), value.w());
+    }
+
+private:
+    Box3f _bounds;
+    VoxelGrid<Vector4f> _map;               ///< Density (x) and density gradient (yzw) at voxel centers
+};
+
+} // namespace pbs
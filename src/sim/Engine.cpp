@@ -35,7 +35,7 @@ Engine::Engine(NVGcontext *ctx, const Vector2i &size, const Vector2i &renderSize
     _framebuffer.init(_renderSize, 1);
 }
 
-void Engine::loadScene(const filesystem::path &path, const json11::Json &settings) {
+void Engine::loadScene(const filesystem::path &path, const json11::Json &settings, std::istream *checkpoint, const std::string &basename) {
     DBG("Loading scene from '%s' ...", path.str());
     _scene = Scene::load(path.str(), settings);
     DBG("%s", _scene.toString());
@@ -48,8 +48,8 @@ void Engine::loadScene(const filesystem::path &path, const json11::Json &setting
     _camera.setNear(_scene.camera.near);
     _camera.setFar(_scene.camera.far);
 
-    _sph.reset(new SPH(_scene));
-    std::string cachePath = FileUtils::splitExtension(path.str()).first + ".cache";
+    _sph.reset(new SPH(_scene, checkpoint));
+    std::string cachePath = (basename.empty() ? FileUtils::splitExtension(path.str()).first : basename) + ".cache";
     _cache.reset(new Cache(cachePath));
 
     _boundaryMeshPainters.clear();
@@ -58,6 +58,10 @@ void Engine::loadScene(const filesystem::path &path, const json11::Json &setting
     }
 }
 
+void Engine::writeCheckpoint(std::ostream &os) const {
+    _sph->writeCheckpoint(os);
+}
+
 void Engine::update(float dt) {
     _sph->update(dt);
 }
@@ -202,10 +206,10 @@ void Engine::renderDebugOverlay() {
         y += 20.f;
     };
 
-    auto drawProfilerItem = [&] (const std::string &name, double ms) {
+    auto drawProfilerItem = [&] (const std::string &name, double ms, double idle) {
         nvgFillColor(_ctx, nanogui::Color(255, 200));
         nvgText(_ctx, x, y, name.c_str(), nullptr);
-        nvgText(_ctx, x + t, y, tfm::format("%.1f ms", ms).c_str(), nullptr);
+        nvgText(_ctx, x + t, y, tfm::format("%.1f ms (idle %.1f ms)", ms, idle).c_str(), nullptr);
         y += 20.f;
     };
 
@@ -218,17 +222,21 @@ void Engine::renderDebugOverlay() {
 
     drawTitle("Profiler");
     double totalTime = 0.0;
+    double totalIdle = 0.0;
     for (const auto &item : Profiler::items()) {
-        drawProfilerItem(item.name, item.avg);
+        drawProfilerItem(item.name, item.avg, item.idle);
         totalTime += item.avg;
+        totalIdle += item.idle;
     }
-    drawProfilerItem("Total", totalTime);
+    drawProfilerItem("Total", totalTime, totalIdle);
 
     y += 20.f;
 
     drawTitle("Debug Monitor");
     for (const auto &item : DebugMonitor::items()) {
-        drawDebugMonitorItem(item);
+        if (item.active) {
+            drawDebugMonitorItem(item);
+        }
     }
 
     nvgEndFrame(_ctx);
@@ -13,6 +13,8 @@
 #include <json11.h>
 
 #include <memory>
+#include <istream>
+#include <ostream>
 
 namespace pbs {
 
@@ -42,7 +44,9 @@ public:
     const Cache &cache() const { return *_cache; }
           Cache &cache()       { return *_cache; }
 
-    void loadScene(const filesystem::path &path, const json11::Json &settings = json11::Json());
+    // The particle cache is written to <basename>.cache (basename defaults to the scene path without extension)
+    void loadScene(const filesystem::path &path, const json11::Json &settings = json11::Json(), std::istream *checkpoint = nullptr, const std::string &basename = std::string());
+    void writeCheckpoint(std::ostream &os) const;
 
     void update(float dt);
     void updateStep();
@@ -6,12 +6,14 @@
 #include "core/Morton.h"
 
 #include <vector>
+#include <algorithm>
 
 namespace pbs {
 
 class Grid {
 public:
-    void init(const Box3f &bounds, float cellSize) {
+    // Cells are linearized with slabAxis varying slowest, so particles sorted by update() are ordered along that axis
+    void init(const Box3f &bounds, float cellSize, int slabAxis = 2) {
         _bounds = bounds;
         _cellSize = cellSize;
         _invCellSize = 1.f / cellSize;
@@ -22,11 +24,24 @@ public:
             nextPowerOfTwo(int(std::floor(_bounds.extents().z() / _cellSize)) + 1)
         );
 
+        // Axes from fastest to slowest varying
+        _axes = slabAxis == 0 ? Vector3i(1, 2, 0) : slabAxis == 1 ? Vector3i(0, 2, 1) : Vector3i(0, 1, 2);
+        _strides[_axes[0]] = 1;
+        _strides[_axes[1]] = _size[_axes[0]];
+        _strides[_axes[2]] = _size[_axes[0]] * _size[_axes[1]];
+
         _cellOffset.resize(_size.prod() + 1);
+        _cellCount.resize(_size.prod());
+        _cellIndex.resize(_size.prod());
 
         DBG("Initialized grid: bounds = %s, cellSize = %f, size = %s", _bounds, _cellSize, _size);
     }
 
+    // Reserve scratch buffers for updates with up to count particles
+    void reserve(size_t count) {
+        _indices.reserve(count);
+    }
+
     inline Vector3i index(const Vector3f &pos) const {
         return Vector3i(
             int(std::floor((pos.x() - _bounds.min.x()) * _invCellSize)),
@@ -37,7 +52,7 @@ public:
 
     inline size_t indexLinear(const Vector3f &pos) const {
         Vector3i i = index(pos);
-        return i.z() * (_size.x() * _size.y()) + i.y() * _size.x() + i.x();
+        return i.x() * _strides.x() + i.y() * _strides.y() + i.z() * _strides.z();
     }
 
     inline uint32_t indexMorton(const Vector3i &index) const {
@@ -48,14 +63,17 @@ public:
         return indexMorton(index(pos));
     }
 
+    // Sort particles into cells (scratch buffers are kept between updates to avoid allocations)
     template<typename SwapFunc>
     void update(const std::vector<Vector3f> &positions, SwapFunc swap) {
-        std::vector<uint32_t> cellCount(_size.prod(), 0);
-        std::vector<uint32_t> cellIndex(_size.prod(), 0);
+        std::vector<uint32_t> &cellCount = _cellCount;
+        std::vector<uint32_t> &cellIndex = _cellIndex;
+        std::fill(cellCount.begin(), cellCount.end(), 0);
 
         size_t count = positions.size();
 
-        std::vector<uint32_t> indices(count);
+        std::vector<uint32_t> &indices = _indices;
+        indices.resize(count);
 
         // Update particle index and count number of particles per cell
         for (size_t i = 0; i < count; ++i) {
@@ -88,10 +106,12 @@ public:
     void lookup(const Vector3f &pos, float radius, Func func) const {
         Vector3i min = index(pos - Vector3f(radius)).cwiseMax(Vector3i(0));
         Vector3i max = index(pos + Vector3f(radius)).cwiseMin(_size - Vector3i(1));
-        for (int z = min.z(); z <= max.z(); ++z) {
-            for (int y = min.y(); y <= max.y(); ++y) {
-                for (int x = min.x(); x <= max.x(); ++x) {
-                    size_t i = z * (_size.x() * _size.y()) + y * _size.x() + x;
+        // Visit cells in memory order (slowest varying axis outermost)
+        const int a0 = _axes[0], a1 = _axes[1], a2 = _axes[2];
+        for (int c2 = min[a2]; c2 <= max[a2]; ++c2) {
+            for (int c1 = min[a1]; c1 <= max[a1]; ++c1) {
+                for (int c0 = min[a0]; c0 <= max[a0]; ++c0) {
+                    size_t i = c2 * _strides[a2] + c1 * _strides[a1] + c0 * _strides[a0];
                     for (size_t j = _cellOffset[i]; j < _cellOffset[i + 1]; ++j) {
                         if (!func(j)) { return; }
                     }
@@ -106,7 +126,12 @@ private:
     float _invCellSize;
 
     Vector3i _size;
+    Vector3i _axes;                         ///< Axes from fastest to slowest varying in the cell order
+    Vector3i _strides;                      ///< Cell index strides of each axis
     std::vector<size_t> _cellOffset;
+    std::vector<uint32_t> _cellCount;
+    std::vector<uint32_t> _cellIndex;
+    std::vector<uint32_t> _indices;
 };
 
 } // namespace pbs
@@ -0,0 +1,158 @@
+#include "KinematicBoundary.h"
+
+#include "core/Serialize.h"
+
+#include <Eigen/Geometry>
+
+namespace pbs {
+
+void KinematicBoundary::build(const ParticleGenerator::Boundary &boundary, const Scene::Motion &motion, const Kernel &kernel, float restDensity) {
+    _motion = motion;
+    _kernel = kernel;
+
+    _localPositions = boundary.positions;
+    _localBounds.reset();
+    for (const auto &p : _localPositions) {
+        _localBounds.expandBy(p);
+    }
+
+    _grid.init(_localBounds, kernel.h);
+    _grid.update(_localPositions, [&] (size_t i, size_t j) {
+        std::swap(_localPositions[i], _localPositions[j]);
+    });
+
+    // Compute the approximate mass of boundary particles based on [4] equation 4 and 5 (same as SPH::updateBoundaryMasses)
+    _masses.resize(_localPositions.size());
+    parallelForRange(0, _localPositions.size(), 64, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            float weight = 0.f;
+            _grid.lookup(_localPositions[i], kernel.h, [&] (size_t j) {
+                float r2 = (_localPositions[i] - _localPositions[j]).squaredNorm();
+                if (r2 < kernel.h2) {
+                    weight += kernel.poly6(r2);
+                }
+                return true;
+            });
+            _masses[i] = restDensity / (kernel.poly6Constant * weight);
+            _masses[i] /= 1.17f;
+        }
+    });
+
+    _positions.resize(_localPositions.size());
+    _velocities.resize(_localPositions.size());
+
+    _time = 0.f;
+    update(0.f);
+
+    DBG("Built kinematic boundary: particles = %d, keyframes = %d", _localPositions.size(), _motion.keyframes.size());
+}
+
+void KinematicBoundary::write(std::ostream &os) const {
+    Serialize::write(os, _motion.pivot);
+    Serialize::write(os, _motion.loop);
+    Serialize::writeVector(os, _motion.keyframes);
+    Serialize::write(os, _kernel.h);
+    Serialize::write(os, _localBounds);
+    Serialize::writeVector(os, _localPositions);
+    Serialize::writeVector(os, _positions);
+    Serialize::writeVector(os, _velocities);
+    Serialize::writeVector(os, _masses);
+    Serialize::write(os, _rotation);
+    Serialize::write(os, _translation);
+    Serialize::write(os, _bounds);
+    Serialize::write(os, _time);
+}
+
+// Local positions are stored in grid order, so rebuilding the grid does not reorder them
+void KinematicBoundary::read(std::istream &is) {
+    float h;
+    Serialize::read(is, _motion.pivot);
+    Serialize::read(is, _motion.loop);
+    Serialize::readVector(is, _motion.keyframes);
+    Serialize::read(is, h);
+    Serialize::read(is, _localBounds);
+    Serialize::readVector(is, _localPositions);
+    Serialize::readVector(is, _positions);
+    Serialize::readVector(is, _velocities);
+    Serialize::readVector(is, _masses);
+    Serialize::read(is, _rotation);
+    Serialize::read(is, _translation);
+    Serialize::read(is, _bounds);
+    Serialize::read(is, _time);
+
+    _kernel.init(h);
+    _grid.init(_localBounds, h);
+    _grid.update(_localPositions, [&] (size_t i, size_t j) {
+        std::swap(_localPositions[i], _localPositions[j]);
+    });
+}
+
+void KinematicBoundary::update(float time) {
+    Eigen::Matrix3f rotation;
+    Vector3f translation;
+    evaluate(time, rotation, translation);
+
+    float invTimeStep = time > _time ? 1.f / (time - _time) : 0.f;
+    parallelForRange(0, _localPositions.size(), 256, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            Vector3f p = rotation * _localPositions[i] + translation;
+            _velocities[i] = (p - _positions[i]) * invTimeStep;
+            _positions[i] = p;
+        }
+    });
+
+    _rotation = rotation;
+    _translation = translation;
+    _time = time;
+
+    // Transformed bounds of the local bounds
+    _bounds.reset();
+    for (int i = 0; i < 8; ++i) {
+        Vector3f corner(
+            (i & 1) ? _localBounds.max.x() : _localBounds.min.x(),
+            (i & 2) ? _localBounds.max.y() : _localBounds.min.y(),
+            (i & 4) ? _localBounds.max.z() : _localBounds.min.z()
+        );
+        _bounds.expandBy(Vector3f(rotation * corner + translation));
+    }
+    _bounds = _bounds.expanded(_kernel.h);
+}
+
+void KinematicBoundary::evaluate(float time, Eigen::Matrix3f &rotation, Vector3f &translation) const {
+    const auto &keyframes = _motion.keyframes;
+
+    // Interpolate translation and euler angles between the surrounding keyframes
+    Vector3f offset;
+    Vector3f angles;
+    if (!keyframes.empty()) {
+        float start = keyframes.front().time;
+        float duration = keyframes.back().time - start;
+        if (_motion.loop && duration > 0.f) {
+            time = start + std::fmod(std::max(time - start, 0.f), duration);
+        }
+        size_t next = std::upper_bound(keyframes.begin(), keyframes.end(), time, [] (float t, const Scene::Motion::Keyframe &keyframe) {
+            return t < keyframe.time;
+        }) - keyframes.begin();
+        if (next == 0 || next == keyframes.size()) {
+            const auto &keyframe = keyframes[next == 0 ? 0 : next - 1];
+            offset = keyframe.translation;
+            angles = keyframe.rotation;
+        } else {
+            const auto &a = keyframes[next - 1];
+            const auto &b = keyframes[next];
+            float t = (time - a.time) / std::max(b.time - a.time, 1e-6f);
+            offset = (1.f - t) * a.translation + t * b.translation;
+            angles = (1.f - t) * a.rotation + t * b.rotation;
+        }
+    }
+
+    angles *= float(M_PI) / 180.f;
+    rotation = (Eigen::AngleAxisf(angles.z(), Eigen::Vector3f::UnitZ()) *
+                Eigen::AngleAxisf(angles.y(), Eigen::Vector3f::UnitY()) *
+                Eigen::AngleAxisf(angles.x(), Eigen::Vector3f::UnitX())).toRotationMatrix();
+
+    // Rotate about the pivot, then translate
+    translation = _motion.pivot - rotation * _motion.pivot + offset;
+}
+
+} // namespace pbs
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "Scene.h"
+#include "Grid.h"
+#include "Kernel.h"
+
+#include "core/Common.h"
+#include "core/Vector.h"
+#include "core/Box.h"
+
+#include "geometry/ParticleGenerator.h"
+
+#include <vector>
+
+namespace pbs {
+
+// Boundary object following a rigid motion (e.g. a paddle or a gate).
+// Boundary particles, their masses [4] and the neighbour grid are built once in local space (the rest
+// pose of the shape). Moving the object only transforms its particles to world space. Neighbour
+// lookups transform the query point to local space and use the static grid. Contributions are added
+// like the other analytic boundaries (sum_b m_b W(x - x_b) and its gradient), so the solvers do not
+// need an extra particle loop.
+class KinematicBoundary {
+public:
+    void build(const ParticleGenerator::Boundary &boundary, const Scene::Motion &motion, const Kernel &kernel, float restDensity);
+
+    void write(std::ostream &os) const;
+    void read(std::istream &is);
+
+    // Move the object to its pose at the given time, particle velocities are derived from the last pose
+    void update(float time);
+
+    const std::vector<Vector3f> &positions() const { return _positions; }
+    const std::vector<Vector3f> &velocities() const { return _velocities; }
+
+    // World space bounds of the particles expanded by the kernel support
+    const Box3f &bounds() const { return _bounds; }
+
+    // Density contribution at p
+    inline float density(const Vector3f &p) const {
+        float density = 0.f;
+        iterateNeighbours(p, [&] (size_t j, const Vector3f &r, float r2) {
+            density += _masses[j] * _kernel.poly6(r2);
+        });
+        return _kernel.poly6Constant * density;
+    }
+
+    // Density gradient contribution at p
+    inline Vector3f gradient(const Vector3f &p) const {
+        Vector3f gradient;
+        iterateNeighbours(p, [&] (size_t j, const Vector3f &r, float r2) {
+            if (r2 > 1e-10f) {
+                gradient += _masses[j] * _kernel.spikyGrad(r, std::sqrt(r2));
+            }
+        });
+        return _kernel.spikyGradConstant * gradient;
+    }
+
+    // Rate of density change at p for a particle moving with velocity v (relative to the boundary particles)
+    inline float densityChange(const Vector3f &p, const Vector3f &v) const {
+        float change = 0.f;
+        iterateNeighbours(p, [&] (size_t j, const Vector3f &r, float r2) {
+            if (r2 > 1e-10f) {
+                change += _masses[j] * (v - _velocities[j]).dot(_kernel.spikyGrad(r, std::sqrt(r2)));
+            }
+        });
+        return _kernel.spikyGradConstant * change;
+    }
+
+private:
+    template<typename Func>
+    inline void iterateNeighbours(const Vector3f &p, Func func) const {
+        if (!_bounds.contains(p)) {
+            return;
+        }
+        Vector3f local = _rotation.transpose() * (p - _translation);
+        _grid.lookup(local, _kernel.h, [&] (size_t j) {
+            Vector3f r = p - _positions[j];
+            float r2 = r.squaredNorm();
+            if (r2 < _kernel.h2) {
+                func(j, r, r2);
+            }
+            return true;
+        });
+    }
+
+    // Transform of the motion at the given time (world = rotation * local + translation)
+    void evaluate(float time, Eigen::Matrix3f &rotation, Vector3f &translation) const;
+
+    Scene::Motion _motion;
+    Kernel _kernel;
+    Grid _grid;                             ///< Neighbour grid in local space
+    Box3f _localBounds;
+    Box3f _bounds;
+    std::vector<Vector3f> _localPositions;
+    std::vector<Vector3f> _positions;       ///< World space positions
+    std::vector<Vector3f> _velocities;
+    std::vector<float> _masses;
+    Eigen::Matrix3f _rotation = Eigen::Matrix3f::Identity();
+    Vector3f _translation;
+    float _time = 0.f;
+};
+
+} // namespace pbs
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "core/Common.h"
+
+#include <vector>
+#include <algorithm>
+
+namespace pbs {
+
+// Slot allocator for particle buffers of a fixed capacity.
+// Slots [0, size) are in use by the particle buffers. Released slots are put on a free list and
+// handed out again by allocate() before the buffers grow. compact() moves particles from the end
+// of the buffers into the remaining free slots, so that live particles occupy [0, size) again.
+// All bookkeeping is reserved for the full capacity, so the pool never allocates after init().
+class ParticlePool {
+public:
+    void init(size_t size, size_t capacity) {
+        _capacity = std::max(size, capacity);
+        _size = size;
+        _free.assign(_capacity, 0);
+        _freeList.clear();
+        _freeList.reserve(_capacity);
+        _holes.clear();
+        _holes.reserve(_capacity);
+        _sources.clear();
+        _sources.reserve(_capacity);
+    }
+
+    size_t size() const { return _size; }
+    size_t capacity() const { return _capacity; }
+    size_t freeCount() const { return _freeList.size(); }
+    size_t liveCount() const { return _size - _freeList.size(); }
+    bool full() const { return liveCount() >= _capacity; }
+
+    // Returns a slot for a new particle (reuses released slots first, size() grows otherwise)
+    size_t allocate() {
+        if (!_freeList.empty()) {
+            size_t i = _freeList.back();
+            _freeList.pop_back();
+            _free[i] = 0;
+            return i;
+        }
+        ASSERT(_size < _capacity, "Particle pool exhausted (capacity = %d)", _capacity);
+        return _size++;
+    }
+
+    // Release the slot of a removed particle
+    void release(size_t i) {
+        if (!_free[i]) {
+            _free[i] = 1;
+            _freeList.push_back(i);
+        }
+    }
+
+    bool isFree(size_t i) const { return _free[i] != 0; }
+
+    // Fill free slots with particles from the end of the buffers, calling move(dst, src) in parallel.
+    // Returns the new size, buffers have to be shrunk to it afterwards.
+    template<typename MoveFunc>
+    size_t compact(MoveFunc move) {
+        size_t newSize = liveCount();
+
+        // Free slots below the new size are filled by live particles above it (same number of both)
+        _holes.clear();
+        for (size_t i : _freeList) {
+            if (i < newSize) {
+                _holes.push_back(i);
+            }
+        }
+        _sources.clear();
+        for (size_t i = newSize; i < _size; ++i) {
+            if (!_free[i]) {
+                _sources.push_back(i);
+            }
+        }
+
+        parallelForRange(0, _holes.size(), 256, [&] (const ParallelRange &range) {
+            for (size_t k = range.begin(); k < range.end(); ++k) {
+                move(_holes[k], _sources[k]);
+            }
+        });
+
+        for (size_t i : _freeList) {
+            _free[i] = 0;
+        }
+        _freeList.clear();
+        _size = newSize;
+        return _size;
+    }
+
+private:
+    size_t _capacity = 0;
+    size_t _size = 0;
+    std::vector<char> _free;                ///< Flags of released slots
+    std::vector<size_t> _freeList;
+    std::vector<size_t> _holes;
+    std::vector<size_t> _sources;
+};
+
+} // namespace pbs
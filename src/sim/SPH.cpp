@@ -1,17 +1,30 @@
 #include "SPH.h"
 
 #include "core/DebugMonitor.h"
+#include "core/Serialize.h"
 
 #include <tbb/enumerable_thread_specific.h>
 
+#include <numeric>
+
 // [1] Weakly compressible SPH for free surface flows
 // [2] Predictive-Corrective Incompressible SPH
 // [3] Versatile Surface Tension and Adhesion for SPH Fluids
 // [4] Versatile Rigid-Fluid Coupling for Incompressible SPH
+// [5] Divergence-Free Smoothed Particle Hydrodynamics
+// [6] Position Based Fluids
+// [7] A Physically Consistent Implicit Viscosity Solver for SPH Fluids
+// [8] Adaptively Sampled Particle Fluids
 
 namespace pbs {
 
-#define HANDLE_BOUNDARIES 1
+// Instantiations of a solver pass for all feature sets (indexed by the feature bits)
+#define FEATURE_PASSES(pass) { \
+    &SPH::pass<0>, &SPH::pass<1>, &SPH::pass<2>, &SPH::pass<3>, \
+    &SPH::pass<4>, &SPH::pass<5>, &SPH::pass<6>, &SPH::pass<7>, \
+    &SPH::pass<8>, &SPH::pass<9>, &SPH::pass<10>, &SPH::pass<11>, \
+    &SPH::pass<12>, &SPH::pass<13>, &SPH::pass<14>, &SPH::pass<15> \
+}
 
 
 template<typename T>
@@ -21,7 +34,26 @@ static void dumpVector(const std::vector<T> &v) {
     }
 }
 
-SPH::SPH(const Scene &scene) {
+// Reset all thread-local values of a persistent reduction
+template<typename T>
+static tbb::enumerable_thread_specific<T> &resetReduction(tbb::enumerable_thread_specific<T> &reduction, const T &value) {
+    for (auto &v : reduction) {
+        v = value;
+    }
+    return reduction;
+}
+
+SPH::SPH(const Scene &scene, std::istream *checkpoint, std::shared_ptr<Boundary> boundary) :
+    _boundary(boundary ? boundary : std::make_shared<Boundary>()),
+    _boundaryPositions(_boundary->positions),
+    _boundaryNormals(_boundary->normals),
+    _boundaryMasses(_boundary->masses),
+    _boundaryGrid(_boundary->grid),
+    _boundaryMeshes(_boundary->meshes)
+{
+    ParallelBusyTimeScope busyTimeScope(&_busyTime);
+    Timer startupTimer;
+
     // Load scene settings
     _method = stringToMethod(scene.settings.getString("method", "pcisph"));
     _particleRadius = scene.settings.getFloat("particleRadius", _particleRadius);
@@ -32,6 +64,114 @@ SPH::SPH(const Scene &scene) {
     _timeStep = scene.settings.getFloat("timeStep", _timeStep);
     _compressionThreshold = scene.settings.getFloat("compressionThreshold", _compressionThreshold);
 
+    // Deterministic mode makes results independent of the thread schedule (e.g. for bit-comparing caches)
+    _deterministic = scene.settings.getBool("deterministic", _deterministic);
+    DeterministicScope deterministicScope(_deterministic);
+
+    surface.enabled = scene.settings.getBool("surfaceClassification", surface.enabled);
+    surface.threshold = scene.settings.getFloat("surfaceThreshold", surface.threshold);
+
+    implicitViscosity.enabled = scene.settings.getBool("implicitViscosity", implicitViscosity.enabled);
+    implicitViscosity.maxIterations = scene.settings.getInteger("viscosityIterations", implicitViscosity.maxIterations);
+    implicitViscosity.tolerance = scene.settings.getFloat("viscosityTolerance", implicitViscosity.tolerance);
+
+    sleeping.enabled = scene.settings.getBool("sleeping", sleeping.enabled);
+    sleeping.distance = scene.settings.getFloat("sleepDistance", sleeping.distance);
+    sleeping.densityError = scene.settings.getFloat("sleepDensityError", sleeping.densityError);
+    sleeping.steps = scene.settings.getInteger("sleepSteps", sleeping.steps);
+
+    shock.rollbackSteps = scene.settings.getInteger("shockRollbackSteps", shock.rollbackSteps);
+    shock.compressSnapshots = scene.settings.getBool("compressSnapshots", shock.compressSnapshots);
+
+    taskGraph.enabled = scene.settings.getBool("taskGraph", taskGraph.enabled);
+
+    domains.count = scene.settings.getInteger("domains", domains.count);
+
+    std::string worldBoundaryModel = scene.settings.getString("worldBoundary", "particles");
+    if (worldBoundaryModel != "particles" && worldBoundaryModel != "planes") {
+        throw Exception("Unknown world boundary '%s'", worldBoundaryModel);
+    }
+    worldBoundary.analytic = worldBoundaryModel == "planes";
+
+    std::string meshBoundaryModel = scene.settings.getString("meshBoundary", "particles");
+    if (meshBoundaryModel != "particles" && meshBoundaryModel != "densityMap") {
+        throw Exception("Unknown mesh boundary '%s'", meshBoundaryModel);
+    }
+    densityMaps.enabled = meshBoundaryModel == "densityMap";
+    densityMaps.cellSize = scene.settings.getFloat("densityMapCellSize", _particleRadius);
+
+    boundaryCulling.enabled = scene.settings.getBool("cullBoundary", boundaryCulling.enabled);
+
+    std::string initialRelaxation = scene.settings.getString("initialRelaxation", "fast");
+    if (initialRelaxation == "none") {
+        startup.relaxation = RelaxNone;
+    } else if (initialRelaxation == "fast") {
+        startup.relaxation = RelaxFast;
+    } else if (initialRelaxation == "solver") {
+        startup.relaxation = RelaxSolver;
+    } else {
+        throw Exception("Unknown initial relaxation '%s'", initialRelaxation);
+    }
+    startup.maxIterations = scene.settings.getInteger("relaxationIterations", startup.maxIterations);
+
+    std::string attributePrecision = scene.settings.getString("attributePrecision", "fp32");
+    if (attributePrecision == "fp16" || attributePrecision == "bf16") {
+        precision.enabled = true;
+        precision.format = attributePrecision == "fp16" ? Float16 : BFloat16;
+    } else if (attributePrecision != "fp32") {
+        throw Exception("Unknown attribute precision '%s'", attributePrecision);
+    }
+    precision.densities.setFormat(precision.format);
+    precision.pressures.setFormat(precision.format);
+    precision.normals.setFormat(precision.format);
+
+    multiRate.enabled = scene.settings.getBool("multiRate", multiRate.enabled);
+    multiRate.maxLevel = scene.settings.getInteger("multiRateMaxLevel", multiRate.maxLevel);
+
+    emission.sinkInterval = std::max(1, scene.settings.getInteger("sinkInterval", emission.sinkInterval));
+
+    adaptive.enabled = scene.settings.getBool("adaptive", adaptive.enabled);
+    adaptive.maxLevel = scene.settings.getInteger("adaptiveMaxLevel", adaptive.maxLevel);
+    adaptive.interval = scene.settings.getInteger("adaptiveInterval", adaptive.interval);
+    adaptive.bandWidth = scene.settings.getInteger("adaptiveBandWidth", adaptive.bandWidth);
+    adaptive.surfaceThreshold = scene.settings.getFloat("adaptiveSurfaceThreshold", adaptive.surfaceThreshold);
+
+    dfsph.cflFactor = scene.settings.getFloat("cflFactor", dfsph.cflFactor);
+    dfsph.maxTimeStep = scene.settings.getFloat("maxTimeStep", dfsph.maxTimeStep);
+    dfsph.maxDensityError = scene.settings.getFloat("maxDensityError", dfsph.maxDensityError);
+    dfsph.maxDivergenceError = scene.settings.getFloat("maxDivergenceError", dfsph.maxDivergenceError);
+    dfsph.warmStart = scene.settings.getBool("warmStart", dfsph.warmStart);
+
+    pbf.timeStep = scene.settings.getFloat("pbfTimeStep", pbf.timeStep);
+    pbf.iterations = scene.settings.getInteger("pbfIterations", pbf.iterations);
+    pbf.relaxation = scene.settings.getFloat("pbfRelaxation", pbf.relaxation);
+    pbf.tensileStrength = scene.settings.getFloat("pbfTensileStrength", pbf.tensileStrength);
+    pbf.tensileDistance = scene.settings.getFloat("pbfTensileDistance", pbf.tensileDistance);
+
+    // Coarse preview: scale the particle size and rescale the parameters depending on it, so the scene keeps its
+    // macroscopic behaviour with 1/scale^3 of the particles. The particle mass follows from the radius and time
+    // steps scale with the particle size (CFL condition). Cohesion and curvature accelerations [5] do not depend
+    // on the particle size, but there are fewer surface particles per area, so surface tension is divided by the
+    // scale. The viscosity force of PCISPH, DFSPH and PBF (and the implicit solve) approximates mu / rho * laplace(v)
+    // and is kept, while WCSPH computes mu / m * laplace(v), so viscosity is scaled with the particle mass.
+    preview.scale = scene.settings.getFloat("previewScale", preview.scale);
+    if (preview.scale <= 0.f) {
+        throw Exception("Invalid preview scale %f", preview.scale);
+    }
+    if (preview.scale != 1.f) {
+        _particleRadius *= preview.scale;
+        _timeStep *= preview.scale;
+        _surfaceTension /= preview.scale;
+        if (_method == WCSPH) {
+            _viscosity *= cube(preview.scale);
+        }
+        densityMaps.cellSize *= preview.scale;
+        dfsph.minTimeStep *= preview.scale;
+        dfsph.maxTimeStep *= preview.scale;
+        pbf.timeStep *= preview.scale;
+        pbf.relaxation /= sqr(preview.scale);
+    }
+
     // Compute derived constants
     _particleRadius2 = sqr(_particleRadius2);
     _particleDiameter = 2.f * _particleRadius;
@@ -61,37 +201,156 @@ SPH::SPH(const Scene &scene) {
     _parameters.particleMass = _particleMass;
     _parameters.restDensity = _restDensity;
 
-    buildScene(scene);
+    // Kernel is needed to build density maps
+    _kernel.init(_kernelRadius);
+
+    if (worldBoundary.analytic && !BoundaryPlanes::supports(scene.world.bounds.expanded(_particleRadius), _kernel)) {
+        DBG("worldBoundary = planes requires a world box of at least 4 kernel radii per axis, using particles");
+        worldBoundary.analytic = false;
+    }
+
+    // Static boundary data is shared with instances using the same boundary settings
+    startup.sharedBoundary = boundary != nullptr;
+    if (startup.sharedBoundary) {
+        if (checkpoint) {
+            throw Exception("Cannot restore a checkpoint with a shared boundary");
+        }
+        if (_boundary->particleRadius != _particleRadius || _boundary->restDensity != _restDensity ||
+            _boundary->analyticWorld != worldBoundary.analytic || _boundary->meshDensityMaps != densityMaps.enabled ||
+            _boundary->densityMapCellSize != densityMaps.cellSize || _boundary->culling != boundaryCulling.enabled) {
+            throw Exception("Shared boundary does not match the scene settings (particleRadius = %f, restDensity = %f, worldBoundary = %s, meshBoundary = %s)",
+                            _boundary->particleRadius, _boundary->restDensity, _boundary->analyticWorld ? "planes" : "particles", _boundary->meshDensityMaps ? "densityMap" : "particles");
+        }
+    } else {
+        _boundary->particleRadius = _particleRadius;
+        _boundary->restDensity = _restDensity;
+        _boundary->analyticWorld = worldBoundary.analytic;
+        _boundary->meshDensityMaps = densityMaps.enabled;
+        _boundary->densityMapCellSize = densityMaps.cellSize;
+        _boundary->culling = boundaryCulling.enabled;
+    }
+
+    if (checkpoint) {
+        restoreScene(*checkpoint);
+    } else {
+        buildScene(scene, !startup.sharedBoundary);
+        if (boundaryCulling.enabled && !startup.sharedBoundary) {
+            cullBoundaryParticles(scene);
+        }
+    }
 
     // Compute bounds
     _bounds.reset();
     for (const auto &p : _boundaryPositions) {
         _bounds.expandBy(p);
     }
+    if (worldBoundary.analytic) {
+        // Planes lie where the world box particles would be
+        _bounds.expandBy(scene.world.bounds.expanded(_particleRadius));
+    }
+
+    emissionInit(scene);
+    if (checkpoint) {
+        restoreState(*checkpoint);
+    }
+
+    // Adaptive resolution changes the number of particles and is only supported by DFSPH
+    if (adaptive.enabled && (_method != DFSPH || implicitViscosity.enabled)) {
+        DBG("adaptive resolution requires the DFSPH solver without implicit viscosity, disabling");
+        adaptive.enabled = false;
+    }
+    if (adaptive.enabled && emission.enabled) {
+        DBG("adaptive resolution does not support emitters and sinks, disabling");
+        adaptive.enabled = false;
+    }
+    if (!adaptive.enabled) {
+        adaptive.maxLevel = 0;
+    }
+
+    // Reduced precision attributes are only supported by PCISPH
+    if (precision.enabled && _method != PCISPH) {
+        DBG("reduced precision attributes require the PCISPH solver, disabling");
+        precision.enabled = false;
+    }
+    // Software half float conversion costs more than the memory traffic it saves
+    if (precision.enabled && precision.format == Float16 && !HALF_F16C) {
+        DBG("fp16 attributes require a build with F16C (USE_F16C), disabling");
+        precision.enabled = false;
+    }
+
+    // Multi-rate time stepping is only supported by PCISPH
+    if (multiRate.enabled && _method != PCISPH) {
+        DBG("multi-rate time stepping requires the PCISPH solver, disabling");
+        multiRate.enabled = false;
+    }
+    if (multiRate.enabled) {
+        multiRate.maxLevel = std::max(0, std::min(multiRate.maxLevel, 8));
+    }
+
+    // Domain decomposition: fluid loops are split into slabs along the longest axis, each run in an arena
+    // pinned to its own CPUs (the task graph would run fluid phases outside of the arenas)
+    if (domains.count != 0) {
+        domains.arenas.reset(new DomainArenas(std::max(0, domains.count)));
+        domains.axis = _bounds.largestAxis();
+        _fluidPartitioner.useDomains(domains.arenas.get());
+        if (taskGraph.enabled) {
+            DBG("domain decomposition does not support the task graph, disabling");
+            taskGraph.enabled = false;
+        }
+    }
 
-    _fluidVelocities.resize(_fluidPositions.size());
-    _fluidPositionsNew.resize(_fluidPositions.size());
-    _fluidVelocitiesNew.resize(_fluidPositions.size());
-    _fluidPositionsPreShock.resize(_fluidPositions.size());
-    _fluidPositionsPreShock.resize(_fluidPositions.size());
-    _fluidNormals.resize(_fluidPositions.size());
-    _fluidForces.resize(_fluidPositions.size());
-    _fluidPressureForces.resize(_fluidPositions.size());
-    _fluidDensities.resize(_fluidPositions.size());
-    _fluidPressures.resize(_fluidPositions.size());
+    resizeFluidParticles(_fluidPositions.size());
+    if (emission.enabled) {
+        reserveFluidParticles(emission.pool.capacity());
+    }
+    // Splitting can at most restore all particles of the base level (particles may already be merged
+    // when resuming from a checkpoint), reserve for them so that resampling does not allocate
+    if (adaptive.enabled) {
+        double mass = std::accumulate(_fluidMasses.begin(), _fluidMasses.end(), 0.0);
+        adaptive.capacity = size_t(std::llround(mass * _invParticleMass));
+        reserveFluidParticles(adaptive.capacity);
+    }
+    placeFluidParticles();
 
     _boundaryDensities.resize(_boundaryPositions.size());
     _boundaryPressures.resize(_boundaryPositions.size());
-    _boundaryMasses.resize(_boundaryPositions.size());
     _boundaryActive.resize(_boundaryPositions.size());
 
-    _kernel.init(_kernelRadius);
-    _fluidGrid.init(_bounds, _kernelRadius);
-    _boundaryGrid.init(_bounds, _kernelRadius);
+    if (worldBoundary.analytic) {
+        worldBoundary.planes.init(scene.world.bounds.expanded(_particleRadius), _kernel, _particleDiameter, _restDensity);
+    }
+    _levelKernels.resize(adaptive.maxLevel + 1);
+    for (int level = 0; level <= adaptive.maxLevel; ++level) {
+        // Doubling the mass scales the particle radius (and kernel support) by 2^(1/3)
+        _levelKernels[level].init(_kernelRadius * std::pow(2.f, level / 3.f));
+    }
+    _fluidGrid.init(_bounds, _kernelRadius, domains.axis);
+
+    // Preprocessing (a shared boundary is already sorted into its grid)
+    if (!startup.sharedBoundary) {
+        _boundaryMasses.resize(_boundaryPositions.size());
+        _boundaryGrid.init(_bounds, _kernelRadius);
+        updateBoundaryGrid();
+        updateBoundaryMasses();
+    }
+
+    // Select the solver passes specialized on the enabled physics (viscosity is handled separately
+    // by the implicit solver, which WCSPH does not use)
+    _features = 0;
+    if (_surfaceTension != 0.f) {
+        _features |= FeatureSurfaceTension;
+    }
+    if (_viscosity != 0.f && (!implicitViscosity.enabled || _method == WCSPH)) {
+        _features |= FeatureViscosity;
+    }
+    if (!_boundaryPositions.empty() || hasAnalyticBoundary()) {
+        _features |= FeatureBoundaries;
+    }
+    if (precision.enabled) {
+        _features |= FeatureReducedPrecision;
+    }
 
-    // Preprocessing
-    updateBoundaryGrid();
-    updateBoundaryMasses();
+    startup.buildTime = startupTimer.lap();
 
     DBG("method = %s", methodToString(_method));
     DBG("particleRadius = %f", _particleRadius);
@@ -102,7 +361,26 @@ SPH::SPH(const Scene &scene) {
     DBG("gravity = %s", _gravity);
     DBG("surfaceTension = %f", _surfaceTension);
     DBG("viscosity = %f", _viscosity);
+    DBG("surfaceClassification = %d", surface.enabled);
+    DBG("surfaceThreshold = %f", surface.threshold);
+    DBG("implicitViscosity = %d", implicitViscosity.enabled);
+    DBG("sleeping = %d", sleeping.enabled);
+    DBG("adaptive = %d", adaptive.enabled);
+    DBG("multiRate = %d", multiRate.enabled);
+    DBG("taskGraph = %d", taskGraph.enabled);
+    DBG("domains = %d", domains.arenas ? domains.arenas->count() : 0);
+    DBG("features = %s%s%s%s", _features & FeatureSurfaceTension ? "surfaceTension " : "", _features & FeatureViscosity ? "viscosity " : "", _features & FeatureBoundaries ? "boundaries " : "", _features & FeatureReducedPrecision ? "reducedPrecision" : "");
+    DBG("worldBoundary = %s", worldBoundary.analytic ? "planes" : "particles");
+    DBG("meshBoundary = %s", densityMaps.enabled ? "densityMap" : "particles");
+    DBG("densityMapCellSize = %f", densityMaps.cellSize);
+    DBG("initialRelaxation = %s", initialRelaxation);
+    DBG("relaxationIterations = %d", startup.maxIterations);
+    DBG("cullBoundary = %s", boundaryCulling.enabled);
+    DBG("sharedBoundary = %d", startup.sharedBoundary);
+    DBG("attributePrecision = %s", precision.enabled ? (precision.format == Float16 ? "fp16" : "bf16") : "fp32");
     DBG("timeStep = %f", _timeStep);
+    DBG("previewScale = %f", preview.scale);
+    DBG("deterministic = %d", _deterministic);
 
     DBG("wcsph.gamma = %f", wcsph.gamma);
     DBG("wcsph.cs = %f", wcsph.cs);
@@ -110,14 +388,47 @@ SPH::SPH(const Scene &scene) {
     DBG("wcsph.viscosity = %f", wcsph.viscosity);
     DBG("wcsph.dt = %f", wcsph.dt);
 
+    DBG("dfsph.cflFactor = %f", dfsph.cflFactor);
+    DBG("dfsph.maxTimeStep = %f", dfsph.maxTimeStep);
+    DBG("dfsph.maxDensityError = %f", dfsph.maxDensityError);
+    DBG("dfsph.maxDivergenceError = %f", dfsph.maxDivergenceError);
+    DBG("dfsph.warmStart = %d", dfsph.warmStart);
+
+    DBG("adaptive.maxLevel = %d", adaptive.maxLevel);
+    DBG("adaptive.interval = %d", adaptive.interval);
+    DBG("adaptive.bandWidth = %d", adaptive.bandWidth);
+
+    DBG("multiRate.maxLevel = %d", multiRate.maxLevel);
+
+    DBG("emission.emitters = %d", emission.emitters.size());
+    DBG("emission.sinks = %d", emission.sinks.size());
+    DBG("emission.sinkInterval = %d", emission.sinkInterval);
+    DBG("emission.maxParticles = %d", emission.pool.capacity());
+
+    DBG("pbf.timeStep = %f", pbf.timeStep);
+    DBG("pbf.iterations = %d", pbf.iterations);
+    DBG("pbf.relaxation = %f", pbf.relaxation);
+    DBG("pbf.tensileStrength = %f", pbf.tensileStrength);
+    DBG("pbf.tensileDistance = %f", pbf.tensileDistance);
+
+    if (domains.arenas) {
+        DBG("domains.axis = %d", domains.axis);
+        DBG("domains.slabs =\n%s", domains.arenas->toString());
+    }
+
     DBG("# particles = %d", _fluidPositions.size());
     DBG("# boundary particles = %d", _boundaryPositions.size());
+    DBG("# kinematic boundaries = %d", kinematics.objects.size());
 
     DBG("Initializing simulation ...");
     switch (_method) {
     case WCSPH: wcsphInit(); break;
     case PCISPH: pcisphInit(); break;
+    case DFSPH: dfsphInit(); break;
+    case PBF: pbfInit(); break;
     }
+
+    DBG("Startup took %s (scene build %s, relaxation %s)", timeString(startup.buildTime + startupTimer.elapsed()), timeString(startup.buildTime), timeString(startup.relaxationTime));
 }
 
 void SPH::reset() {
@@ -132,17 +443,48 @@ void SPH::update(float dt) {
 }
 
 void SPH::updateStep() {
+    ParallelBusyTimeScope busyTimeScope(&_busyTime);
+    DeterministicScope deterministicScope(_deterministic);
+    size_t allocations = allocationCount();
+
+    if (emission.enabled) {
+        Profiler::profile("Emitters/Sinks", [&] () {
+            updateEmission();
+        });
+    }
+
+    if (!kinematics.objects.empty()) {
+        Profiler::profile("Kinematic Boundaries", [&] () {
+            updateKinematicBoundaries();
+        });
+    }
+
     switch (_method) {
     case WCSPH: wcsphUpdate(); break;
     case PCISPH: pcisphUpdate(); break;
+    case DFSPH: dfsphUpdate(); break;
+    case PBF: pbfUpdate(); break;
+    }
+
+    if (emission.enabled) {
+        DebugMonitor::addItem("emittedParticles", "%d", emission.emitted);
+        DebugMonitor::addItem("removedParticles", "%d", emission.removed);
+        DebugMonitor::addItem("particlePool", "%.1f%%%s", 100.f * _fluidPositions.size() / std::max(size_t(1), emission.pool.capacity()), emission.poolFull ? " (full)" : "");
+    }
+
+    // All buffers are persistent, steps must not allocate memory after warm-up
+    if (++_steps > WarmupSteps && allocationChecks()) {
+        ASSERT(allocationCount() == allocations, "Step %d performed %d heap allocations", _steps, allocationCount() - allocations);
     }
 }
 
 // Activate all boundary particles that are nearby fluid particles
 void SPH::activateBoundaryParticles() {
-    parallelFor(_boundaryPositions.size(), [this] (size_t i) {
-        _boundaryActive[i] = hasNeighbours(_fluidGrid, _fluidPositions, _boundaryPositions[i]);
-    });
+    parallelForRange(0, _boundaryPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            _boundaryActive[i] = hasNeighbours(_fluidGrid, _fluidPositions, _boundaryPositions[i]);
+        }
+    }, _boundaryPartitioner);
 }
 
 void SPH::updateBoundaryGrid() {
@@ -152,247 +494,471 @@ void SPH::updateBoundaryGrid() {
     });
 }
 
+// Move kinematic boundaries to their pose at the current time
+void SPH::updateKinematicBoundaries() {
+    for (auto &object : kinematics.objects) {
+        object.update(_time);
+    }
+}
+
 // Compute the approximate mass of boundary particles based on [4] equation 4 and 5
 void SPH::updateBoundaryMasses() {
-    parallelFor(_boundaryPositions.size(), [this] (size_t i) {
-        float weight = 0.f;
-        iterateNeighbours(_boundaryGrid, _boundaryPositions, _boundaryPositions[i], [this, &weight] (size_t j, const Vector3f &r, float r2) {
-            weight += _kernel.poly6(r2);
-        });
-        _boundaryMasses[i] = _restDensity / (_kernel.poly6Constant * weight);
-        _boundaryMasses[i] /= 1.17f;
-    });
+    parallelForRange(0, _boundaryPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            float weight = 0.f;
+            iterateNeighbours(_boundaryGrid, _boundaryPositions, _boundaryPositions[i], [this, &weight] (size_t j, const Vector3f &r, float r2) {
+                weight += _kernel.poly6(r2);
+            });
+            _boundaryMasses[i] = _restDensity / (_kernel.poly6Constant * weight);
+            _boundaryMasses[i] /= 1.17f;
+        }
+    }, _boundaryPartitioner);
 }
 
 // Computes densities of fluid and boundary particles based on [4] equation 6
 void SPH::updateDensities() {
-#if HANDLE_BOUNDARIES
-    parallelFor(_boundaryPositions.size(), [this] (size_t i) {
-        if (!_boundaryActive[i]) {
-            return;
+    updateBoundaryDensities();
+    updateFluidDensities();
+}
+
+void SPH::updateBoundaryDensities() {
+    if (!(_features & FeatureBoundaries)) {
+        return;
+    }
+    parallelForRange(0, _boundaryPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            if (!_boundaryActive[i]) {
+                continue;
+            }
+            float fluidDensity = 0.f;
+            iterateNeighbours(_fluidGrid, _fluidPositions, _boundaryPositions[i], [this, &fluidDensity] (size_t j, const Vector3f &r, float r2) {
+                fluidDensity += _kernel.poly6(r2) * _fluidMasses[j];
+            });
+            float boundaryDensity = 0.f;
+            iterateNeighbours(_boundaryGrid, _boundaryPositions, _boundaryPositions[i], [this, &boundaryDensity] (size_t j, const Vector3f &r, float r2) {
+                boundaryDensity += _kernel.poly6(r2) * _boundaryMasses[j];
+            });
+            float density = _kernel.poly6Constant * fluidDensity;
+            density += _kernel.poly6Constant * boundaryDensity;
+            density += analyticBoundaryDensity(_boundaryPositions[i]);
+
+            _boundaryDensities[i] = density;
         }
-        float fluidDensity = 0.f;
-        iterateNeighbours(_fluidGrid, _fluidPositions, _boundaryPositions[i], [this, &fluidDensity] (size_t j, const Vector3f &r, float r2) {
-            fluidDensity += _kernel.poly6(r2);
-        });
-        float boundaryDensity = 0.f;
-        iterateNeighbours(_boundaryGrid, _boundaryPositions, _boundaryPositions[i], [this, &boundaryDensity] (size_t j, const Vector3f &r, float r2) {
-            boundaryDensity += _kernel.poly6(r2) * _boundaryMasses[j];
-        });
-        float density = _kernel.poly6Constant * _particleMass * fluidDensity;
-        density += _kernel.poly6Constant * boundaryDensity;
+    }, _boundaryPartitioner);
+}
 
-        _boundaryDensities[i] = density;
-    });
-#endif
+template<int Features>
+void SPH::updateFluidDensities() {
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            if (!_fluidActive[i]) {
+                continue;
+            }
+            float density = 0.f;
+            iterateFluidNeighbours(i, [&] (size_t j, const Vector3f &r, float r2, const Kernel &kernel) {
+                density += kernel.poly6Constant * kernel.poly6(r2) * _fluidMasses[j];
+            });
+            // Classify surface particles based on the fluid density (colour field)
+            _fluidSurface[i] = !surface.enabled || density < surface.threshold * _restDensity;
+            if (Features & FeatureBoundaries) {
+                float boundaryDensity = 0.f;
+                iterateNeighbours(_boundaryGrid, _boundaryPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
+                    boundaryDensity += _kernel.poly6(r2) * _boundaryMasses[j];;
+                });
+                density += _kernel.poly6Constant * boundaryDensity;
+                density += analyticBoundaryDensity(_fluidPositions[i]);
+            }
 
-    parallelFor(_fluidPositions.size(), [this] (size_t i) {
-        float fluidDensity = 0.f;
-        iterateNeighbours(_fluidGrid, _fluidPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
-            fluidDensity += _kernel.poly6(r2);
-        });
-        float density = _kernel.poly6Constant * _particleMass * fluidDensity;
-#if HANDLE_BOUNDARIES
-        float boundaryDensity = 0.f;
-        iterateNeighbours(_boundaryGrid, _boundaryPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
-            boundaryDensity += _kernel.poly6(r2) * _boundaryMasses[j];;
-        });
-        density += _kernel.poly6Constant * boundaryDensity;
-#endif
+            _fluidDensities[i] = density;
+        }
+    }, _fluidPartitioner);
 
-        _fluidDensities[i] = density;
-    });
+    if (precision.enabled) {
+        precision.densityError = precision.densities.store(_fluidDensities, _fluidPartitioner);
+    }
+}
+
+void SPH::updateFluidDensities() {
+    if (_features & FeatureBoundaries) {
+        updateFluidDensities<FeatureBoundaries>();
+    } else {
+        updateFluidDensities<0>();
+    }
 }
 
-// Compute normals based on [3]
+// Compute normals based on [3] (only needed for surface tension and adaptive resolution)
+template<int Features>
 void SPH::updateNormals() {
-    parallelFor(_fluidPositions.size(), [this] (size_t i) {
-        Vector3f normal;
-        iterateNeighbours(_fluidGrid, _fluidPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
-            normal += _kernel.poly6Grad(r, r2) / _fluidDensities[j];
-        });
-        normal *= _kernelRadius * _particleMass * _kernel.poly6GradConstant;
-        _fluidNormals[i] = normal;
-    });
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            if (!_fluidActive[i]) {
+                continue;
+            }
+            // Normals are needed for surface particles and their neighbours (curvature term of surface
+            // tension), further inside the fluid they are set to zero
+            Vector3f normal;
+            bool nearSurface = _fluidSurface[i];
+            iterateFluidNeighbours(i, [&] (size_t j, const Vector3f &r, float r2, const Kernel &kernel) {
+                normal += kernel.poly6GradConstant * kernel.poly6Grad(r, r2) * (_fluidMasses[j] / neighbourDensity<Features>(j));
+                nearSurface |= bool(_fluidSurface[j]);
+            });
+            normal *= _kernelRadius;
+            _fluidNormals[i] = nearSurface ? normal : Vector3f(0.f);
+        }
+    }, _fluidPartitioner);
+
+    if (Features & FeatureReducedPrecision) {
+        precision.normalError = precision.normals.store(_fluidNormals, _fluidPartitioner);
+    }
+}
+
+void SPH::updateNormals() {
+    if (!(_features & FeatureSurfaceTension) && !adaptive.enabled) {
+        return;
+    }
+    if (_features & FeatureReducedPrecision) {
+        updateNormals<FeatureReducedPrecision>();
+    } else {
+        updateNormals<0>();
+    }
 }
 
-void SPH::computeCollisions(std::function<void(size_t i, const Vector3f &n, float d)> handler) {
-    for (size_t i = 0; i < _fluidPositions.size(); ++i) {
-        const auto &p = _fluidPositions[i];
-        if (p.x() < _bounds.min.x()) {
-            handler(i, Vector3f(1.f, 0.f, 0.f), _bounds.min.x() - p.x());
+// Solve viscosity implicitly using a matrix-free preconditioned conjugate gradient method.
+// Uses the same viscosity laplacian as the explicit viscosity force, symmetrized by averaging
+// densities, so that diag(rho) + dt * L is symmetric positive definite (see [7]).
+void SPH::solveImplicitViscosity() {
+    auto &cg = implicitViscosity;
+    const size_t count = _fluidPositions.size();
+    const float scale = _timeStep * _viscosity * _particleMass * _kernel.viscosityLaplaceConstant;
+
+    auto weight = [this] (size_t i, size_t j, float r2) {
+        return _kernel.viscosityLaplace(std::sqrt(r2)) * 2.f / (_fluidDensities[i] + _fluidDensities[j]);
+    };
+
+    // result = (diag(rho) + dt * L) * x
+    auto multiply = [&] (const std::vector<Vector3f> &x, std::vector<Vector3f> &result) {
+        parallelForRange(0, count, ParticleGrainSize, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                Vector3f sum;
+                iterateNeighbours(_fluidGrid, _fluidPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
+                    if (r2 < 1e-10f) {
+                        return;
+                    }
+                    sum += weight(i, j, r2) * (x[i] - x[j]);
+                });
+                result[i] = _fluidDensities[i] * x[i] + scale * sum;
+            }
+        }, _fluidPartitioner);
+    };
+
+    auto dot = [this, count] (const std::vector<Vector3f> &a, const std::vector<Vector3f> &b) {
+        return parallelReduce(count, 0.f, [&] (size_t i, float &sum) {
+            sum += a[i].dot(b[i]);
+        }, std::plus<float>(), _fluidPartitioner);
+    };
+
+    // Setup right hand side and jacobi preconditioner
+    parallelForRange(0, count, ParticleGrainSize, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            float sum = 0.f;
+            iterateNeighbours(_fluidGrid, _fluidPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
+                if (r2 < 1e-10f) {
+                    return;
+                }
+                sum += weight(i, j, r2);
+            });
+            cg.diagonal[i] = _fluidDensities[i] + scale * sum;
+            cg.b[i] = _fluidDensities[i] * _fluidVelocities[i];
         }
-        if (p.x() > _bounds.max.x()) {
-            handler(i, Vector3f(-1.f, 0.f, 0.f), p.x() - _bounds.max.x());
+    }, _fluidPartitioner);
+
+    // Use current velocities as initial guess
+    std::vector<Vector3f> &x = _fluidVelocities;
+    multiply(x, cg.Ap);
+    parallelForRange(0, count, ParticleGrainSize, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            cg.r[i] = cg.b[i] - cg.Ap[i];
+            cg.z[i] = cg.r[i] / cg.diagonal[i];
+            cg.p[i] = cg.z[i];
         }
-        if (p.y() < _bounds.min.y()) {
-            handler(i, Vector3f(0.f, 1.f, 0.f), _bounds.min.y() - p.y());
+    }, _fluidPartitioner);
+
+    float rz = dot(cg.r, cg.z);
+    float threshold2 = sqr(cg.tolerance) * dot(cg.b, cg.b);
+
+    int k = 0;
+    while (k < cg.maxIterations && dot(cg.r, cg.r) > threshold2) {
+        multiply(cg.p, cg.Ap);
+        float pAp = dot(cg.p, cg.Ap);
+        if (pAp <= 0.f) {
+            break;
         }
-        if (p.y() > _bounds.max.y()) {
-            handler(i, Vector3f(0.f, -1.f, 0.f), p.y() - _bounds.max.y());
+        float alpha = rz / pAp;
+        parallelForRange(0, count, ParticleGrainSize, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                x[i] += alpha * cg.p[i];
+                cg.r[i] -= alpha * cg.Ap[i];
+                cg.z[i] = cg.r[i] / cg.diagonal[i];
+            }
+        }, _fluidPartitioner);
+        float rzNew = dot(cg.r, cg.z);
+        float beta = rzNew / rz;
+        rz = rzNew;
+        parallelForRange(0, count, ParticleGrainSize, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                cg.p[i] = cg.z[i] + beta * cg.p[i];
+            }
+        }, _fluidPartitioner);
+        ++k;
+    }
+
+    cg.iterations = k;
+}
+
+// Put resting particles to sleep and wake them up on contact with active particles.
+// A particle is resting if it stayed close to where it came to rest and its density error stayed
+// below the threshold for a number of steps. Velocities are not used, the adaptive time step keeps
+// the solver noise of resting fluid near the CFL limit, but the noise does not move particles far.
+// It only goes to sleep if all its neighbours are resting as well. Sleeping particles are not
+// updated but still act as (static) neighbours of active particles.
+void SPH::updateSleeping() {
+    float distance2 = sqr(sleeping.distance * _particleRadius);
+    float densityError = sleeping.densityError * _restDensity;
+
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            if (_fluidSleeping[i]) {
+                continue;
+            }
+            bool resting = (_fluidPositions[i] - _fluidRestPositions[i]).squaredNorm() < distance2 && std::abs(_fluidDensities[i] - _restDensity) < densityError;
+            if (resting) {
+                ++_fluidRestingSteps[i];
+            } else {
+                _fluidRestingSteps[i] = 0;
+                _fluidRestPositions[i] = _fluidPositions[i];
+            }
         }
-        if (p.z() < _bounds.min.z()) {
-            handler(i, Vector3f(0.f, 0.f, 1.f), _bounds.min.z() - p.z());
+    }, _fluidPartitioner);
+
+    // Decide first and apply in a separate pass, neighbour lookups read the resting steps of other particles
+    std::vector<int> &sleep = _scratch.flags;
+    sleep.resize(_fluidPositions.size());
+
+    auto &sleepingCount = resetReduction(_scratch.counts, size_t(0));
+
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, sleepingCount, [&] (const ParallelRange &range, size_t &count) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            bool resting = _fluidRestingSteps[i] >= sleeping.steps;
+            if (resting) {
+                _fluidGrid.lookup(_fluidPositions[i], _kernelRadius, [&] (size_t j) {
+                    if (_fluidRestingSteps[j] < sleeping.steps && (_fluidPositions[i] - _fluidPositions[j]).squaredNorm() < _kernelRadius2) {
+                        resting = false;
+                        return false;
+                    }
+                    return true;
+                });
+            }
+            sleep[i] = resting;
+            count += resting;
         }
-        if (p.z() > _bounds.max.z()) {
-            handler(i, Vector3f(0.f, 0.f, -1.f), p.z() - _bounds.max.z());
+    }, _fluidPartitioner);
+
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            // Woken up particles keep their resting steps, otherwise waking would spread through all
+            // sleeping particles (they only stop resting once they move or get compressed)
+            if (sleep[i]) {
+                _fluidVelocities[i] = Vector3f(0.f);
+            }
+            _fluidSleeping[i] = sleep[i];
         }
-    }
+    }, _fluidPartitioner);
+
+    sleeping.fraction = float(std::accumulate(sleepingCount.begin(), sleepingCount.end(), size_t(0))) / std::max(size_t(1), _fluidPositions.size());
 }
 
+// Positions are clamped rather than moved by the penetration depth, which can leave particles just
+// outside the grid due to rounding. The solvers handle collisions in their integration loops, this
+// is only used for positions that are changed outside of a step (initial relaxation).
 void SPH::enforceBounds() {
-    computeCollisions([&] (size_t i, const Vector3f &n, float d) {
-        float c = 0.5f;
-        _fluidPositions[i] += n * d;
-        _fluidVelocities[i] -= (1 + c) * _fluidVelocities[i].dot(n) * n;
-    });
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            handleCollision(_fluidPositions[i], _fluidVelocities[i]);
+        }
+    }, _fluidPartitioner);
 }
 
 void SPH::wcsphUpdateDensitiesAndPressures() {
-    parallelFor(_boundaryPositions.size(), [this] (size_t i) {
-        if (!_boundaryActive[i]) {
-            return;
+    parallelForRange(0, _boundaryPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            if (!_boundaryActive[i]) {
+                continue;
+            }
+            float fluidDensity = 0.f;
+            iterateNeighbours(_fluidGrid, _fluidPositions, _boundaryPositions[i], [this, &fluidDensity] (size_t j, const Vector3f &r, float r2) {
+                fluidDensity += _kernel.poly6(r2);
+            });
+            float boundaryDensity = 0.f;
+            iterateNeighbours(_boundaryGrid, _boundaryPositions, _boundaryPositions[i], [this, &boundaryDensity] (size_t j, const Vector3f &r, float r2) {
+                boundaryDensity += _kernel.poly6(r2) * _boundaryMasses[j];
+            });
+            float density = _kernel.poly6Constant * _particleMass * fluidDensity;
+            density += _kernel.poly6Constant * boundaryDensity;
+            density += analyticBoundaryDensity(_boundaryPositions[i]);
+
+            // Tait pressure (WCSPH)
+            float t = density / _restDensity;
+            float pressure = wcsph.B * ((t*t)*(t*t)*(t*t)*t - 1.f);
+
+            _boundaryDensities[i] = density;
+            _boundaryPressures[i] = pressure;
         }
-        float fluidDensity = 0.f;
-        iterateNeighbours(_fluidGrid, _fluidPositions, _boundaryPositions[i], [this, &fluidDensity] (size_t j, const Vector3f &r, float r2) {
-            fluidDensity += _kernel.poly6(r2);
-        });
-        float boundaryDensity = 0.f;
-        iterateNeighbours(_boundaryGrid, _boundaryPositions, _boundaryPositions[i], [this, &boundaryDensity] (size_t j, const Vector3f &r, float r2) {
-            boundaryDensity += _kernel.poly6(r2) * _boundaryMasses[j];
-        });
-        float density = _kernel.poly6Constant * _particleMass * fluidDensity;
-        density += _kernel.poly6Constant * boundaryDensity;
-
-        // Tait pressure (WCSPH)
-        float t = density / _restDensity;
-        float pressure = wcsph.B * ((t*t)*(t*t)*(t*t)*t - 1.f);
-
-        _boundaryDensities[i] = density;
-        _boundaryPressures[i] = pressure;
-    });
-
-    parallelFor(_fluidPositions.size(), [this] (size_t i) {
-        float fluidDensity = 0.f;
-        iterateNeighbours(_fluidGrid, _fluidPositions, _fluidPositions[i], [this, &fluidDensity] (size_t j, const Vector3f &r, float r2) {
-            fluidDensity += _kernel.poly6(r2);
-        });
-        float boundaryDensity = 0.f;
-        iterateNeighbours(_boundaryGrid, _boundaryPositions, _fluidPositions[i], [this, &boundaryDensity] (size_t j, const Vector3f &r, float r2) {
-            boundaryDensity += _kernel.poly6(r2) * _boundaryMasses[j];;
-        });
-        float density = _kernel.poly6Constant * _particleMass * fluidDensity;
-        density += _kernel.poly6Constant * boundaryDensity;
-
-        // Tait pressure (WCSPH)
-        float t = density / _restDensity;
-        float pressure = wcsph.B * ((t*t)*(t*t)*(t*t)*t - 1.f);
-
-        _fluidDensities[i] = density;
-        _fluidPressures[i] = pressure;
-    });
+    }, _boundaryPartitioner);
+
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            float fluidDensity = 0.f;
+            iterateNeighbours(_fluidGrid, _fluidPositions, _fluidPositions[i], [this, &fluidDensity] (size_t j, const Vector3f &r, float r2) {
+                fluidDensity += _kernel.poly6(r2);
+            });
+            float boundaryDensity = 0.f;
+            iterateNeighbours(_boundaryGrid, _boundaryPositions, _fluidPositions[i], [this, &boundaryDensity] (size_t j, const Vector3f &r, float r2) {
+                boundaryDensity += _kernel.poly6(r2) * _boundaryMasses[j];;
+            });
+            float density = _kernel.poly6Constant * _particleMass * fluidDensity;
+            _fluidSurface[i] = !surface.enabled || density < surface.threshold * _restDensity;
+            density += _kernel.poly6Constant * boundaryDensity;
+            density += analyticBoundaryDensity(_fluidPositions[i]);
+
+            // Tait pressure (WCSPH)
+            float t = density / _restDensity;
+            float pressure = wcsph.B * ((t*t)*(t*t)*(t*t)*t - 1.f);
+
+            _fluidDensities[i] = density;
+            _fluidPressures[i] = pressure;
+        }
+    }, _fluidPartitioner);
 }
 
+template<int Features>
 void SPH::wcsphUpdateForces() {
-    parallelFor(_fluidPositions.size(), [this] (size_t i) {
-        Vector3f force(0.f);
-        Vector3f forceViscosity;
-        Vector3f forceCohesion;
-        Vector3f forceCurvature;
-
-        _fluidGrid.lookup(_fluidPositions[i], _kernelRadius, [this, i, &force, &forceCohesion, &forceCurvature, &forceViscosity] (size_t j) {
-            const Vector3f &v_i = _fluidVelocities[i];
-            const Vector3f &v_j = _fluidVelocities[j];
-            const Vector3f &n_i = _fluidNormals[i];
-            const Vector3f &n_j = _fluidNormals[j];
-            const float &density_i = _fluidDensities[i];
-            const float &density_j = _fluidDensities[j];
-            const float &pressure_i = _fluidPressures[i];
-            const float &pressure_j = _fluidPressures[j];
-
-            if (i != j) {
-                Vector3f r = _fluidPositions[i] - _fluidPositions[j];
-                float r2 = r.squaredNorm();
-                if (r2 < _kernelRadius2 && r2 > 0.00001f) {
-                    float rn = std::sqrt(r2);
-                    //force -= 0.5f * (pressure_i + pressure_j) * _m / density_j * Kernel::spikyGrad(r);
-                    //force -= _particleMass2 * (pressure_i + pressure_j) / (2.f * density_i * density_j) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
-
-                    // Viscosity force
-                    //force += _particleMass2 * _settings.viscosity * (v_j - v_i) / (density_i * density_j) * _kernel.viscosityLaplaceConstant * _kernel.viscosityLaplace(rn);
-
-
-                    // Pressure force (WCSPH)
-                    //if (pressure_i > 0.f || pressure_j > 0.f)
-                    force -= _particleMass2 * (pressure_i / sqr(density_i) + pressure_j / sqr(density_j)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
-                    //force -= _particleMass2 * (pressure_i / sqr(density_i)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
-
-                    #if 0
-                    // Viscosity force (WCSPH)
-                    Vector3f v = (v_i - v_j);
-                    if (v.dot(r) < 0.f) {
-                        float vu = 2.f * wcsph.viscosity * _kernelRadius * wcsph.cs / (density_i + density_j);
-                        force += vu * _particleMass2 * (v.dot(r) / (r2 + 0.001f * sqr(_kernelRadius))) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            Vector3f force(0.f);
+            Vector3f forceViscosity;
+            Vector3f forceCohesion;
+            Vector3f forceCurvature;
+            bool isSurface = _fluidSurface[i];
+
+            _fluidGrid.lookup(_fluidPositions[i], _kernelRadius, [this, i, isSurface, &force, &forceCohesion, &forceCurvature, &forceViscosity] (size_t j) {
+                const Vector3f &v_i = _fluidVelocities[i];
+                const Vector3f &v_j = _fluidVelocities[j];
+                const Vector3f &n_i = _fluidNormals[i];
+                const Vector3f &n_j = _fluidNormals[j];
+                const float &density_i = _fluidDensities[i];
+                const float &density_j = _fluidDensities[j];
+                const float &pressure_i = _fluidPressures[i];
+                const float &pressure_j = _fluidPressures[j];
+
+                if (i != j) {
+                    Vector3f r = _fluidPositions[i] - _fluidPositions[j];
+                    float r2 = r.squaredNorm();
+                    if (r2 < _kernelRadius2 && r2 > 0.00001f) {
+                        float rn = std::sqrt(r2);
+                        //force -= 0.5f * (pressure_i + pressure_j) * _m / density_j * Kernel::spikyGrad(r);
+                        //force -= _particleMass2 * (pressure_i + pressure_j) / (2.f * density_i * density_j) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
+
+                        // Viscosity force
+                        //force += _particleMass2 * _settings.viscosity * (v_j - v_i) / (density_i * density_j) * _kernel.viscosityLaplaceConstant * _kernel.viscosityLaplace(rn);
+
+
+                        // Pressure force (WCSPH)
+                        //if (pressure_i > 0.f || pressure_j > 0.f)
+                        force -= _particleMass2 * (pressure_i / sqr(density_i) + pressure_j / sqr(density_j)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
+                        //force -= _particleMass2 * (pressure_i / sqr(density_i)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
+
+                        #if 0
+                        // Viscosity force (WCSPH)
+                        Vector3f v = (v_i - v_j);
+                        if (v.dot(r) < 0.f) {
+                            float vu = 2.f * wcsph.viscosity * _kernelRadius * wcsph.cs / (density_i + density_j);
+                            force += vu * _particleMass2 * (v.dot(r) / (r2 + 0.001f * sqr(_kernelRadius))) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
+                        }
+                        #endif
+
+                        // Surface tension force (WCSPH)
+                        #if 0
+                        float K = 0.1f;
+                        Vector3f a = -K * _kernel.poly6Constant * _kernel.poly6(r2) * r / rn;
+                        force += _particleMass * a;
+                        #endif
+
+                        // Viscosity
+                        if ((Features & FeatureViscosity) && density_j > 0.0001f) {
+                            forceViscosity -= (v_i - v_j) * (_kernel.viscosityLaplace(rn) / density_j);
+                        }
+
+                        // Surface tension (according to [3]), only acts on surface particles
+                        if ((Features & FeatureSurfaceTension) && isSurface) {
+                            float correctionFactor = 2.f * _restDensity / (density_i + density_j);
+                            forceCohesion += correctionFactor * (r / rn) * _kernel.surfaceTension(rn);
+                            forceCurvature += correctionFactor * (n_i - n_j);
+                        }
+                    } else if (r2 == 0.f && !_deterministic) {
+                        // Avoid collapsing particles (races with other threads, disabled in deterministic mode)
+                        _fluidPositions[j] += Vector3f(1e-5f);
                     }
-                    #endif
-
-                    // Surface tension force (WCSPH)
-                    #if 0
-                    float K = 0.1f;
-                    Vector3f a = -K * _kernel.poly6Constant * _kernel.poly6(r2) * r / rn;
-                    force += _particleMass * a;
-                    #endif
-
-                    // Viscosity
-                    if (density_j > 0.0001f) {
-                        forceViscosity -= (v_i - v_j) * (_kernel.viscosityLaplace(rn) / density_j);
+                }
+                return true;
+            });
+
+            if (Features & FeatureBoundaries) {
+                _boundaryGrid.lookup(_fluidPositions[i], _kernelRadius, [this, i, &force, &forceCohesion, &forceCurvature, &forceViscosity] (size_t j) {
+                    const float &density_i = _fluidDensities[i];
+                    const float &density_j = _boundaryDensities[j];
+                    const float &pressure_i = _fluidPressures[i];
+                    const float &pressure_j = _boundaryPressures[j];
+
+                    Vector3f r = _fluidPositions[i] - _boundaryPositions[j];
+                    float r2 = r.squaredNorm();
+                    if (r2 < _kernelRadius2 && r2 > 0.00001f) {
+                        float rn = std::sqrt(r2);
+                        // Pressure force (WCSPH)
+                        //force -= /*2.f **/ _particleMass2 * (pressure_i / sqr(density_i) + pressure_j / sqr(density_j)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
+                        force -= _particleMass * _boundaryMasses[j] * (pressure_i / sqr(density_i) + pressure_j / sqr(density_j)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
+                        //force -= _particleMass * _boundaryMasses[j] * (pressure_i / sqr(density_i)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
                     }
-
-                    // Surface tension (according to [3])
-                    float correctionFactor = 2.f * _restDensity / (density_i + density_j);
-                    forceCohesion += correctionFactor * (r / rn) * _kernel.surfaceTension(rn);
-                    forceCurvature += correctionFactor * (n_i - n_j);
-                } else if (r2 == 0.f) {
-                    // Avoid collapsing particles
-                    _fluidPositions[j] += Vector3f(1e-5f);
+                    return true;
+                });
+                if (hasAnalyticBoundary()) {
+                    // Mirrored pressure and density
+                    force -= _particleMass * (2.f * _fluidPressures[i] / sqr(_fluidDensities[i])) * analyticBoundaryGradient(_fluidPositions[i]);
                 }
             }
-            return true;
-        });
 
-#if HANDLE_BOUNDARIES
-        _boundaryGrid.lookup(_fluidPositions[i], _kernelRadius, [this, i, &force, &forceCohesion, &forceCurvature, &forceViscosity] (size_t j) {
-            const float &density_i = _fluidDensities[i];
-            const float &density_j = _boundaryDensities[j];
-            const float &pressure_i = _fluidPressures[i];
-            const float &pressure_j = _boundaryPressures[j];
+            //const float viscosity = 0.0005f;
+            //const float viscosity = 0.001f;
 
-            Vector3f r = _fluidPositions[i] - _boundaryPositions[j];
-            float r2 = r.squaredNorm();
-            if (r2 < _kernelRadius2 && r2 > 0.00001f) {
-                float rn = std::sqrt(r2);
-                // Pressure force (WCSPH)
-                //force -= /*2.f **/ _particleMass2 * (pressure_i / sqr(density_i) + pressure_j / sqr(density_j)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
-                force -= _particleMass * _boundaryMasses[j] * (pressure_i / sqr(density_i) + pressure_j / sqr(density_j)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
-                //force -= _particleMass * _boundaryMasses[j] * (pressure_i / sqr(density_i)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
+            // Disabled forces stay zero
+            if (Features & FeatureViscosity) {
+                forceViscosity *= _viscosity * _particleMass * _kernel.viscosityLaplaceConstant;
+            }
+            if (Features & FeatureSurfaceTension) {
+                forceCohesion *= -_surfaceTension * _particleMass2 * _kernel.surfaceTensionConstant;
+                forceCurvature *= -_surfaceTension * _particleMass;
             }
-            return true;
-        });
-#endif
-
-        //const float viscosity = 0.0005f;
-        //const float viscosity = 0.001f;
-
-        forceViscosity *= _viscosity * _particleMass * _kernel.viscosityLaplaceConstant;
 
-        forceCohesion *= -_surfaceTension * _particleMass2 * _kernel.surfaceTensionConstant;
-        forceCurvature *= -_surfaceTension * _particleMass;
+            force += forceCohesion + forceCurvature + forceViscosity;
+            force += _particleMass * _gravity;
 
-        force += forceCohesion + forceCurvature + forceViscosity;
-        force += _particleMass * _gravity;
+            _fluidForces[i] = force;
+        }
+    }, _fluidPartitioner);
+}
 
-        _fluidForces[i] = force;
-    });
+void SPH::wcsphUpdateForces() {
+    static const FeaturePass passes[] = FEATURE_PASSES(wcsphUpdateForces);
+    (this->*passes[_features])();
 }
 
 void SPH::wcsphInit() {
@@ -426,15 +992,14 @@ void SPH::wcsphUpdate() {
     });
 
     Profiler::profile("Integrate", [&] () {
-        parallelFor(_fluidPositions.size(), [&] (size_t i) {
-            Vector3f a = _invParticleMass * _fluidForces[i];
-            _fluidVelocities[i] += a * _timeStep;
-            _fluidPositions[i] += _fluidVelocities[i] * _timeStep;
-        });
-    });
-
-    Profiler::profile("Collision Update", [&] () {
-        enforceBounds();
+        parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                Vector3f a = _invParticleMass * _fluidForces[i];
+                _fluidVelocities[i] += a * _timeStep;
+                _fluidPositions[i] += _fluidVelocities[i] * _timeStep;
+                handleCollision(_fluidPositions[i], _fluidVelocities[i]);
+            }
+        }, _fluidPartitioner);
     });
 
     _time += _timeStep;
@@ -444,9 +1009,87 @@ void SPH::pcisphUpdateGrid() {
     _fluidGrid.update(_fluidPositions, [&] (size_t i, size_t j) {
         std::swap(_fluidPositions[i], _fluidPositions[j]);
         std::swap(_fluidVelocities[i], _fluidVelocities[j]);
+        std::swap(_fluidDensities[i], _fluidDensities[j]);
+        std::swap(_fluidPressures[i], _fluidPressures[j]);
+        std::swap(_fluidNormals[i], _fluidNormals[j]);
+        std::swap(_fluidRestingSteps[i], _fluidRestingSteps[j]);
+        std::swap(_fluidRestPositions[i], _fluidRestPositions[j]);
+        std::swap(_fluidSleeping[i], _fluidSleeping[j]);
+        std::swap(_fluidForces[i], _fluidForces[j]);
+        std::swap(_fluidPressureForces[i], _fluidPressureForces[j]);
+        std::swap(_fluidTimeStepLevels[i], _fluidTimeStepLevels[j]);
+        std::swap(_fluidSurface[i], _fluidSurface[j]);
     });
 }
 
+// Assign time step levels for multi-rate time stepping. The base time step is limited by the
+// fastest particle, each particle uses the largest power-of-two multiple of it that keeps its
+// own CFL and force criteria within those of the fastest particle. Levels of neighbouring
+// particles differ by at most one, so that fast particles do not run into particles that are
+// not updated for a long time.
+void SPH::pcisphUpdateTimeStepLevels() {
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            float velocity = std::max(1e-8f, _fluidVelocities[i].norm());
+            float force = std::max(1e-8f, (_fluidForces[i] + _fluidPressureForces[i]).norm());
+            float maxTimeStep = std::min(_timeStep * _maxVelocity / velocity, _timeStep * std::sqrt(_maxForce / force));
+            int level = 0;
+            while (level < multiRate.maxLevel && _timeStep * (2 << level) <= maxTimeStep) {
+                ++level;
+            }
+            _fluidTimeStepLevels[i] = level;
+        }
+    }, _fluidPartitioner);
+
+    for (int pass = 0; pass < multiRate.maxLevel; ++pass) {
+        parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                int level = _fluidTimeStepLevels[i];
+                iterateNeighbours(_fluidGrid, _fluidPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
+                    level = std::min(level, _fluidTimeStepLevels[j] + 1);
+                });
+                multiRate.levelsNew[i] = level;
+            }
+        }, _fluidPartitioner);
+        std::swap(_fluidTimeStepLevels, multiRate.levelsNew);
+    }
+}
+
+// Determine the particles that are updated in the current step.
+// With multi-rate time stepping a particle of level l is updated every 2^l steps. All particles
+// are updated at the start of a block, which synchronizes neighbour quantities (densities,
+// normals, pressures) that are otherwise taken from the last update of a particle.
+//
+// This is a weaker scheme than fully asynchronous multi-rate integration: only the neighbour sums
+// (densities, normals, forces and the pressure iterations) are limited to active particles, which is
+// where almost all time of a step is spent. Every base step still
+// - drifts inactive particles with their velocity and sorts all particles into the grid, so that
+//   active particles always see current neighbour positions,
+// - predicts the density of a level l > 0 particle at the end of its 2^l step from neighbour
+//   positions extrapolated with their predicted velocities (see pcisphUpdatePressures),
+// - uses densities and pressures of inactive neighbours from their last update.
+// A consistent scheme would have to integrate neighbours to the sub-step times of each level and keep
+// their quantities per level, which does not fit the global PCISPH pressure iteration. The errors are
+// bounded by the level constraint (neighbour levels differ by at most one) and the resynchronization at
+// block starts.
+void SPH::pcisphUpdateActiveParticles() {
+    if (multiRate.enabled && multiRate.step == 0) {
+        pcisphUpdateTimeStepLevels();
+    }
+
+    auto &activeCount = resetReduction(_scratch.counts, size_t(0));
+
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, activeCount, [&] (const ParallelRange &range, size_t &count) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            bool active = !_fluidSleeping[i] && (multiRate.step & ((1 << _fluidTimeStepLevels[i]) - 1)) == 0;
+            _fluidActive[i] = active;
+            count += active ? 1 : 0;
+        }
+    }, _fluidPartitioner);
+
+    multiRate.activeFraction = float(std::accumulate(activeCount.begin(), activeCount.end(), size_t(0))) / std::max(size_t(1), _fluidPositions.size());
+}
+
 void SPH::pcisphUpdateDensityVariationScaling() {
     // Compute density error scaling factor
     Vector3f gradSum;
@@ -475,91 +1118,145 @@ void SPH::pcisphUpdateDensityVariationScaling() {
 // Initialize forces
 // - compute all forces that are constant during PCISPH iterations (e.g. viscosity, surface tension, external forces)
 // - reset pressures and pressure forces
+template<int Features>
 void SPH::pcisphInitializeForces() {
-    parallelFor(_fluidPositions.size(), [&] (size_t i) {
-        Vector3f forceViscosity;
-        Vector3f forceCohesion;
-        Vector3f forceCurvature;
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            if (!_fluidActive[i]) {
+                continue;
+            }
 
-        iterateNeighbours(_fluidGrid, _fluidPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
-            const Vector3f &v_i = _fluidVelocities[i];
-            const Vector3f &v_j = _fluidVelocities[j];
-            const Vector3f &n_i = _fluidNormals[i];
-            const Vector3f &n_j = _fluidNormals[j];
-            const float &density_i = _fluidDensities[i];
-            const float &density_j = _fluidDensities[j];
+            Vector3f forceViscosity;
+            Vector3f forceCohesion;
+            Vector3f forceCurvature;
+            bool isSurface = _fluidSurface[i];
+
+            iterateFluidNeighbours(i, [&] (size_t j, const Vector3f &r, float r2, const Kernel &kernel) {
+                const Vector3f &v_i = _fluidVelocities[i];
+                const Vector3f &v_j = _fluidVelocities[j];
+                const Vector3f &n_i = _fluidNormals[i];
+                const float &density_i = _fluidDensities[i];
+                const float density_j = neighbourDensity<Features>(j);
+                const float &mass_j = _fluidMasses[j];
+
+                if (r2 < 1e-7f) {
+                    return;
+                }
 
-            if (r2 < 1e-7f) {
-                return;
-            }
+                float rn = std::sqrt(r2);
 
-            float rn = std::sqrt(r2);
+                // Viscosity
+                if (Features & FeatureViscosity) {
+                    forceViscosity -= (v_i - v_j) * (mass_j * kernel.viscosityLaplaceConstant * kernel.viscosityLaplace(rn) / density_j);
+                }
 
-            // Viscosity
-            //if (density_j > 0.0001f) {
-                forceViscosity -= (v_i - v_j) * (_kernel.viscosityLaplace(rn) / density_j);
-            //}
+                // Surface tension (according to [3]), only acts on surface particles
+                if ((Features & FeatureSurfaceTension) && isSurface) {
+                    float correctionFactor = 2.f * _restDensity / (density_i + density_j);
+                    forceCohesion += correctionFactor * (r / rn) * (mass_j * kernel.surfaceTensionConstant * kernel.surfaceTension(rn));
+                    forceCurvature += correctionFactor * (n_i - neighbourNormal<Features>(j));
+                }
+            });
 
-            // Surface tension (according to [3])
-            float correctionFactor = 2.f * _restDensity / (density_i + density_j);
-            forceCohesion += correctionFactor * (r / rn) * _kernel.surfaceTension(rn);
-            forceCurvature += correctionFactor * (n_i - n_j);
-        });
+            const float &mass_i = _fluidMasses[i];
 
-        //if (_fluidDensities[i] > 0.0001f) {
-            forceViscosity *= _viscosity * _particleMass2 * _kernel.viscosityLaplaceConstant / _fluidDensities[i];
-        //} else {
-        //    forceViscosity = Vector3f(0.f);
-        //}
+            // Disabled forces stay zero
+            if (Features & FeatureViscosity) {
+                forceViscosity *= _viscosity * mass_i / _fluidDensities[i];
+            }
+            if (Features & FeatureSurfaceTension) {
+                forceCohesion *= -_surfaceTension * mass_i;
+                forceCurvature *= -_surfaceTension * mass_i;
+            }
 
-        forceCohesion *= -_surfaceTension * _particleMass2 * _kernel.surfaceTensionConstant;
-        forceCurvature *= -_surfaceTension * _particleMass;
+            Vector3f force;
+            force += forceCohesion + forceCurvature + forceViscosity;
+            force += mass_i * _gravity;
 
-        Vector3f force;
-        force += forceCohesion + forceCurvature + forceViscosity;
-        force += _particleMass * _gravity;
+            _fluidForces[i] = force;
+            _fluidPressures[i] = 0.f;
+            _fluidPressureForces[i] = Vector3f(0.f);
+        }
+    }, _fluidPartitioner);
+}
 
-        _fluidForces[i] = force;
-        _fluidPressures[i] = 0.f;
-        _fluidPressureForces[i] = Vector3f(0.f);
-    });
+void SPH::pcisphInitializeForces() {
+    static const FeaturePass passes[] = FEATURE_PASSES(pcisphInitializeForces);
+    (this->*passes[_features])();
 }
 
+// Inactive particles keep their velocity and drift with it
 void SPH::pcisphPredictVelocitiesAndPositions() {
-    parallelFor(_fluidPositions.size(), [&] (size_t i) {
-        Vector3f a = _invParticleMass * (_fluidForces[i] + _fluidPressureForces[i]);
-        _fluidVelocitiesNew[i] = _fluidVelocities[i] + a * _timeStep;
-        _fluidPositionsNew[i] = _fluidPositions[i] + _fluidVelocitiesNew[i] * _timeStep;
-    });
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            if (!_fluidActive[i]) {
+                _fluidVelocitiesNew[i] = _fluidVelocities[i];
+                _fluidPositionsNew[i] = _fluidPositions[i] + _fluidVelocities[i] * _timeStep;
+                continue;
+            }
+            float timeStep = _timeStep * (1 << _fluidTimeStepLevels[i]);
+            Vector3f a = _invParticleMass * (_fluidForces[i] + _fluidPressureForces[i]);
+            _fluidVelocitiesNew[i] = _fluidVelocities[i] + a * timeStep;
+            _fluidPositionsNew[i] = _fluidPositions[i] + _fluidVelocitiesNew[i] * _timeStep;
+        }
+    }, _fluidPartitioner);
 }
 
+template<int Features>
 void SPH::pcisphUpdatePressures() {
-    tbb::enumerable_thread_specific<float> maxDensityVariation(-std::numeric_limits<float>::infinity());
-    tbb::enumerable_thread_specific<float> accDensityVariation(0.f);
-
-    parallelFor(_fluidPositions.size(), [&] (size_t i) {
+    // Reduces max. and sum of density variations
+    Vector2f densityVariations = parallelReduce(_fluidPositions.size(), Vector2f(0.f), [&] (size_t i, Vector2f &acc) {
+        if (!_fluidActive[i]) {
+            return;
+        }
+        int level = _fluidTimeStepLevels[i];
         float fluidDensity = 0.f;
-        iterateNeighbours2(_fluidGrid, _fluidPositionsNew, _fluidPositions[i], _fluidPositionsNew[i], [&] (size_t j, const Vector3f &r, float r2) {
-            fluidDensity += _kernel.poly6(r2);
-        });
+        Vector3f positionNew = _fluidPositionsNew[i];
+        if (level == 0) {
+            iterateNeighbours2(_fluidGrid, _fluidPositionsNew, _fluidPositions[i], _fluidPositionsNew[i], [&] (size_t j, const Vector3f &r, float r2) {
+                fluidDensity += _kernel.poly6(r2);
+            });
+        } else {
+            // Predict density at the end of the particle's (longer) time step
+            float extraTimeStep = _timeStep * ((1 << level) - 1);
+            positionNew += _fluidVelocitiesNew[i] * extraTimeStep;
+            _fluidGrid.lookup(_fluidPositions[i], _kernelRadius, [&] (size_t j) {
+                Vector3f r = positionNew - (_fluidPositionsNew[j] + _fluidVelocitiesNew[j] * extraTimeStep);
+                float r2 = r.squaredNorm();
+                if (r2 < _kernelRadius2) {
+                    fluidDensity += _kernel.poly6(r2);
+                }
+                return true;
+            });
+        }
         float density = _kernel.poly6Constant * _particleMass * fluidDensity;
-#if HANDLE_BOUNDARIES
-        float boundaryDensity = 0.f;
-        iterateNeighbours(_boundaryGrid, _boundaryPositions, _fluidPositionsNew[i], [&] (size_t j, const Vector3f &r, float r2) {
-            boundaryDensity += _kernel.poly6(r2) * _boundaryMasses[j];;
-        });
-        density += _kernel.poly6Constant * boundaryDensity;
-#endif
+        if (Features & FeatureBoundaries) {
+            float boundaryDensity = 0.f;
+            iterateNeighbours(_boundaryGrid, _boundaryPositions, positionNew, [&] (size_t j, const Vector3f &r, float r2) {
+                boundaryDensity += _kernel.poly6(r2) * _boundaryMasses[j];;
+            });
+            density += _kernel.poly6Constant * boundaryDensity;
+            density += analyticBoundaryDensity(positionNew);
+        }
 
         float densityVariation = std::max(0.f, density - _restDensity);
-        maxDensityVariation.local() = std::max(maxDensityVariation.local(), densityVariation);
-        accDensityVariation.local() += densityVariation;
-
-        _fluidPressures[i] += _densityVariationScaling * densityVariation;
-    });
-
-    _maxDensityVariation = std::accumulate(maxDensityVariation.begin(), maxDensityVariation.end(), 0.f, [] (float a, float b) { return std::max(a, b); });
-    _avgDensityVariation = std::accumulate(accDensityVariation.begin(), accDensityVariation.end(), 0.f) / _fluidPositions.size();
+        acc.x() = std::max(acc.x(), densityVariation);
+        acc.y() += densityVariation;
+
+        // Scaling factor is proportional to 1 / timeStep^2
+        _fluidPressures[i] += _densityVariationScaling / (1 << (2 * level)) * densityVariation;
+    }, [] (const Vector2f &a, const Vector2f &b) {
+        return Vector2f(std::max(a.x(), b.x()), a.y() + b.y());
+    }, _fluidPartitioner);
+
+    _maxDensityVariation = densityVariations.x();
+    // Average over particles that are updated in this step
+    float activeCount = std::max(1.f, multiRate.activeFraction * _fluidPositions.size());
+    _avgDensityVariation = densityVariations.y() / activeCount;
+
+    if (precision.enabled) {
+        precision.pressureError = precision.pressures.store(_fluidPressures, _fluidPartitioner);
+    }
 
 #if 0
     DBG("maxDensityVariation = %f", _maxDensityVariation);
@@ -567,76 +1264,178 @@ void SPH::pcisphUpdatePressures() {
 #endif
 }
 
-void SPH::pcisphUpdatePressureForces() {
-    parallelFor(_fluidPositions.size(), [&] (size_t i) {
-        Vector3f pressureForce;
+void SPH::pcisphUpdatePressures() {
+    if (_features & FeatureBoundaries) {
+        pcisphUpdatePressures<FeatureBoundaries>();
+    } else {
+        pcisphUpdatePressures<0>();
+    }
+}
 
-        iterateNeighbours(_fluidGrid, _fluidPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
-            if (r2 < 1e-5f) {
-                return;
+template<int Features>
+void SPH::pcisphUpdatePressureForces() {
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            if (!_fluidActive[i]) {
+                continue;
             }
+            Vector3f pressureForce;
+
+            iterateNeighbours(_fluidGrid, _fluidPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
+                if (r2 < 1e-5f) {
+                    return;
+                }
 
-            float rn = std::sqrt(r2);
+                float rn = std::sqrt(r2);
 
 #if 1
-            const float &density_i = _fluidDensities[i];
-            const float &density_j = _fluidDensities[j];
-            const float &pressure_i = _fluidPressures[i];
-            const float &pressure_j = _fluidPressures[j];
+                const float &density_i = _fluidDensities[i];
+                const float density_j = neighbourDensity<Features>(j);
+                const float &pressure_i = _fluidPressures[i];
+                const float pressure_j = neighbourPressure<Features>(j);
 
-            pressureForce -= _particleMass2 * (pressure_i / sqr(density_i) + pressure_j / sqr(density_j)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
+                pressureForce -= _particleMass2 * (pressure_i / sqr(density_i) + pressure_j / sqr(density_j)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
 #else
-            const size_t k = j;//std::min(i, j);
-            const float &density_k = _fluidDensities[k];
-            const float &pressure_k = _fluidPressures[k];
+                const size_t k = j;//std::min(i, j);
+                const float &density_k = _fluidDensities[k];
+                const float &pressure_k = _fluidPressures[k];
 
-            pressureForce -= _particleMass2 * (pressure_k / sqr(density_k)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
+                pressureForce -= _particleMass2 * (pressure_k / sqr(density_k)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
 #endif
-        });
+            });
 
-#if HANDLE_BOUNDARIES
-        iterateNeighbours(_boundaryGrid, _boundaryPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
-            if (r2 < 1e-5f) {
-                return;
-            }
+            if (Features & FeatureBoundaries) {
+                iterateNeighbours(_boundaryGrid, _boundaryPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
+                    if (r2 < 1e-5f) {
+                        return;
+                    }
 
-            float rn = std::sqrt(r2);
+                    float rn = std::sqrt(r2);
 
-            const float &density_i = _fluidDensities[i];
-            const float &density_j = _boundaryDensities[j];
-            const float &pressure_i = _fluidPressures[i];
-            //const float &pressure_j = _boundaryPressures[j];
-            const float &pressure_j = _fluidPressures[i];
+                    const float &density_i = _fluidDensities[i];
+                    const float &density_j = _boundaryDensities[j];
+                    const float &pressure_i = _fluidPressures[i];
+                    //const float &pressure_j = _boundaryPressures[j];
+                    const float &pressure_j = _fluidPressures[i];
+
+                    //pressureForce -= _particleMass2 * (pressure_i / sqr(density_i) + pressure_j / sqr(density_j)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
+                    pressureForce -= _particleMass * _boundaryMasses[j] * (pressure_i / sqr(density_i) + pressure_j / sqr(density_j)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
+                });
+                if (hasAnalyticBoundary()) {
+                    // Mirrored pressure and density
+                    pressureForce -= _particleMass * (2.f * _fluidPressures[i] / sqr(_fluidDensities[i])) * analyticBoundaryGradient(_fluidPositions[i]);
+                }
+            }
 
-            //pressureForce -= _particleMass2 * (pressure_i / sqr(density_i) + pressure_j / sqr(density_j)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
-            pressureForce -= _particleMass * _boundaryMasses[j] * (pressure_i / sqr(density_i) + pressure_j / sqr(density_j)) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, rn);
-        });
-#endif
+            _fluidPressureForces[i] = pressureForce;
+        }
+    }, _fluidPartitioner);
+}
 
-        _fluidPressureForces[i] = pressureForce;
-    });
+void SPH::pcisphUpdatePressureForces() {
+    static const FeaturePass passes[] = FEATURE_PASSES(pcisphUpdatePressureForces);
+    (this->*passes[_features])();
 }
 
 void SPH::pcisphUpdateVelocitiesAndPositions() {
-    tbb::enumerable_thread_specific<float> maxVelocity(0.f);
-    tbb::enumerable_thread_specific<float> maxForce(0.f);
-
-    parallelFor(_fluidPositions.size(), [&] (size_t i) {
-        Vector3f force = _fluidForces[i] + _fluidPressureForces[i];
-        maxForce.local() = std::max(maxForce.local(), force.squaredNorm());
-        _fluidVelocitiesNew[i] = _fluidVelocities[i] + _invParticleMass * force * _timeStep;
-        _fluidPositionsNew[i] = _fluidPositions[i] + _fluidVelocitiesNew[i] * _timeStep;
-        maxVelocity.local() = std::max(maxVelocity.local(), _fluidVelocities[i].squaredNorm());
-    });
+    // Squared max. velocity (x) and force (y)
+    auto &maxima = resetReduction(_scratch.maxima, Vector2f(0.f));
+
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, maxima, [&] (const ParallelRange &range, Vector2f &max) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            max.x() = std::max(max.x(), _fluidVelocities[i].squaredNorm());
+            if (!_fluidActive[i]) {
+                _fluidVelocitiesNew[i] = _fluidVelocities[i];
+                _fluidPositionsNew[i] = _fluidPositions[i] + _fluidVelocities[i] * _timeStep;
+            } else {
+                float timeStep = _timeStep * (1 << _fluidTimeStepLevels[i]);
+                Vector3f force = _fluidForces[i] + _fluidPressureForces[i];
+                max.y() = std::max(max.y(), force.squaredNorm());
+                _fluidVelocitiesNew[i] = _fluidVelocities[i] + _invParticleMass * force * timeStep;
+                _fluidPositionsNew[i] = _fluidPositions[i] + _fluidVelocitiesNew[i] * _timeStep;
+            }
+            handleCollision(_fluidPositionsNew[i], _fluidVelocitiesNew[i]);
+        }
+    }, _fluidPartitioner);
 
-    _maxVelocity = std::sqrt(std::accumulate(maxVelocity.begin(), maxVelocity.end(), 0.f, [] (float a, float b) { return std::max(a, b); }));
-    _maxForce = std::sqrt(std::accumulate(maxForce.begin(), maxForce.end(), 0.f, [] (float a, float b) { return std::max(a, b); }));
+    Vector2f max = std::accumulate(maxima.begin(), maxima.end(), Vector2f(0.f), [] (const Vector2f &a, const Vector2f &b) { return Vector2f(a.cwiseMax(b)); });
+    _maxVelocity = std::sqrt(max.x());
+    _maxForce = std::sqrt(max.y());
 
     std::swap(_fluidPositionsNew, _fluidPositions);
     std::swap(_fluidVelocitiesNew, _fluidVelocities);
 }
 
+// Build the task graph of the phases leading up to the pressure solve. The boundary phases
+// (activation, densities) only depend on the fluid grid and are only needed by the pressure
+// forces, so they run concurrently with the chain of fluid phases. Nodes execute when all their
+// predecessors are done, which replaces the barriers between the boundary and fluid phases.
+void SPH::pcisphBuildTaskGraph() {
+    using namespace tbb::flow;
+    typedef continue_node<continue_msg> Node;
+
+    taskGraph.nodes.clear();
+    taskGraph.start.reset();
+    taskGraph.graph.reset(new graph());
+    taskGraph.start.reset(new broadcast_node<continue_msg>(*taskGraph.graph));
+
+    auto addNode = [this] (std::function<void()> func) -> Node & {
+        // Nodes run on worker threads, which take over the loop settings of this instance
+        taskGraph.nodes.emplace_back(new Node(*taskGraph.graph, [this, func] (const continue_msg &) {
+            ParallelBusyTimeScope busyTimeScope(&_busyTime);
+            DeterministicScope deterministicScope(_deterministic);
+            func();
+            return continue_msg();
+        }));
+        return *taskGraph.nodes.back();
+    };
+
+    // Boundary phases
+    auto &activateBoundary = addNode([this] () { activateBoundaryParticles(); });
+    auto &boundaryDensities = addNode([this] () { updateBoundaryDensities(); });
+    make_edge(*taskGraph.start, activateBoundary);
+    make_edge(activateBoundary, boundaryDensities);
+
+    // Fluid phases
+    auto &updateActive = addNode([this] () {
+        if (sleeping.enabled) {
+            updateSleeping();
+        }
+        if (sleeping.enabled || multiRate.enabled) {
+            pcisphUpdateActiveParticles();
+        }
+    });
+    auto &fluidDensities = addNode([this] () { updateFluidDensities(); });
+    auto &normals = addNode([this] () { updateNormals(); });
+    auto &forces = addNode([this] () {
+        pcisphInitializeForces();
+        if (implicitViscosity.enabled) {
+            solveImplicitViscosity();
+        }
+    });
+    make_edge(*taskGraph.start, updateActive);
+    make_edge(updateActive, fluidDensities);
+    make_edge(fluidDensities, normals);
+    make_edge(normals, forces);
+}
+
 void SPH::pcisphInit() {
+    if (taskGraph.enabled) {
+        pcisphBuildTaskGraph();
+    }
+
+    // Snapshots of the last steps used to go back in time when a shock is detected
+    // (restored snapshots are kept unless the rollback settings changed)
+    size_t snapshotCapacity = size_t(std::max(1, shock.rollbackSteps - 1));
+    if (!startup.resumed || !_snapshots.matches(snapshotCapacity, shock.compressSnapshots)) {
+        _snapshots.init(snapshotCapacity, _fluidPositions.size(), emission.pool.capacity(), _bounds, shock.compressSnapshots);
+    }
+
+    // Restored attributes of inactive particles (multi-rate) must not be recomputed
+    if (startup.resumed) {
+        return;
+    }
+
     // Compute densities
     pcisphUpdateGrid();
     updateDensities();
@@ -648,17 +1447,44 @@ void SPH::pcisphInit() {
     }
     DBG("min/max densities = %f/%f", mind, maxd);
 
-    _fluidPositionsPreShock = _fluidPositions;
-    _fluidVelocitiesPreShock = _fluidVelocities;
-
     // Relax initial particle distribution and reset velocities
-    pcisphUpdate(10000);
+    Timer timer;
+    switch (startup.relaxation) {
+    case RelaxNone: break;
+    case RelaxFast: pcisphRelax(); break;
+    case RelaxSolver: pcisphUpdate(10000); break;
+    }
+    startup.relaxationTime = timer.elapsed();
     for (auto &v : _fluidVelocities) {
         v = Vector3f(0.f);
     }
+    multiRate.step = 0;
 
     _time = 0.f;
-    _timePreShock = 0.f;
+    _snapshots.clear();
+}
+
+// Relax the initial particle distribution by projecting positions onto the (non-compression) density
+// constraint [6], stopping early once the avg. density error is below the compression threshold.
+// Unlike a full PCISPH step, this involves no forces or time step and converges in a few iterations.
+void SPH::pcisphRelax() {
+    // Grid is up to date (see pcisphInit)
+    std::copy(_fluidPositions.begin(), _fluidPositions.end(), _fluidPositionsNew.begin());
+
+    startup.iterations = 0;
+    while (startup.iterations < startup.maxIterations) {
+        pbfUpdateLambdas();
+        if (pbf.avgDensityError < _compressionThreshold) {
+            break;
+        }
+        pbfUpdatePositionCorrections();
+        ++startup.iterations;
+    }
+
+    std::copy(_fluidPositionsNew.begin(), _fluidPositionsNew.end(), _fluidPositions.begin());
+    enforceBounds();
+
+    DBG("Relaxed initial state in %d iterations (avg. density error = %.3f%%)", startup.iterations, pbf.avgDensityError * 100.f);
 }
 
 void SPH::pcisphUpdate(int maxIterations) {
@@ -668,21 +1494,47 @@ void SPH::pcisphUpdate(int maxIterations) {
         pcisphUpdateGrid();
     });
 
-    Profiler::profile("Activate Boundary", [&] () {
-        activateBoundaryParticles();
-    });
+    if (taskGraph.enabled) {
+        // Idle time of this item measures the remaining barrier overhead of the graph
+        Profiler::profile("Task Graph", [&] () {
+            taskGraph.start->try_put(tbb::flow::continue_msg());
+            taskGraph.graph->wait_for_all();
+        });
+    } else {
+        if (sleeping.enabled) {
+            Profiler::profile("Update Sleeping", [&] () {
+                updateSleeping();
+            });
+        }
 
-    Profiler::profile("Update Densities", [&] () {
-        updateDensities();
-    });
+        if (sleeping.enabled || multiRate.enabled) {
+            Profiler::profile("Update Active", [&] () {
+                pcisphUpdateActiveParticles();
+            });
+        }
 
-    Profiler::profile("Update Normals", [&] () {
-        updateNormals();
-    });
+        Profiler::profile("Activate Boundary", [&] () {
+            activateBoundaryParticles();
+        });
 
-    Profiler::profile("Initialize Forces", [&] () {
-        pcisphInitializeForces();
-    });
+        Profiler::profile("Update Densities", [&] () {
+            updateDensities();
+        });
+
+        Profiler::profile("Update Normals", [&] () {
+            updateNormals();
+        });
+
+        Profiler::profile("Initialize Forces", [&] () {
+            pcisphInitializeForces();
+        });
+
+        if (implicitViscosity.enabled) {
+            Profiler::profile("Implicit Viscosity", [&] () {
+                solveImplicitViscosity();
+            });
+        }
+    }
 
     int k = 0;
     while (k < maxIterations) {
@@ -710,12 +1562,22 @@ void SPH::pcisphUpdate(int maxIterations) {
         pcisphUpdateVelocitiesAndPositions();
     });
 
-    Profiler::profile("Collision Update", [&] () {
-        enforceBounds();
-    });
-
     DebugMonitor::addItem("fluidParticles", "%d", _fluidPositions.size());
     DebugMonitor::addItem("boundaryParticles", "%d", _boundaryPositions.size());
+    if (sleeping.enabled) {
+        DebugMonitor::addItem("sleepingParticles", "%.1f%%", sleeping.fraction * 100.f);
+    }
+    if (implicitViscosity.enabled) {
+        DebugMonitor::addItem("viscosityIterations", "%d", implicitViscosity.iterations);
+    }
+    if (multiRate.enabled) {
+        DebugMonitor::addItem("activeParticles", "%.1f%%", multiRate.activeFraction * 100.f);
+    }
+    if (precision.enabled) {
+        DebugMonitor::addItem("densityPrecisionError", "%.2e", precision.densityError);
+        DebugMonitor::addItem("pressurePrecisionError", "%.2e", precision.pressureError);
+        DebugMonitor::addItem("normalPrecisionError", "%.2e", precision.normalError);
+    }
 
     DebugMonitor::addItem("maxDensityVariation", "%.1f", _maxDensityVariation);
     DebugMonitor::addItem("avgDensityVariation", "%.1f", _avgDensityVariation);
@@ -726,8 +1588,9 @@ void SPH::pcisphUpdate(int maxIterations) {
     _maxVelocity = std::max(1e-8f, _maxVelocity);
     _maxForce = std::max(1e-8f, _maxForce);
 
-    // Adjust timestep
-    if ((0.19f * std::sqrt(_kernelRadius / _maxForce) > _timeStep) &&
+    // Adjust timestep (not increased while all particles sleep, the limits would not bound it)
+    if ((sleeping.fraction < 1.f) &&
+        (0.19f * std::sqrt(_kernelRadius / _maxForce) > _timeStep) &&
         (_maxDensityVariation < 4.5f * _avgDensityVariationThreshold) &&
         (_avgDensityVariation < 0.9f * _avgDensityVariationThreshold) &&
         (0.39f * _kernelRadius / _maxVelocity > _timeStep)) {
@@ -740,7 +1603,12 @@ void SPH::pcisphUpdate(int maxIterations) {
         _timeStep *= 0.998f;
     }
 
+    if (multiRate.enabled) {
+        multiRate.step = (multiRate.step + 1) & ((1 << multiRate.maxLevel) - 1);
+    }
+
     // Detect shock
+    bool rolledBack = false;
     //if ((_maxDensityVariation - _prevMaxDensityVariation > 0.5f * (_avgDensityVariationThreshold + _maxDensityVariationThreshold)) ||
     if ((_maxDensityVariation - _prevMaxDensityVariation > _maxDensityVariationThreshold) ||
         (_maxDensityVariation > _maxDensityVariationThreshold) ||
@@ -757,10 +1625,17 @@ void SPH::pcisphUpdate(int maxIterations) {
         }
         _timeStep = std::min(0.2f * std::sqrt(_kernelRadius / _maxForce), 0.25f * _kernelRadius / _maxVelocity);
 
-        // Go back two timesteps
-        _time = _timePreShock;
-        _fluidPositions = _fluidPositionsPreShock;
-        _fluidVelocities = _fluidVelocitiesPreShock;
+        // Go back to the oldest snapshot (shock.rollbackSteps timesteps)
+        rolledBack = _snapshots.restoreOldest(_time, _fluidPositions, _fluidVelocities);
+
+        // Snapshots are in an older particle order, so resting states would belong to other particles
+        if (rolledBack && sleeping.enabled) {
+            std::fill(_fluidRestingSteps.begin(), _fluidRestingSteps.end(), 0);
+            std::fill(_fluidSleeping.begin(), _fluidSleeping.end(), 0);
+        }
+
+        // Start a new block to resynchronize all particles
+        multiRate.step = 0;
 
         DebugMonitor::addItem("shock", "yes");
     } else {
@@ -768,28 +1643,1196 @@ void SPH::pcisphUpdate(int maxIterations) {
         DebugMonitor::addItem("shock", "no");
     }
 
-    // store time, positions and velocities of two timesteps back
-    // "new" buffer holds positions/velocities before current integration step!
-    _timePreShock = _time;
-    std::swap(_fluidPositionsNew, _fluidPositionsPreShock);
-    std::swap(_fluidVelocitiesNew, _fluidVelocitiesPreShock);
+    if (!rolledBack) {
+        // store time, positions and velocities before the current integration step
+        // "new" buffer holds positions/velocities before current integration step!
+        _snapshots.push(_time, _fluidPositionsNew, _fluidVelocitiesNew);
+
+        _time += _timeStep;
+    }
+
+    DebugMonitor::addItem("timeStep", "%.5f", _timeStep);
+    DebugMonitor::addItem("time", "%.5f", _time);
+}
+
+void SPH::dfsphUpdateGrid() {
+    _fluidGrid.update(_fluidPositions, [&] (size_t i, size_t j) {
+        std::swap(_fluidPositions[i], _fluidPositions[j]);
+        std::swap(_fluidVelocities[i], _fluidVelocities[j]);
+        std::swap(_fluidKappa[i], _fluidKappa[j]);
+        std::swap(_fluidKappaV[i], _fluidKappaV[j]);
+        std::swap(_fluidMasses[i], _fluidMasses[j]);
+        std::swap(_fluidLevels[i], _fluidLevels[j]);
+    });
+}
+
+// Compute the DFSPH factors (alpha) based on [5] equation 11
+template<int Features>
+void SPH::dfsphUpdateFactors() {
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            Vector3f gradSum;
+            float gradDotSum = 0.f;
+            int neighbourCount = 0;
+
+            iterateFluidNeighbours(i, [&] (size_t j, const Vector3f &r, float r2, const Kernel &kernel) {
+                if (r2 < 1e-10f) {
+                    return;
+                }
+                Vector3f grad = _fluidMasses[j] * kernel.spikyGradConstant * kernel.spikyGrad(r, std::sqrt(r2));
+                gradSum += grad;
+                gradDotSum += grad.dot(grad);
+                ++neighbourCount;
+            });
+
+            if (Features & FeatureBoundaries) {
+                iterateNeighbours(_boundaryGrid, _boundaryPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
+                    if (r2 < 1e-10f) {
+                        return;
+                    }
+                    gradSum += _boundaryMasses[j] * _kernel.spikyGradConstant * _kernel.spikyGrad(r, std::sqrt(r2));
+                    ++neighbourCount;
+                });
+                gradSum += analyticBoundaryGradient(_fluidPositions[i]);
+            }
+
+            float denominator = gradSum.squaredNorm() + gradDotSum;
+            _fluidFactors[i] = denominator > 1e-6f ? _fluidDensities[i] / denominator : 0.f;
+            _fluidNeighbourCounts[i] = neighbourCount;
+        }
+    }, _fluidPartitioner);
+}
+
+void SPH::dfsphUpdateFactors() {
+    if (_features & FeatureBoundaries) {
+        dfsphUpdateFactors<FeatureBoundaries>();
+    } else {
+        dfsphUpdateFactors<0>();
+    }
+}
+
+// Compute the rate of density change due to the current velocities based on [5] equation 9
+template<int Features>
+void SPH::dfsphUpdateDensityChanges() {
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            const Vector3f &v_i = _fluidVelocities[i];
+            float densityChange = 0.f;
+
+            iterateFluidNeighbours(i, [&] (size_t j, const Vector3f &r, float r2, const Kernel &kernel) {
+                if (r2 < 1e-10f) {
+                    return;
+                }
+                densityChange += _fluidMasses[j] * (v_i - _fluidVelocities[j]).dot(kernel.spikyGradConstant * kernel.spikyGrad(r, std::sqrt(r2)));
+            });
+
+            if (Features & FeatureBoundaries) {
+                iterateNeighbours(_boundaryGrid, _boundaryPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
+                    if (r2 < 1e-10f) {
+                        return;
+                    }
+                    densityChange += _boundaryMasses[j] * v_i.dot(_kernel.spikyGradConstant * _kernel.spikyGrad(r, std::sqrt(r2)));
+                });
+                densityChange += analyticBoundaryDensityChange(_fluidPositions[i], v_i);
+            }
+
+            _fluidDensityChanges[i] = densityChange;
+        }
+    }, _fluidPartitioner);
+}
+
+void SPH::dfsphUpdateDensityChanges() {
+    if (_features & FeatureBoundaries) {
+        dfsphUpdateDensityChanges<FeatureBoundaries>();
+    } else {
+        dfsphUpdateDensityChanges<0>();
+    }
+}
+
+// Apply pressure accelerations given by the stiffness values kappa based on [5] equation 12
+template<int Features>
+void SPH::dfsphUpdateVelocities(const std::vector<float> &kappa) {
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this, &kappa] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            float k_i = kappa[i] / _fluidDensities[i];
+            Vector3f dv;
+
+            iterateFluidNeighbours(i, [&] (size_t j, const Vector3f &r, float r2, const Kernel &kernel) {
+                if (r2 < 1e-10f) {
+                    return;
+                }
+                float k_j = kappa[j] / _fluidDensities[j];
+                dv -= _fluidMasses[j] * (k_i + k_j) * kernel.spikyGradConstant * kernel.spikyGrad(r, std::sqrt(r2));
+            });
+
+            if (Features & FeatureBoundaries) {
+                iterateNeighbours(_boundaryGrid, _boundaryPositions, _fluidPositions[i], [&] (size_t j, const Vector3f &r, float r2) {
+                    if (r2 < 1e-10f) {
+                        return;
+                    }
+                    dv -= _boundaryMasses[j] * k_i * _kernel.spikyGradConstant * _kernel.spikyGrad(r, std::sqrt(r2));
+                });
+                dv -= k_i * analyticBoundaryGradient(_fluidPositions[i]);
+            }
+
+            _fluidVelocities[i] += _timeStep * dv;
+        }
+    }, _fluidPartitioner);
+}
+
+void SPH::dfsphUpdateVelocities(const std::vector<float> &kappa) {
+    if (_features & FeatureBoundaries) {
+        dfsphUpdateVelocities<FeatureBoundaries>(kappa);
+    } else {
+        dfsphUpdateVelocities<0>(kappa);
+    }
+}
+
+// Adjust time step according to the CFL condition
+void SPH::dfsphUpdateTimeStep() {
+    auto &maxVelocity = resetReduction(_scratch.maximum, 0.f);
+
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, maxVelocity, [&] (const ParallelRange &range, float &max) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            Vector3f v = _fluidVelocities[i] + _fluidForces[i] * (_timeStep / _fluidMasses[i]);
+            max = std::max(max, v.squaredNorm());
+        }
+    }, _fluidPartitioner);
+
+    _maxVelocity = std::sqrt(std::accumulate(maxVelocity.begin(), maxVelocity.end(), 0.f, [] (float a, float b) { return std::max(a, b); }));
+    _maxVelocity = std::max(1e-8f, _maxVelocity);
+
+    _timeStep = clamp(dfsph.cflFactor * _particleDiameter / _maxVelocity, dfsph.minTimeStep, dfsph.maxTimeStep);
+}
+
+void SPH::dfsphPredictVelocities() {
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            _fluidVelocities[i] += _fluidForces[i] * (_timeStep / _fluidMasses[i]);
+        }
+    }, _fluidPartitioner);
+}
+
+void SPH::dfsphUpdatePositions() {
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            _fluidPositions[i] += _fluidVelocities[i] * _timeStep;
+            handleCollision(_fluidPositions[i], _fluidVelocities[i]);
+        }
+    }, _fluidPartitioner);
+}
+
+// Iteratively correct velocities to enforce constant density based on [5] algorithm 3
+int SPH::dfsphCorrectDensityError() {
+    // Warm start using damped pressure values of last time step
+    if (dfsph.warmStart) {
+        parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                _fluidKappa[i] *= 0.5f;
+            }
+        }, _fluidPartitioner);
+        dfsphUpdateVelocities(_fluidKappa);
+    } else {
+        std::fill(_fluidKappa.begin(), _fluidKappa.end(), 0.f);
+    }
+
+    float invTimeStep2 = 1.f / sqr(_timeStep);
+
+    int k = 0;
+    while (true) {
+        dfsphUpdateDensityChanges();
+
+        float accDensityError = parallelReduce(_fluidPositions.size(), 0.f, [&] (size_t i, float &sum) {
+            float densityAdv = std::max(_fluidDensities[i] + _timeStep * _fluidDensityChanges[i], _restDensity);
+            float densityError = densityAdv - _restDensity;
+            sum += densityError;
+            _fluidKappaIteration[i] = densityError * _fluidFactors[i] * invTimeStep2;
+        }, std::plus<float>(), _fluidPartitioner);
+        dfsph.avgDensityError = accDensityError / (std::max(size_t(1), _fluidPositions.size()) * _restDensity);
+
+        if ((k >= dfsph.minIterations && dfsph.avgDensityError <= dfsph.maxDensityError) || k >= dfsph.maxIterations) {
+            break;
+        }
+
+        dfsphUpdateVelocities(_fluidKappaIteration);
+        parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                _fluidKappa[i] += _fluidKappaIteration[i];
+            }
+        }, _fluidPartitioner);
+        ++k;
+    }
+
+    return k;
+}
+
+// Iteratively correct velocities to enforce a divergence-free velocity field based on [5] algorithm 2
+int SPH::dfsphCorrectDivergenceError() {
+    // Warm start using damped pressure values of last time step
+    if (dfsph.warmStart) {
+        parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                _fluidKappaV[i] *= 0.5f;
+            }
+        }, _fluidPartitioner);
+        dfsphUpdateVelocities(_fluidKappaV);
+    } else {
+        std::fill(_fluidKappaV.begin(), _fluidKappaV.end(), 0.f);
+    }
+
+    float invTimeStep = 1.f / _timeStep;
+
+    int k = 0;
+    while (true) {
+        dfsphUpdateDensityChanges();
+
+        float accDivergenceError = parallelReduce(_fluidPositions.size(), 0.f, [&] (size_t i, float &sum) {
+            // Only correct divergence of particles with sufficient neighbours (not at the free surface)
+            float densityChange = _fluidNeighbourCounts[i] >= _kernelSupportParticles / 2 ? std::max(_fluidDensityChanges[i], 0.f) : 0.f;
+            sum += densityChange;
+            _fluidKappaIteration[i] = densityChange * _fluidFactors[i] * invTimeStep;
+        }, std::plus<float>(), _fluidPartitioner);
+        dfsph.avgDivergenceError = accDivergenceError / (std::max(size_t(1), _fluidPositions.size()) * _restDensity);
+
+        if ((k >= dfsph.minIterations && dfsph.avgDivergenceError <= dfsph.maxDivergenceError) || k >= dfsph.maxIterations) {
+            break;
+        }
+
+        dfsphUpdateVelocities(_fluidKappaIteration);
+        parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                _fluidKappaV[i] += _fluidKappaIteration[i];
+            }
+        }, _fluidPartitioner);
+        ++k;
+    }
+
+    return k;
+}
+
+void SPH::dfsphInit() {
+    if (startup.resumed) {
+        return;
+    }
+    std::fill(_fluidKappa.begin(), _fluidKappa.end(), 0.f);
+    std::fill(_fluidKappaV.begin(), _fluidKappaV.end(), 0.f);
+    _time = 0.f;
+}
+
+void SPH::dfsphUpdate() {
+    DebugMonitor::clear();
+
+    Profiler::profile("Update Grid", [&] () {
+        dfsphUpdateGrid();
+    });
+
+    Profiler::profile("Activate Boundary", [&] () {
+        activateBoundaryParticles();
+    });
+
+    Profiler::profile("Update Densities", [&] () {
+        updateDensities();
+        dfsphUpdateFactors();
+    });
+
+    int divergenceIterations = 0;
+    Profiler::profile("Correct divergence", [&] () {
+        divergenceIterations = dfsphCorrectDivergenceError();
+    });
+
+    Profiler::profile("Update Normals", [&] () {
+        updateNormals();
+    });
+
+    Profiler::profile("Initialize Forces", [&] () {
+        pcisphInitializeForces();
+    });
+
+    bool resample = adaptive.enabled && ++adaptive.steps >= adaptive.interval;
+    if (resample) {
+        Profiler::profile("Update surface distances", [&] () {
+            adaptiveUpdateSurfaceDistances();
+        });
+    }
+
+    Profiler::profile("Update time step", [&] () {
+        dfsphUpdateTimeStep();
+    });
+
+    if (implicitViscosity.enabled) {
+        Profiler::profile("Implicit Viscosity", [&] () {
+            solveImplicitViscosity();
+        });
+    }
+
+    Profiler::profile("Predict velocities", [&] () {
+        dfsphPredictVelocities();
+    });
+
+    int densityIterations = 0;
+    Profiler::profile("Correct density", [&] () {
+        densityIterations = dfsphCorrectDensityError();
+    });
+
+    Profiler::profile("Update positions", [&] () {
+        dfsphUpdatePositions();
+    });
+
+    if (resample) {
+        Profiler::profile("Resample", [&] () {
+            adaptiveResample();
+        });
+        adaptive.steps = 0;
+    }
+
+    _time += _timeStep;
+
+    DebugMonitor::addItem("fluidParticles", "%d", _fluidPositions.size());
+    DebugMonitor::addItem("boundaryParticles", "%d", _boundaryPositions.size());
+    if (adaptive.enabled) {
+        DebugMonitor::addItem("merged", "%d", adaptive.merged);
+        DebugMonitor::addItem("split", "%d", adaptive.split);
+    }
+    if (implicitViscosity.enabled) {
+        DebugMonitor::addItem("viscosityIterations", "%d", implicitViscosity.iterations);
+    }
+
+    DebugMonitor::addItem("densityIterations", "%d", densityIterations);
+    DebugMonitor::addItem("divergenceIterations", "%d", divergenceIterations);
+    DebugMonitor::addItem("avgDensityError", "%.3f%%", dfsph.avgDensityError * 100.f);
+    DebugMonitor::addItem("avgDivergenceError", "%.3f%%", dfsph.avgDivergenceError * 100.f);
+    DebugMonitor::addItem("maxVelocity", "%.3f", _maxVelocity);
+    DebugMonitor::addItem("timeStep", "%.5f", _timeStep);
+    DebugMonitor::addItem("time", "%.5f", _time);
+}
+
+// Compute the distance of each particle to the free surface or boundary, measured in neighbourhood layers.
+// Particles at the free surface or close to the boundary have distance zero, distances are clamped to
+// the number of layers needed to reach the coarsest level.
+void SPH::adaptiveUpdateSurfaceDistances() {
+    const size_t count = _fluidPositions.size();
+    const int maxDistance = adaptive.maxLevel * adaptive.bandWidth + 1;
+
+    adaptive.distances.resize(count);
+    adaptive.distancesNew.resize(count);
+
+    parallelForRange(0, count, ParticleGrainSize, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            bool surface = _fluidNormals[i].norm() > adaptive.surfaceThreshold ||
+                           _fluidNeighbourCounts[i] < _kernelSupportParticles / 2 ||
+                           hasNeighbours(_boundaryGrid, _boundaryPositions, _fluidPositions[i]) ||
+                           (hasAnalyticBoundary() && analyticBoundaryDensity(_fluidPositions[i]) > 0.f);
+            adaptive.distances[i] = surface ? 0 : maxDistance;
+        }
+    }, _fluidPartitioner);
+
+    for (int layer = 0; layer < maxDistance; ++layer) {
+        parallelForRange(0, count, ParticleGrainSize, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                int distance = adaptive.distances[i];
+                iterateFluidNeighbours(i, [&] (size_t j, const Vector3f &r, float r2, const Kernel &kernel) {
+                    distance = std::min(distance, adaptive.distances[j] + 1);
+                });
+                adaptive.distancesNew[i] = distance;
+            }
+        }, _fluidPartitioner);
+        std::swap(adaptive.distances, adaptive.distancesNew);
+    }
+}
+
+// Merge pairs of particles far away from the surface and split particles that got too close to the surface (see [8]).
+// A particle of mass level l (mass = 2^l * particleMass) is allowed at distances >= l * bandWidth. Merging requires
+// an additional layer of distance to avoid particles being merged and split back and forth.
+// The kernel level of a particle follows its mass level with a delay of one resampling step. This way, split
+// particles initially interact with the coarse kernel of their parent, which avoids density spikes.
+// Mass and momentum are conserved, particles change by at most one level per resampling step.
+// Resampling runs in parallel: each particle picks its closest merge partner and decides its action, the new
+// particles are counted per block, and an exclusive prefix sum over the block counts gives the slots the
+// blocks scatter their particles to (as the new order only depends on the old one, results are deterministic).
+// Pairs are merged if both particles picked each other, other candidates wait for the next resampling step.
+void SPH::adaptiveResample() {
+    enum Action {
+        Keep,
+        Split,
+        Merge,                              ///< Merged with its partner (the partner with the lower index emits the particle)
+        Merged,                             ///< Merged into its partner
+    };
+
+    const size_t count = _fluidPositions.size();
+    const size_t blockCount = (count + ParticleGrainSize - 1) / ParticleGrainSize;
+
+    auto massLevel = [this] (size_t i) {
+        return int(std::lround(std::log2(_fluidMasses[i] * _invParticleMass)));
+    };
+    auto mergeDistance = [this] (int level) {
+        return (level + 1) * adaptive.bandWidth + 1;
+    };
+
+    // Closest merge partner of each particle (the particle itself if there is none)
+    std::vector<size_t> &partners = _scratch.indices;
+    partners.resize(count);
+    parallelForRange(0, count, ParticleGrainSize, [&] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            partners[i] = i;
+            int level = massLevel(i);
+            if (level >= adaptive.maxLevel || adaptive.distances[i] < mergeDistance(level)) {
+                continue;
+            }
+            const Vector3f &p_i = _fluidPositions[i];
+            float radius = 0.5f * _levelKernels[level].h;
+            float minDistance2 = sqr(radius);
+            _fluidGrid.lookup(p_i, radius, [&] (size_t j) {
+                if (j != i && massLevel(j) == level && adaptive.distances[j] >= mergeDistance(level)) {
+                    float distance2 = (p_i - _fluidPositions[j]).squaredNorm();
+                    if (distance2 < minDistance2) {
+                        minDistance2 = distance2;
+                        partners[i] = j;
+                    }
+                }
+                return true;
+            });
+        }
+    }, _fluidPartitioner);
+
+    // Actions and number of new particles per block
+    std::vector<int> &actions = _scratch.flags;
+    std::vector<size_t> &offsets = _scratch.offsets;
+    actions.resize(count);
+    offsets.resize(blockCount + 1);
+    auto &splitCount = resetReduction(_scratch.counts, size_t(0));
+    parallelForRange(0, blockCount, 1, splitCount, [&] (const ParallelRange &range, size_t &splits) {
+        for (size_t block = range.begin(); block < range.end(); ++block) {
+            size_t blockNewCount = 0;
+            for (size_t i = block * ParticleGrainSize; i < std::min(count, (block + 1) * ParticleGrainSize); ++i) {
+                size_t j = partners[i];
+                Action action = Keep;
+                if (j != i && partners[j] == i) {
+                    action = i < j ? Merge : Merged;
+                } else if (adaptive.distances[i] < massLevel(i) * adaptive.bandWidth) {
+                    action = Split;
+                    ++splits;
+                }
+                actions[i] = action;
+                blockNewCount += action == Split ? 2 : (action == Merged ? 0 : 1);
+            }
+            offsets[block + 1] = blockNewCount;
+        }
+    });
+    offsets[0] = 0;
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    const size_t newCount = offsets[blockCount];
+
+    // New particle buffers (swapped with the current ones at the end)
+    std::vector<Vector3f> &positions = _scratch.positions;
+    std::vector<Vector3f> &velocities = _scratch.velocities;
+    std::vector<float> &masses = _scratch.masses;
+    std::vector<int> &levels = _scratch.levels;
+    std::vector<float> &kappa = _scratch.kappa;
+    std::vector<float> &kappaV = _scratch.kappaV;
+    positions.reserve(adaptive.capacity);
+    velocities.reserve(adaptive.capacity);
+    masses.reserve(adaptive.capacity);
+    levels.reserve(adaptive.capacity);
+    kappa.reserve(adaptive.capacity);
+    kappaV.reserve(adaptive.capacity);
+    positions.resize(newCount);
+    velocities.resize(newCount);
+    masses.resize(newCount);
+    levels.resize(newCount);
+    kappa.resize(newCount);
+    kappaV.resize(newCount);
+
+    // Split directions are drawn from a stream per particle, so they don't depend on the thread schedule
+    uint64_t seed = adaptive.rng.nextUInt();
+
+    parallelForRange(0, blockCount, 1, [&] (const ParallelRange &range) {
+        for (size_t block = range.begin(); block < range.end(); ++block) {
+            size_t slot = offsets[block];
+            auto addParticle = [&] (const Vector3f &p, const Vector3f &v, float m, int level, float k, float kv) {
+                positions[slot] = p;
+                velocities[slot] = v;
+                masses[slot] = m;
+                levels[slot] = level;
+                kappa[slot] = k;
+                kappaV[slot] = kv;
+                ++slot;
+            };
+
+            for (size_t i = block * ParticleGrainSize; i < std::min(count, (block + 1) * ParticleGrainSize); ++i) {
+                const Vector3f &p_i = _fluidPositions[i];
+                const Vector3f &v_i = _fluidVelocities[i];
+                float m_i = _fluidMasses[i];
+                int level = massLevel(i);
+
+                switch (actions[i]) {
+                case Keep:
+                    addParticle(p_i, v_i, m_i, level, _fluidKappa[i], _fluidKappaV[i]);
+                    break;
+                case Merge: {
+                    size_t j = partners[i];
+                    float m_j = _fluidMasses[j];
+                    float m = m_i + m_j;
+                    addParticle(
+                        (m_i * p_i + m_j * _fluidPositions[j]) / m,
+                        (m_i * v_i + m_j * _fluidVelocities[j]) / m,
+                        m, _fluidLevels[i],
+                        (m_i * _fluidKappa[i] + m_j * _fluidKappa[j]) / m,
+                        (m_i * _fluidKappaV[i] + m_j * _fluidKappaV[j]) / m
+                    );
+                    break;
+                }
+                case Merged:
+                    break;
+                case Split: {
+                    // Split into two particles placed one (child) particle diameter apart. Out of a few random directions,
+                    // use the one that keeps the children furthest away from existing neighbours.
+                    pcg32 rng(seed, i);
+                    float childRadius = _particleRadius * std::pow(2.f, (level - 1) / 3.f);
+                    float maxDistance2 = -1.f;
+                    Vector3f offset;
+                    for (int k = 0; k < 4; ++k) {
+                        float z = 2.f * rng.nextFloat() - 1.f;
+                        float phi = 2.f * float(M_PI) * rng.nextFloat();
+                        float s = std::sqrt(std::max(0.f, 1.f - sqr(z)));
+                        Vector3f candidate = Vector3f(s * std::cos(phi), s * std::sin(phi), z) * childRadius;
+                        float minDistance2 = std::numeric_limits<float>::infinity();
+                        _fluidGrid.lookup(p_i, 4.f * childRadius, [&] (size_t j) {
+                            if (j != i) {
+                                Vector3f r = p_i - _fluidPositions[j];
+                                minDistance2 = std::min(minDistance2, std::min((r + candidate).squaredNorm(), (r - candidate).squaredNorm()));
+                            }
+                            return true;
+                        });
+                        if (minDistance2 > maxDistance2) {
+                            maxDistance2 = minDistance2;
+                            offset = candidate;
+                        }
+                    }
+                    addParticle(p_i - offset, v_i, 0.5f * m_i, _fluidLevels[i], _fluidKappa[i], _fluidKappaV[i]);
+                    addParticle(p_i + offset, v_i, 0.5f * m_i, _fluidLevels[i], _fluidKappa[i], _fluidKappaV[i]);
+                    break;
+                }
+                }
+            }
+        }
+    });
+
+    adaptive.split = int(std::accumulate(splitCount.begin(), splitCount.end(), size_t(0)));
+    adaptive.merged = int(count + adaptive.split - newCount);
+
+    std::swap(_fluidPositions, positions);
+    std::swap(_fluidVelocities, velocities);
+    std::swap(_fluidMasses, masses);
+    std::swap(_fluidLevels, levels);
+    std::swap(_fluidKappa, kappa);
+    std::swap(_fluidKappaV, kappaV);
+
+    // Resize buffers that are recomputed every step
+    _fluidNormals.resize(newCount);
+    _fluidForces.resize(newCount);
+    _fluidPressureForces.resize(newCount);
+    _fluidDensities.resize(newCount);
+    _fluidPressures.resize(newCount);
+    _fluidFactors.resize(newCount);
+    _fluidDensityChanges.resize(newCount);
+    _fluidKappaIteration.resize(newCount);
+    _fluidNeighbourCounts.resize(newCount);
+    _fluidSleeping.resize(newCount, 0);
+    _fluidActive.resize(newCount, 1);
+    _fluidSurface.resize(newCount, 1);
+
+    // Swapped in buffers and slabs of the new particle count are not placed yet
+    placeFluidParticles();
+}
+
+// Predict positions using non-pressure forces
+void SPH::pbfPredictPositions() {
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            _fluidVelocitiesNew[i] = _fluidVelocities[i] + _invParticleMass * _fluidForces[i] * _timeStep;
+            _fluidPositionsNew[i] = _fluidPositions[i] + _fluidVelocitiesNew[i] * _timeStep;
+        }
+    }, _fluidPartitioner);
+}
+
+// Compute density constraints and lagrange multipliers based on [6] equation 11
+// Densities are clamped to the rest density to only enforce non-compression.
+template<int Features>
+void SPH::pbfUpdateLambdas() {
+    float accDensityError = parallelReduce(_fluidPositions.size(), 0.f, [&] (size_t i, float &sum) {
+        float fluidDensity = 0.f;
+        Vector3f gradSum;
+        float gradDotSum = 0.f;
+
+        iterateNeighbours2(_fluidGrid, _fluidPositionsNew, _fluidPositions[i], _fluidPositionsNew[i], [&] (size_t j, const Vector3f &r, float r2) {
+            fluidDensity += _kernel.poly6(r2);
+            if (r2 < 1e-10f) {
+                return;
+            }
+            Vector3f grad = _particleMass * _kernel.spikyGradConstant * _kernel.spikyGrad(r, std::sqrt(r2));
+            gradSum += grad;
+            gradDotSum += grad.dot(grad);
+        });
+        float density = _kernel.poly6Constant * _particleMass * fluidDensity;
+
+        if (Features & FeatureBoundaries) {
+            float boundaryDensity = 0.f;
+            iterateNeighbours(_boundaryGrid, _boundaryPositions, _fluidPositionsNew[i], [&] (size_t j, const Vector3f &r, float r2) {
+                boundaryDensity += _kernel.poly6(r2) * _boundaryMasses[j];
+                if (r2 < 1e-10f) {
+                    return;
+                }
+                gradSum += _boundaryMasses[j] * _kernel.spikyGradConstant * _kernel.spikyGrad(r, std::sqrt(r2));
+            });
+            density += _kernel.poly6Constant * boundaryDensity;
+            density += analyticBoundaryDensity(_fluidPositionsNew[i]);
+            gradSum += analyticBoundaryGradient(_fluidPositionsNew[i]);
+        }
+
+        float constraint = std::max(density / _restDensity - 1.f, 0.f);
+        sum += constraint;
+
+        float gradNorm2 = (gradSum.squaredNorm() + gradDotSum) / sqr(_restDensity);
+        _fluidLambdas[i] = -constraint / (gradNorm2 + pbf.relaxation);
+    }, std::plus<float>(), _fluidPartitioner);
+
+    pbf.avgDensityError = accDensityError / std::max(size_t(1), _fluidPositions.size());
+}
+
+void SPH::pbfUpdateLambdas() {
+    if (_features & FeatureBoundaries) {
+        pbfUpdateLambdas<FeatureBoundaries>();
+    } else {
+        pbfUpdateLambdas<0>();
+    }
+}
+
+// Compute position corrections based on [6] equation 14 (equation 12 with the artificial pressure s_corr of
+// equation 13, n = 4). Clamping the constraint only stops particles from attracting each other in the solve,
+// s_corr additionally pushes apart particles that cluster at the free surface.
+// Initial relaxation runs before pbfInit(), so it projects without s_corr.
+template<int Features>
+void SPH::pbfUpdatePositionCorrections() {
+    float invKernelDeltaQ = 1.f / _kernel.poly6(sqr(pbf.tensileDistance * _kernelRadius));
+
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this, invKernelDeltaQ] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            const float &lambda_i = _fluidLambdas[i];
+            Vector3f correction;
+
+            iterateNeighbours2(_fluidGrid, _fluidPositionsNew, _fluidPositions[i], _fluidPositionsNew[i], [&] (size_t j, const Vector3f &r, float r2) {
+                if (r2 < 1e-10f) {
+                    return;
+                }
+                float corr = pbf.tensilePressure * sqr(sqr(_kernel.poly6(r2) * invKernelDeltaQ));
+                correction += _particleMass * (lambda_i + _fluidLambdas[j] + corr) * _kernel.spikyGradConstant * _kernel.spikyGrad(r, std::sqrt(r2));
+            });
+
+            if (Features & FeatureBoundaries) {
+                iterateNeighbours(_boundaryGrid, _boundaryPositions, _fluidPositionsNew[i], [&] (size_t j, const Vector3f &r, float r2) {
+                    if (r2 < 1e-10f) {
+                        return;
+                    }
+                    correction += _boundaryMasses[j] * lambda_i * _kernel.spikyGradConstant * _kernel.spikyGrad(r, std::sqrt(r2));
+                });
+                correction += lambda_i * analyticBoundaryGradient(_fluidPositionsNew[i]);
+            }
+
+            _fluidPositionCorrections[i] = correction * (1.f / _restDensity);
+        }
+    }, _fluidPartitioner);
+
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            _fluidPositionsNew[i] += _fluidPositionCorrections[i];
+        }
+    }, _fluidPartitioner);
+}
+
+void SPH::pbfUpdatePositionCorrections() {
+    if (_features & FeatureBoundaries) {
+        pbfUpdatePositionCorrections<FeatureBoundaries>();
+    } else {
+        pbfUpdatePositionCorrections<0>();
+    }
+}
+
+// Derive velocities from projected positions
+void SPH::pbfUpdateVelocitiesAndPositions() {
+    auto &maxVelocity = resetReduction(_scratch.maximum, 0.f);
+
+    float invTimeStep = 1.f / _timeStep;
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, maxVelocity, [&] (const ParallelRange &range, float &max) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            _fluidVelocities[i] = (_fluidPositionsNew[i] - _fluidPositions[i]) * invTimeStep;
+            _fluidPositions[i] = _fluidPositionsNew[i];
+            max = std::max(max, _fluidVelocities[i].squaredNorm());
+            handleCollision(_fluidPositions[i], _fluidVelocities[i]);
+        }
+    }, _fluidPartitioner);
+
+    _maxVelocity = std::sqrt(std::accumulate(maxVelocity.begin(), maxVelocity.end(), 0.f, [] (float a, float b) { return std::max(a, b); }));
+}
+
+void SPH::pbfInit() {
+    _timeStep = pbf.timeStep;
+
+    // s_corr is a lambda (scaled by the inverse constraint gradient), the constant k of [6] only suits the scale of
+    // its scenes. Scale it by the constraint gradient of a prototype particle with a filled neighbourhood instead,
+    // so a strength k corrects like a density error of k.
+    float gradDotSum = 0.f;
+    for (float x = -_kernelRadius - _particleRadius; x <= _kernelRadius + _particleRadius; x += 2.f * _particleRadius) {
+        for (float y = -_kernelRadius - _particleRadius; y <= _kernelRadius + _particleRadius; y += 2.f * _particleRadius) {
+            for (float z = -_kernelRadius - _particleRadius; z <= _kernelRadius + _particleRadius; z += 2.f * _particleRadius) {
+                Vector3f r = Vector3f(x, y, z);
+                float r2 = r.squaredNorm();
+                if (r2 < _kernelRadius2 && r2 > 1e-10f) {
+                    Vector3f grad = _particleMass * _kernel.spikyGradConstant * _kernel.spikyGrad(r, std::sqrt(r2));
+                    gradDotSum += grad.dot(grad);
+                }
+            }
+        }
+    }
+    pbf.tensilePressure = -pbf.tensileStrength * sqr(_restDensity) / gradDotSum;
+    DBG("pbf.tensilePressure = %g", pbf.tensilePressure);
+
+    if (!startup.resumed) {
+        _time = 0.f;
+    }
+}
+
+void SPH::pbfUpdate() {
+    DebugMonitor::clear();
+
+    Profiler::profile("Update Grid", [&] () {
+        pcisphUpdateGrid();
+    });
+
+    Profiler::profile("Activate Boundary", [&] () {
+        activateBoundaryParticles();
+    });
+
+    Profiler::profile("Update Densities", [&] () {
+        updateDensities();
+    });
+
+    Profiler::profile("Update Normals", [&] () {
+        updateNormals();
+    });
+
+    Profiler::profile("Initialize Forces", [&] () {
+        pcisphInitializeForces();
+    });
+
+    if (implicitViscosity.enabled) {
+        Profiler::profile("Implicit Viscosity", [&] () {
+            solveImplicitViscosity();
+        });
+    }
+
+    Profiler::profile("Predict positions", [&] () {
+        pbfPredictPositions();
+    });
+
+    for (int k = 0; k < pbf.iterations; ++k) {
+        Profiler::profile("Update lambdas", [&] () {
+            pbfUpdateLambdas();
+        });
+        Profiler::profile("Update positions", [&] () {
+            pbfUpdatePositionCorrections();
+        });
+    }
+
+    Profiler::profile("Update velocities/positions", [&] () {
+        pbfUpdateVelocitiesAndPositions();
+    });
 
     _time += _timeStep;
 
+    DebugMonitor::addItem("fluidParticles", "%d", _fluidPositions.size());
+    DebugMonitor::addItem("boundaryParticles", "%d", _boundaryPositions.size());
+    if (implicitViscosity.enabled) {
+        DebugMonitor::addItem("viscosityIterations", "%d", implicitViscosity.iterations);
+    }
+
+    DebugMonitor::addItem("iterations", "%d", pbf.iterations);
+    DebugMonitor::addItem("avgDensityError", "%.3f%%", pbf.avgDensityError * 100.f);
+    DebugMonitor::addItem("maxVelocity", "%.3f", _maxVelocity);
     DebugMonitor::addItem("timeStep", "%.5f", _timeStep);
     DebugMonitor::addItem("time", "%.5f", _time);
 }
 
 
-void SPH::buildScene(const Scene &scene) {
+// Set up emitters and sinks. The size of the particle pool is derived from the emission rates and
+// durations of the emitters, unbounded emitters use a fixed headroom (maxFluidParticles setting).
+void SPH::emissionInit(const Scene &scene) {
+    emission.enabled = !scene.emitters.empty() || !scene.sinks.empty();
+
+    size_t count = _fluidPositions.size();
+    size_t capacity = count;
+    bool bounded = true;
+
+    for (const auto &shape : scene.emitters) {
+        if (!_bounds.contains(shape.bounds)) {
+            throw Exception("Emitter is not inside the world bounds:\n%s", shape.toString());
+        }
+
+        // Layers of particles are emitted on the face orthogonal to the dominant velocity axis
+        int axis;
+        float speed = shape.velocity.cwiseAbs().maxCoeff(&axis);
+        if (speed <= 0.f) {
+            DBG("emitter has zero velocity, ignoring");
+            continue;
+        }
+        int u = (axis + 1) % 3;
+        int v = (axis + 2) % 3;
+
+        Emitter emitter(shape);
+        emitter.direction = Vector3f(0.f);
+        emitter.direction[axis] = shape.velocity[axis] > 0.f ? 1.f : -1.f;
+
+        Vector3f extents = shape.bounds.extents();
+        int nu = std::max(1, int(std::ceil(extents[u] / _particleDiameter)));
+        int nv = std::max(1, int(std::ceil(extents[v] / _particleDiameter)));
+        Vector3f origin = shape.bounds.min + Vector3f(_particleRadius);
+        origin[axis] = shape.velocity[axis] > 0.f ? shape.bounds.min[axis] + _particleRadius : shape.bounds.max[axis] - _particleRadius;
+        for (int iu = 0; iu < nu; ++iu) {
+            for (int iv = 0; iv < nv; ++iv) {
+                Vector3f p = origin;
+                p[u] += iu * extents[u] / nu;
+                p[v] += iv * extents[v] / nv;
+                emitter.layer.emplace_back(p);
+            }
+        }
+
+        float duration = shape.end - std::max(0.f, shape.start);
+        if (std::isfinite(duration)) {
+            float rate = emitter.layer.size() * speed / _particleDiameter;
+            capacity += size_t(std::ceil(rate * std::max(0.f, duration))) + emitter.layer.size();
+        } else {
+            bounded = false;
+        }
+
+        emission.emitters.emplace_back(std::move(emitter));
+    }
+
+    for (const auto &sink : scene.sinks) {
+        emission.sinks.emplace_back(sink.bounds);
+    }
+
+    if (!bounded) {
+        capacity = count + 100000;
+    }
+    capacity = std::max(count, size_t(std::max(0, scene.settings.getInteger("maxFluidParticles", int(capacity)))));
+
+    emission.pool.init(count, capacity);
+    if (emission.enabled) {
+        emission.slots.reserve(capacity);
+        emission.positions.reserve(capacity);
+        emission.velocities.reserve(capacity);
+    }
+}
+
+// Remove particles in sinks and emit new particles. Sinks are only evaluated every sinkInterval steps.
+// Released slots are refilled by emitted particles first, the remaining ones are compacted right away,
+// so the solvers only ever see live particles.
+void SPH::updateEmission() {
+    size_t changes = emission.emitted + emission.removed;
+
+    if (!emission.sinks.empty() && ++emission.steps >= emission.sinkInterval) {
+        updateSinks();
+        emission.steps = 0;
+    }
+
+    updateEmitters();
+
+    if (emission.pool.freeCount() > 0) {
+        emission.pool.compact([this] (size_t dst, size_t src) {
+            moveFluidParticle(dst, src);
+        });
+        resizeFluidParticles(emission.pool.size());
+    }
+
+    // Snapshots can only be restored for the same set of particles, slabs of the domain decomposition
+    // moved with the particle count
+    if (emission.emitted + emission.removed != changes) {
+        _snapshots.clear();
+        placeFluidParticles();
+    }
+}
+
+// Release the slots of all particles inside a sink
+void SPH::updateSinks() {
+    std::vector<int> &removed = _scratch.flags;
+    removed.assign(_fluidPositions.size(), 0);
+    parallelForRange(0, _fluidPositions.size(), ParticleGrainSize, [this, &removed] (const ParallelRange &range) {
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            for (const auto &sink : emission.sinks) {
+                if (sink.contains(_fluidPositions[i])) {
+                    removed[i] = 1;
+                    break;
+                }
+            }
+        }
+    }, _fluidPartitioner);
+
+    for (size_t i = 0; i < removed.size(); ++i) {
+        if (removed[i]) {
+            emission.pool.release(i);
+            ++emission.removed;
+        }
+    }
+}
+
+// Emit a layer of particles whenever the last layer has moved one particle diameter away from the
+// upstream face. Sites that are still occupied by fluid (e.g. backed up or slowed down by the flow)
+// are skipped, emitting into them would compress the fluid. Time going back (shock rollback) takes
+// back the distance travelled.
+void SPH::updateEmitters() {
+    float dt = _time - emission.time;
+    emission.time = _time;
+
+    // Grid still holds the particle order of the last step, positions have moved less than a cell since
+    const float minDistance2 = sqr(0.9f * _particleDiameter);
+    auto occupied = [&] (const Vector3f &p) {
+        bool result = false;
+        _fluidGrid.lookup(p, _particleDiameter, [&] (size_t j) {
+            if (!emission.pool.isFree(j) && (p - _fluidPositions[j]).squaredNorm() < minDistance2) {
+                result = true;
+                return false;
+            }
+            return true;
+        });
+        return result;
+    };
+
+    emission.slots.clear();
+    emission.positions.clear();
+    emission.velocities.clear();
+    emission.poolFull = false;
+
+    for (auto &emitter : emission.emitters) {
+        if (_time < emitter.shape.start || _time >= emitter.shape.end) {
+            continue;
+        }
+        float speed = std::abs(emitter.shape.velocity.dot(emitter.direction));
+        emitter.distance = std::max(0.f, emitter.distance + speed * dt);
+        while (emitter.distance >= _particleDiameter) {
+            emitter.distance -= _particleDiameter;
+            for (const auto &site : emitter.layer) {
+                Vector3f p = site + emitter.direction * emitter.distance;
+                if (occupied(p)) {
+                    continue;
+                }
+                if (emission.pool.full()) {
+                    emission.poolFull = true;
+                    break;
+                }
+                emission.slots.emplace_back(emission.pool.allocate());
+                emission.positions.emplace_back(p);
+                emission.velocities.emplace_back(emitter.shape.velocity);
+            }
+        }
+    }
+
+    if (emission.slots.empty()) {
+        return;
+    }
+
+    resizeFluidParticles(emission.pool.size());
+    parallelForRange(0, emission.slots.size(), ParticleGrainSize, [this] (const ParallelRange &range) {
+        for (size_t k = range.begin(); k < range.end(); ++k) {
+            resetFluidParticle(emission.slots[k], emission.positions[k], emission.velocities[k]);
+        }
+    });
+    emission.emitted += emission.slots.size();
+}
+
+// Reserve all fluid particle buffers (and per-particle scratch buffers) for the given number of particles
+void SPH::reserveFluidParticles(size_t capacity) {
+    _fluidPositions.reserve(capacity);
+    _fluidVelocities.reserve(capacity);
+    _fluidPositionsNew.reserve(capacity);
+    _fluidVelocitiesNew.reserve(capacity);
+    _fluidNormals.reserve(capacity);
+    _fluidForces.reserve(capacity);
+    _fluidPressureForces.reserve(capacity);
+    _fluidDensities.reserve(capacity);
+    _fluidPressures.reserve(capacity);
+    _fluidFactors.reserve(capacity);
+    _fluidDensityChanges.reserve(capacity);
+    _fluidKappa.reserve(capacity);
+    _fluidKappaV.reserve(capacity);
+    _fluidKappaIteration.reserve(capacity);
+    _fluidNeighbourCounts.reserve(capacity);
+    _fluidLambdas.reserve(capacity);
+    _fluidPositionCorrections.reserve(capacity);
+    _fluidRestingSteps.reserve(capacity);
+    _fluidRestPositions.reserve(capacity);
+    _fluidSleeping.reserve(capacity);
+    _fluidActive.reserve(capacity);
+    _fluidSurface.reserve(capacity);
+    _fluidTimeStepLevels.reserve(capacity);
+    _fluidMasses.reserve(capacity);
+    _fluidLevels.reserve(capacity);
+    _fluidGrid.reserve(capacity);
+
+    if (multiRate.enabled) {
+        multiRate.levelsNew.reserve(capacity);
+    }
+    if (adaptive.enabled) {
+        adaptive.distances.reserve(capacity);
+        adaptive.distancesNew.reserve(capacity);
+    }
+    if (implicitViscosity.enabled) {
+        implicitViscosity.diagonal.reserve(capacity);
+        implicitViscosity.b.reserve(capacity);
+        implicitViscosity.r.reserve(capacity);
+        implicitViscosity.z.reserve(capacity);
+        implicitViscosity.p.reserve(capacity);
+        implicitViscosity.Ap.reserve(capacity);
+    }
+    if (precision.enabled) {
+        precision.densities.reserve(capacity);
+        precision.pressures.reserve(capacity);
+        precision.normals.reserve(capacity);
+    }
+    _scratch.flags.reserve(capacity);
+    if (adaptive.enabled) {
+        _scratch.indices.reserve(capacity);
+        _scratch.offsets.reserve(capacity / ParticleGrainSize + 2);
+    }
+}
+
+// Resize all fluid particle buffers, new particles get default attributes
+void SPH::resizeFluidParticles(size_t count) {
+    _fluidPositions.resize(count);
+    _fluidVelocities.resize(count);
+    _fluidPositionsNew.resize(count);
+    _fluidVelocitiesNew.resize(count);
+    _fluidNormals.resize(count);
+    _fluidForces.resize(count);
+    _fluidPressureForces.resize(count);
+    _fluidDensities.resize(count);
+    _fluidPressures.resize(count);
+    _fluidFactors.resize(count);
+    _fluidDensityChanges.resize(count);
+    _fluidKappa.resize(count);
+    _fluidKappaV.resize(count);
+    _fluidKappaIteration.resize(count);
+    _fluidNeighbourCounts.resize(count);
+    _fluidLambdas.resize(count);
+    _fluidPositionCorrections.resize(count);
+    _fluidRestingSteps.resize(count, 0);
+    _fluidRestPositions.resize(count);
+    _fluidSleeping.resize(count, 0);
+    _fluidActive.resize(count, 1);
+    _fluidSurface.resize(count, 1);
+    _fluidTimeStepLevels.resize(count, 0);
+    _fluidMasses.resize(count, _particleMass);
+    _fluidLevels.resize(count, 0);
+
+    if (multiRate.enabled) {
+        multiRate.levelsNew.resize(count);
+    }
+    if (implicitViscosity.enabled) {
+        implicitViscosity.diagonal.resize(count);
+        implicitViscosity.b.resize(count);
+        implicitViscosity.r.resize(count);
+        implicitViscosity.z.resize(count);
+        implicitViscosity.p.resize(count);
+        implicitViscosity.Ap.resize(count);
+    }
+}
+
+// Move the pages of the main fluid buffers to the NUMA nodes of the slabs owning them
+void SPH::placeFluidParticles() {
+    if (!domains.arenas) {
+        return;
+    }
+    domains.arenas->place(_fluidPositions);
+    domains.arenas->place(_fluidVelocities);
+    domains.arenas->place(_fluidPositionsNew);
+    domains.arenas->place(_fluidVelocitiesNew);
+    domains.arenas->place(_fluidNormals);
+    domains.arenas->place(_fluidForces);
+    domains.arenas->place(_fluidPressureForces);
+    domains.arenas->place(_fluidDensities);
+    domains.arenas->place(_fluidPressures);
+}
+
+// Initialize a (new or reused) fluid particle slot
+void SPH::resetFluidParticle(size_t i, const Vector3f &p, const Vector3f &v) {
+    _fluidPositions[i] = p;
+    _fluidVelocities[i] = v;
+    _fluidPositionsNew[i] = p;
+    _fluidVelocitiesNew[i] = v;
+    _fluidNormals[i] = Vector3f(0.f);
+    _fluidForces[i] = Vector3f(0.f);
+    _fluidPressureForces[i] = Vector3f(0.f);
+    _fluidDensities[i] = 0.f;
+    _fluidPressures[i] = 0.f;
+    _fluidFactors[i] = 0.f;
+    _fluidDensityChanges[i] = 0.f;
+    _fluidKappa[i] = 0.f;
+    _fluidKappaV[i] = 0.f;
+    _fluidKappaIteration[i] = 0.f;
+    _fluidNeighbourCounts[i] = 0;
+    _fluidLambdas[i] = 0.f;
+    _fluidPositionCorrections[i] = Vector3f(0.f);
+    _fluidRestingSteps[i] = 0;
+    _fluidRestPositions[i] = p;
+    _fluidSleeping[i] = 0;
+    _fluidActive[i] = 1;
+    _fluidSurface[i] = 1;
+    _fluidTimeStepLevels[i] = 0;
+    _fluidMasses[i] = _particleMass;
+    _fluidLevels[i] = 0;
+}
+
+// Move a fluid particle to another slot
+void SPH::moveFluidParticle(size_t dst, size_t src) {
+    _fluidPositions[dst] = _fluidPositions[src];
+    _fluidVelocities[dst] = _fluidVelocities[src];
+    _fluidPositionsNew[dst] = _fluidPositionsNew[src];
+    _fluidVelocitiesNew[dst] = _fluidVelocitiesNew[src];
+    _fluidNormals[dst] = _fluidNormals[src];
+    _fluidForces[dst] = _fluidForces[src];
+    _fluidPressureForces[dst] = _fluidPressureForces[src];
+    _fluidDensities[dst] = _fluidDensities[src];
+    _fluidPressures[dst] = _fluidPressures[src];
+    _fluidFactors[dst] = _fluidFactors[src];
+    _fluidDensityChanges[dst] = _fluidDensityChanges[src];
+    _fluidKappa[dst] = _fluidKappa[src];
+    _fluidKappaV[dst] = _fluidKappaV[src];
+    _fluidKappaIteration[dst] = _fluidKappaIteration[src];
+    _fluidNeighbourCounts[dst] = _fluidNeighbourCounts[src];
+    _fluidLambdas[dst] = _fluidLambdas[src];
+    _fluidPositionCorrections[dst] = _fluidPositionCorrections[src];
+    _fluidRestingSteps[dst] = _fluidRestingSteps[src];
+    _fluidRestPositions[dst] = _fluidRestPositions[src];
+    _fluidSleeping[dst] = _fluidSleeping[src];
+    _fluidActive[dst] = _fluidActive[src];
+    _fluidSurface[dst] = _fluidSurface[src];
+    _fluidTimeStepLevels[dst] = _fluidTimeStepLevels[src];
+    _fluidMasses[dst] = _fluidMasses[src];
+    _fluidLevels[dst] = _fluidLevels[src];
+}
+
+// Static boundaries (boundary particles, density maps and meshes) are only built if the boundary is not shared
+void SPH::buildScene(const Scene &scene, bool staticBoundaries) {
     for (const auto &sceneBox : scene.boxes) {
         switch (sceneBox.type) {
         case Scene::Fluid:
             addFluidParticles(ParticleGenerator::generateVolumeBox(sceneBox.bounds, _particleRadius));
             break;
         case Scene::Boundary:
-            addBoundaryParticles(ParticleGenerator::generateBoundaryBox(sceneBox.bounds, _particleRadius));
-            _boundaryMeshes.emplace_back(Mesh::createBox(sceneBox.bounds));
+            if (staticBoundaries || !sceneBox.motion.empty()) {
+                addBoundaryParticles(ParticleGenerator::generateBoundaryBox(sceneBox.bounds, _particleRadius), sceneBox.motion);
+            }
+            if (staticBoundaries) {
+                _boundaryMeshes.emplace_back(Mesh::createBox(sceneBox.bounds));
+            }
             break;
         }
     }
@@ -799,40 +2842,373 @@ void SPH::buildScene(const Scene &scene) {
             addFluidParticles(ParticleGenerator::generateVolumeSphere(sceneSphere.position, sceneSphere.radius, _particleRadius));
             break;
         case Scene::Boundary:
-            addBoundaryParticles(ParticleGenerator::generateBoundarySphere(sceneSphere.position, sceneSphere.radius, _particleRadius));
-            _boundaryMeshes.emplace_back(Mesh::createSphere(sceneSphere.position, sceneSphere.radius));
+            if (staticBoundaries || !sceneSphere.motion.empty()) {
+                addBoundaryParticles(ParticleGenerator::generateBoundarySphere(sceneSphere.position, sceneSphere.radius, _particleRadius), sceneSphere.motion);
+            }
+            if (staticBoundaries) {
+                _boundaryMeshes.emplace_back(Mesh::createSphere(sceneSphere.position, sceneSphere.radius));
+            }
             break;
         }
     }
     for (const auto &sceneMesh : scene.meshes) {
+        if (sceneMesh.type == Scene::Boundary && !staticBoundaries && sceneMesh.motion.empty()) {
+            continue;
+        }
         Mesh mesh = ObjReader::load(sceneMesh.filename);
         switch (sceneMesh.type) {
         case Scene::Fluid:
             addFluidParticles(ParticleGenerator::generateVolumeMesh(mesh, _particleRadius));
             break;
         case Scene::Boundary:
-            addBoundaryParticles(ParticleGenerator::generateBoundaryMesh(mesh, _particleRadius));
-            _boundaryMeshes.emplace_back(mesh);
+            if (densityMaps.enabled && sceneMesh.motion.empty()) {
+                _boundary->densityMaps.emplace_back();
+                _boundary->densityMaps.back().build(mesh, _kernel, _restDensity, _particleRadius, densityMaps.cellSize);
+            } else {
+                addBoundaryParticles(ParticleGenerator::generateBoundaryMesh(mesh, _particleRadius), sceneMesh.motion);
+            }
+            if (staticBoundaries) {
+                _boundaryMeshes.emplace_back(mesh);
+            }
             break;
         }
     }
 
-    addBoundaryParticles(ParticleGenerator::generateBoundaryBox(scene.world.bounds, _particleRadius, true));
+    if (!worldBoundary.analytic && staticBoundaries) {
+        addBoundaryParticles(ParticleGenerator::generateBoundaryBox(scene.world.bounds, _particleRadius, true));
+    }
 }
 
 void SPH::addFluidParticles(const ParticleGenerator::Volume &volume) {
     _fluidPositions.insert(_fluidPositions.end(), volume.positions.begin(), volume.positions.end());
 }
 
-void SPH::addBoundaryParticles(const ParticleGenerator::Boundary &boundary) {
+void SPH::addBoundaryParticles(const ParticleGenerator::Boundary &boundary, const Scene::Motion &motion) {
+    if (!motion.empty()) {
+        kinematics.objects.emplace_back();
+        kinematics.objects.back().build(boundary, motion, _kernel, _restDensity);
+        return;
+    }
     _boundaryPositions.insert(_boundaryPositions.end(), boundary.positions.begin(), boundary.positions.end());
     _boundaryNormals.insert(_boundaryNormals.end(), boundary.normals.begin(), boundary.normals.end());
 }
 
+// Remove boundary particles that can never interact with fluid, i.e. particles inside other solids,
+// beneath solids resting on the floor or between touching solids. A particle is kept if there is free
+// space (inside the world box and outside of all boundary boxes and spheres) within the kernel radius.
+// Free space is sampled on a lattice with the particle radius as spacing, closest samples first.
+// Samples on faces count as occupied, so touching solids (and solids resting on the floor) close the gap.
+// Mesh and kinematic boundaries are not used as occluders (there is no inside test for meshes at this point
+// and kinematic boundaries move away).
+// Boundary masses are computed afterwards, so they only account for the remaining particles.
+void SPH::cullBoundaryParticles(const Scene &scene) {
+    Timer timer;
+
+    std::vector<const Scene::Box *> boxes;
+    for (const auto &sceneBox : scene.boxes) {
+        if (sceneBox.type == Scene::Boundary && sceneBox.motion.empty()) {
+            boxes.emplace_back(&sceneBox);
+        }
+    }
+    std::vector<const Scene::Sphere *> spheres;
+    for (const auto &sceneSphere : scene.spheres) {
+        if (sceneSphere.type == Scene::Boundary && sceneSphere.motion.empty()) {
+            spheres.emplace_back(&sceneSphere);
+        }
+    }
+
+    // Lattice offsets within the kernel support, sorted by distance
+    std::vector<Vector3f> offsets;
+    int n = int(std::ceil(_kernelRadius / _particleRadius));
+    for (int x = -n; x <= n; ++x) {
+        for (int y = -n; y <= n; ++y) {
+            for (int z = -n; z <= n; ++z) {
+                Vector3f offset = Vector3f(x, y, z) * _particleRadius;
+                if ((x != 0 || y != 0 || z != 0) && offset.squaredNorm() <= _kernelRadius2) {
+                    offsets.emplace_back(offset);
+                }
+            }
+        }
+    }
+    std::sort(offsets.begin(), offsets.end(), [] (const Vector3f &a, const Vector3f &b) {
+        return a.squaredNorm() < b.squaredNorm();
+    });
+
+    std::vector<char> keep(_boundaryPositions.size());
+    parallelForRange(0, _boundaryPositions.size(), ParticleGrainSize, [&] (const ParallelRange &range) {
+        std::vector<const Scene::Box *> nearBoxes;
+        std::vector<const Scene::Sphere *> nearSpheres;
+        for (size_t i = range.begin(); i < range.end(); ++i) {
+            const Vector3f &p = _boundaryPositions[i];
+
+            // Solids that can cover samples around p
+            nearBoxes.clear();
+            for (const auto *box : boxes) {
+                if (box->bounds.expanded(_kernelRadius).contains(p)) {
+                    nearBoxes.emplace_back(box);
+                }
+            }
+            nearSpheres.clear();
+            for (const auto *sphere : spheres) {
+                if ((p - sphere->position).squaredNorm() < sqr(sphere->radius + _kernelRadius)) {
+                    nearSpheres.emplace_back(sphere);
+                }
+            }
+
+            auto isFree = [&] (const Vector3f &q) {
+                if (!scene.world.bounds.contains(q, true)) {
+                    return false;
+                }
+                for (const auto *box : nearBoxes) {
+                    if (box->bounds.contains(q)) {
+                        return false;
+                    }
+                }
+                for (const auto *sphere : nearSpheres) {
+                    if ((q - sphere->position).squaredNorm() <= sqr(sphere->radius)) {
+                        return false;
+                    }
+                }
+                return true;
+            };
+
+            keep[i] = std::any_of(offsets.begin(), offsets.end(), [&] (const Vector3f &offset) {
+                return isFree(p + offset);
+            });
+        }
+    });
+
+    size_t count = 0;
+    for (size_t i = 0; i < _boundaryPositions.size(); ++i) {
+        if (keep[i]) {
+            _boundaryPositions[count] = _boundaryPositions[i];
+            _boundaryNormals[count] = _boundaryNormals[i];
+            ++count;
+        }
+    }
+    _boundary->culled = _boundaryPositions.size() - count;
+    _boundaryPositions.resize(count);
+    _boundaryNormals.resize(count);
+
+    DBG("Culled %d of %d boundary particles, took %s", _boundary->culled, count + _boundary->culled, timer.elapsedString());
+}
+
+const std::vector<std::string> &SPH::Boundary::settingNames() {
+    static const std::vector<std::string> names = {
+        "particleRadius", "restDensity", "worldBoundary", "meshBoundary", "densityMapCellSize", "cullBoundary",
+        "previewScale" // scales the particle radius and density map cell size
+    };
+    return names;
+}
+
+// Checkpoints store everything that is expensive to rebuild (boundary particles after culling, density maps,
+// kinematic boundaries) and all state carried between steps. Settings are taken from the scene on restore,
+// the header only guards against restoring a checkpoint into a different setup.
+static const uint32_t CheckpointMagic = 0x54504b43;  // "CKPT"
+static const uint32_t CheckpointVersion = 3;
+
+void SPH::writeCheckpoint(std::ostream &os) const {
+    Serialize::write(os, CheckpointMagic);
+    Serialize::write(os, CheckpointVersion);
+    Serialize::write(os, _method);
+    Serialize::write(os, _particleRadius);
+    Serialize::write(os, worldBoundary.analytic);
+    Serialize::write(os, densityMaps.enabled);
+
+    // Scene
+    Serialize::writeVector(os, _boundaryPositions);
+    Serialize::writeVector(os, _boundaryNormals);
+    Serialize::write(os, _boundary->culled);
+    Serialize::write(os, _boundary->densityMaps.size());
+    for (const auto &map : _boundary->densityMaps) {
+        map.write(os);
+    }
+    Serialize::write(os, kinematics.objects.size());
+    for (const auto &object : kinematics.objects) {
+        object.write(os);
+    }
+    Serialize::write(os, _boundaryMeshes.size());
+    for (const auto &mesh : _boundaryMeshes) {
+        mesh.write(os);
+    }
+
+    // Solver state
+    Serialize::write(os, _time);
+    Serialize::write(os, _timeStep);
+    Serialize::write(os, _densityVariationScaling);
+    Serialize::write(os, _maxDensityVariation);
+    Serialize::write(os, _prevMaxDensityVariation);
+    Serialize::write(os, _avgDensityVariation);
+    Serialize::write(os, _maxVelocity);
+    Serialize::write(os, _maxForce);
+    Serialize::write(os, multiRate.step);
+    Serialize::write(os, adaptive.steps);
+    Serialize::write(os, adaptive.rng);
+    Serialize::writeVector(os, adaptive.distances);
+
+    // Fluid particles
+    Serialize::writeVector(os, _fluidPositions);
+    Serialize::writeVector(os, _fluidVelocities);
+    Serialize::writeVector(os, _fluidPositionsNew);
+    Serialize::writeVector(os, _fluidVelocitiesNew);
+    Serialize::writeVector(os, _fluidNormals);
+    Serialize::writeVector(os, _fluidForces);
+    Serialize::writeVector(os, _fluidPressureForces);
+    Serialize::writeVector(os, _fluidDensities);
+    Serialize::writeVector(os, _fluidPressures);
+    Serialize::writeVector(os, _fluidFactors);
+    Serialize::writeVector(os, _fluidDensityChanges);
+    Serialize::writeVector(os, _fluidKappa);
+    Serialize::writeVector(os, _fluidKappaV);
+    Serialize::writeVector(os, _fluidKappaIteration);
+    Serialize::writeVector(os, _fluidNeighbourCounts);
+    Serialize::writeVector(os, _fluidLambdas);
+    Serialize::writeVector(os, _fluidPositionCorrections);
+    Serialize::writeVector(os, _fluidRestingSteps);
+    Serialize::writeVector(os, _fluidRestPositions);
+    Serialize::writeVector(os, _fluidSleeping);
+    Serialize::writeVector(os, _fluidActive);
+    Serialize::writeVector(os, _fluidSurface);
+    Serialize::writeVector(os, _fluidTimeStepLevels);
+    Serialize::writeVector(os, _fluidMasses);
+    Serialize::writeVector(os, _fluidLevels);
+
+    // Emitters and sinks
+    Serialize::write(os, emission.pool.capacity());
+    Serialize::write(os, emission.steps);
+    Serialize::write(os, emission.time);
+    Serialize::write(os, emission.poolFull);
+    Serialize::write(os, emission.emitted);
+    Serialize::write(os, emission.removed);
+    Serialize::write(os, emission.emitters.size());
+    for (const auto &emitter : emission.emitters) {
+        Serialize::write(os, emitter.distance);
+    }
+
+    // Snapshots for shock rollback (PCISPH)
+    _snapshots.write(os);
+}
+
+void SPH::restoreScene(std::istream &is) {
+    uint32_t magic, version;
+    Serialize::read(is, magic);
+    Serialize::read(is, version);
+    if (!is.good() || magic != CheckpointMagic || version != CheckpointVersion) {
+        throw Exception("Invalid checkpoint (expected version %d)", CheckpointVersion);
+    }
+    Method method;
+    float particleRadius;
+    bool analytic, densityMap;
+    Serialize::read(is, method);
+    Serialize::read(is, particleRadius);
+    Serialize::read(is, analytic);
+    Serialize::read(is, densityMap);
+    if (method != _method || particleRadius != _particleRadius || analytic != worldBoundary.analytic || densityMap != densityMaps.enabled) {
+        throw Exception("Checkpoint does not match the scene settings (method = %s, particleRadius = %f, worldBoundary = %s, meshBoundary = %s)",
+                        methodToString(method), particleRadius, analytic ? "planes" : "particles", densityMap ? "densityMap" : "particles");
+    }
+
+    size_t count;
+    Serialize::readVector(is, _boundaryPositions);
+    Serialize::readVector(is, _boundaryNormals);
+    Serialize::read(is, _boundary->culled);
+    Serialize::read(is, count);
+    _boundary->densityMaps.resize(count);
+    for (auto &map : _boundary->densityMaps) {
+        map.read(is);
+    }
+    Serialize::read(is, count);
+    kinematics.objects.resize(count);
+    for (auto &object : kinematics.objects) {
+        object.read(is);
+    }
+    Serialize::read(is, count);
+    _boundaryMeshes.resize(count);
+    for (auto &mesh : _boundaryMeshes) {
+        mesh.read(is);
+    }
+
+    startup.resumed = true;
+}
+
+// Called after emissionInit(), as the pool is restored with its original capacity
+void SPH::restoreState(std::istream &is) {
+    Serialize::read(is, _time);
+    Serialize::read(is, _timeStep);
+    Serialize::read(is, _densityVariationScaling);
+    Serialize::read(is, _maxDensityVariation);
+    Serialize::read(is, _prevMaxDensityVariation);
+    Serialize::read(is, _avgDensityVariation);
+    Serialize::read(is, _maxVelocity);
+    Serialize::read(is, _maxForce);
+    Serialize::read(is, multiRate.step);
+    Serialize::read(is, adaptive.steps);
+    Serialize::read(is, adaptive.rng);
+    Serialize::readVector(is, adaptive.distances);
+
+    Serialize::readVector(is, _fluidPositions);
+    Serialize::readVector(is, _fluidVelocities);
+    Serialize::readVector(is, _fluidPositionsNew);
+    Serialize::readVector(is, _fluidVelocitiesNew);
+    Serialize::readVector(is, _fluidNormals);
+    Serialize::readVector(is, _fluidForces);
+    Serialize::readVector(is, _fluidPressureForces);
+    Serialize::readVector(is, _fluidDensities);
+    Serialize::readVector(is, _fluidPressures);
+    Serialize::readVector(is, _fluidFactors);
+    Serialize::readVector(is, _fluidDensityChanges);
+    Serialize::readVector(is, _fluidKappa);
+    Serialize::readVector(is, _fluidKappaV);
+    Serialize::readVector(is, _fluidKappaIteration);
+    Serialize::readVector(is, _fluidNeighbourCounts);
+    Serialize::readVector(is, _fluidLambdas);
+    Serialize::readVector(is, _fluidPositionCorrections);
+    Serialize::readVector(is, _fluidRestingSteps);
+    Serialize::readVector(is, _fluidRestPositions);
+    Serialize::readVector(is, _fluidSleeping);
+    Serialize::readVector(is, _fluidActive);
+    Serialize::readVector(is, _fluidSurface);
+    Serialize::readVector(is, _fluidTimeStepLevels);
+    Serialize::readVector(is, _fluidMasses);
+    Serialize::readVector(is, _fluidLevels);
+
+    size_t capacity, count;
+    Serialize::read(is, capacity);
+    Serialize::read(is, emission.steps);
+    Serialize::read(is, emission.time);
+    Serialize::read(is, emission.poolFull);
+    Serialize::read(is, emission.emitted);
+    Serialize::read(is, emission.removed);
+    Serialize::read(is, count);
+    if (!is.good() || count != emission.emitters.size()) {
+        throw Exception("Checkpoint is truncated or does not match the emitters of the scene");
+    }
+    for (auto &emitter : emission.emitters) {
+        Serialize::read(is, emitter.distance);
+    }
+
+    _snapshots.read(is, capacity);
+    if (!is.good()) {
+        throw Exception("Checkpoint is truncated");
+    }
+
+    // The pool is compacted after every step, so all slots are in use
+    emission.pool.init(_fluidPositions.size(), capacity);
+    if (emission.enabled) {
+        emission.slots.reserve(capacity);
+        emission.positions.reserve(capacity);
+        emission.velocities.reserve(capacity);
+    }
+
+    DBG("Restored checkpoint: time = %f, particles = %d", _time, _fluidPositions.size());
+}
+
 std::string SPH::methodToString(Method method) {
     switch (method) {
     case WCSPH: return "wcsph";
     case PCISPH: return "pcisph";
+    case DFSPH: return "dfsph";
+    case PBF: return "pbf";
     }
     return "unknown";
 }
@@ -842,6 +3218,10 @@ SPH::Method SPH::stringToMethod(const std::string &str) {
         return WCSPH;
     } else if (str == "pcisph") {
         return PCISPH;
+    } else if (str == "dfsph") {
+        return DFSPH;
+    } else if (str == "pbf") {
+        return PBF;
     } else {
         return PCISPH;
     }
@@ -1,10 +1,16 @@
 #pragma once
 
 #include "Scene.h"
+#include "BoundaryPlanes.h"
+#include "DensityMap.h"
 #include "Grid.h"
+#include "KinematicBoundary.h"
 #include "Kernel.h"
+#include "ParticlePool.h"
+#include "SnapshotRing.h"
 
 #include "core/Common.h"
+#include "core/Half.h"
 #include "core/Vector.h"
 #include "core/Box.h"
 #include "core/AlignedAllocator.h"
@@ -18,8 +24,14 @@
 #include "geometry/ParticleGenerator.h"
 
 #include <tbb/tbb.h>
+#include <tbb/flow_graph.h>
+
+#include <pcg32.h>
 
 #include <vector>
+#include <memory>
+#include <istream>
+#include <ostream>
 
 namespace pbs {
 
@@ -35,7 +47,35 @@ public:
         float restDensity;
     };
 
-    SPH(const Scene &scene);
+    // Static boundary data (boundary particles after culling, their masses and neighbour grid, density maps
+    // and boundary meshes). It is immutable after the scene is built and only depends on the scene geometry
+    // and the settings below, so variants of a scene with other solver settings can share it.
+    struct Boundary {
+        std::vector<Vector3f> positions;
+        std::vector<Vector3f> normals;
+        std::vector<float> masses;
+        Grid grid;
+        std::vector<DensityMap> densityMaps;
+        std::vector<Mesh> meshes;
+        size_t culled = 0;
+
+        // Settings the data was built with
+        float particleRadius;
+        float restDensity;
+        bool analyticWorld;
+        bool meshDensityMaps;
+        float densityMapCellSize;
+        bool culling;
+
+        // Names of the scene settings the data depends on
+        static const std::vector<std::string> &settingNames();
+    };
+
+    // Builds the scene, or restores the state written by writeCheckpoint() if a checkpoint is given
+    // (the scene only provides the settings and emitters in that case).
+    // If a boundary of another instance is given (see boundary()), only the fluid and kinematic boundaries
+    // are built and the static boundary data is shared.
+    SPH(const Scene &scene, std::istream *checkpoint = nullptr, std::shared_ptr<Boundary> boundary = nullptr);
 
     void reset();
     void update(float dt);
@@ -46,11 +86,17 @@ public:
     float timeStep() const { return _timeStep; }
     float time() const { return _time; }
 
+    // Write the complete simulation state (boundaries, particles and solver state)
+    void writeCheckpoint(std::ostream &os) const;
+
     const std::vector<Vector3f> &fluidPositions() const { return _fluidPositions; }
           std::vector<Vector3f> &fluidPositions()       { return _fluidPositions; }
+    const std::vector<int> &fluidSurface() const { return _fluidSurface; }
     const std::vector<Vector3f> &boundaryPositions() const { return _boundaryPositions; }
     const std::vector<Vector3f> &boundaryNormals() const { return _boundaryNormals; }
     const std::vector<Mesh> &boundaryMeshes() const { return _boundaryMeshes; }
+    const std::vector<KinematicBoundary> &kinematicBoundaries() const { return kinematics.objects; }
+    const std::shared_ptr<Boundary> &boundary() const { return _boundary; }
 
 private:
 
@@ -80,6 +126,91 @@ private:
         });
     }
 
+    // iterate over all fluid neighbours of fluid particle i, calling func(j, r, r2, kernel)
+    // particles of different resolution levels interact using the kernel of the smaller particle
+    template<typename Func>
+    inline void iterateFluidNeighbours(size_t i, Func func) {
+        const Vector3f &p = _fluidPositions[i];
+        int level = _fluidLevels[i];
+        _fluidGrid.lookup(p, _levelKernels[level].h, [&] (size_t j) {
+            const Kernel &kernel = _levelKernels[std::min(level, _fluidLevels[j])];
+            Vector3f r = p - _fluidPositions[j];
+            float r2 = r.squaredNorm();
+            if (r2 < kernel.h2) {
+                func(j, r, r2, kernel);
+            }
+            return true;
+        });
+    }
+
+    // attributes of neighbour fluid particles (read from reduced precision storage with FeatureReducedPrecision)
+    template<int Features>
+    inline float neighbourDensity(size_t j) const {
+        return (Features & FeatureReducedPrecision) ? precision.densities.scalar(j) : _fluidDensities[j];
+    }
+    template<int Features>
+    inline float neighbourPressure(size_t j) const {
+        return (Features & FeatureReducedPrecision) ? precision.pressures.scalar(j) : _fluidPressures[j];
+    }
+    template<int Features>
+    inline Vector3f neighbourNormal(size_t j) const {
+        return (Features & FeatureReducedPrecision) ? precision.normals.vector(j) : _fluidNormals[j];
+    }
+
+    // contributions of analytic boundaries (world planes and density maps) at p
+    inline float analyticBoundaryDensity(const Vector3f &p) const {
+        float density = worldBoundary.analytic ? worldBoundary.planes.density(p) : 0.f;
+        for (const auto &map : _boundary->densityMaps) {
+            density += map.density(p);
+        }
+        for (const auto &object : kinematics.objects) {
+            density += object.density(p);
+        }
+        return density;
+    }
+    inline Vector3f analyticBoundaryGradient(const Vector3f &p) const {
+        Vector3f gradient = worldBoundary.analytic ? worldBoundary.planes.gradient(p) : Vector3f(0.f);
+        for (const auto &map : _boundary->densityMaps) {
+            gradient += map.gradient(p);
+        }
+        for (const auto &object : kinematics.objects) {
+            gradient += object.gradient(p);
+        }
+        return gradient;
+    }
+    // Rate of density change for a particle at p moving with velocity v (kinematic boundaries move as well)
+    inline float analyticBoundaryDensityChange(const Vector3f &p, const Vector3f &v) const {
+        float change = 0.f;
+        if (worldBoundary.analytic) {
+            change += v.dot(worldBoundary.planes.gradient(p));
+        }
+        for (const auto &map : _boundary->densityMaps) {
+            change += v.dot(map.gradient(p));
+        }
+        for (const auto &object : kinematics.objects) {
+            change += object.densityChange(p, v);
+        }
+        return change;
+    }
+    inline bool hasAnalyticBoundary() const {
+        return worldBoundary.analytic || !_boundary->densityMaps.empty() || !kinematics.objects.empty();
+    }
+
+    // clamp a fluid particle to the bounds (world box or analytic planes) and reflect its velocity on the
+    // violated axes, inlined into the integration loops so positions are only streamed once
+    inline void handleCollision(Vector3f &p, Vector3f &v) const {
+        const float c = 0.5f;
+        for (int k = 0; k < 3; ++k) {
+            if (p[k] < _bounds.min[k]) {
+                p[k] = _bounds.min[k];
+                v[k] -= (1.f + c) * v[k];
+            } else if (p[k] > _bounds.max[k]) {
+                p[k] = _bounds.max[k];
+                v[k] -= (1.f + c) * v[k];
+            }
+        }
+    }
+
     // returns true if there are neighbours around p
     inline bool hasNeighbours(const Grid &grid, const std::vector<Vector3f> &positions, const Vector3f &p) {
         bool result = false;
@@ -98,43 +229,120 @@ private:
     void activateBoundaryParticles();
     void updateBoundaryGrid();
     void updateBoundaryMasses();
+    void updateKinematicBoundaries();
     void updateDensities();
+    void updateBoundaryDensities();
+    void updateFluidDensities();
+    template<int Features> void updateFluidDensities();
     void updateNormals();
-    void computeCollisions(std::function<void(size_t i, const Vector3f &n, float d)> handler);
+    template<int Features> void updateNormals();
+    void solveImplicitViscosity();
+    void updateSleeping();
     void enforceBounds();
 
     // WCSPH update methods
     void wcsphUpdateDensitiesAndPressures();
     void wcsphUpdateForces();
+    template<int Features> void wcsphUpdateForces();
 
     void wcsphInit();
     void wcsphUpdate();
 
     // PCISPH update methods
     void pcisphUpdateGrid();
+    void pcisphUpdateTimeStepLevels();
+    void pcisphUpdateActiveParticles();
     void pcisphUpdateDensityVariationScaling();
     void pcisphInitializeForces();
+    template<int Features> void pcisphInitializeForces();
     void pcisphPredictVelocitiesAndPositions();
     void pcisphUpdatePressures();
+    template<int Features> void pcisphUpdatePressures();
     void pcisphUpdatePressureForces();
+    template<int Features> void pcisphUpdatePressureForces();
     void pcisphUpdateVelocitiesAndPositions();
 
+    void pcisphBuildTaskGraph();
     void pcisphInit();
     void pcisphUpdate(int maxIterations = 100);
-
-    void buildScene(const Scene &scene);
+    void pcisphRelax();
+
+    // DFSPH update methods
+    void dfsphUpdateGrid();
+    void dfsphUpdateFactors();
+    template<int Features> void dfsphUpdateFactors();
+    void dfsphUpdateDensityChanges();
+    template<int Features> void dfsphUpdateDensityChanges();
+    void dfsphUpdateVelocities(const std::vector<float> &kappa);
+    template<int Features> void dfsphUpdateVelocities(const std::vector<float> &kappa);
+    void dfsphUpdateTimeStep();
+    void dfsphPredictVelocities();
+    void dfsphUpdatePositions();
+    int dfsphCorrectDensityError();
+    int dfsphCorrectDivergenceError();
+
+    void dfsphInit();
+    void dfsphUpdate();
+
+    // Adaptive resolution methods
+    void adaptiveUpdateSurfaceDistances();
+    void adaptiveResample();
+
+    // PBF update methods
+    void pbfPredictPositions();
+    void pbfUpdateLambdas();
+    template<int Features> void pbfUpdateLambdas();
+    void pbfUpdatePositionCorrections();
+    template<int Features> void pbfUpdatePositionCorrections();
+    void pbfUpdateVelocitiesAndPositions();
+
+    void pbfInit();
+    void pbfUpdate();
+
+    // Emitter and sink methods
+    void emissionInit(const Scene &scene);
+    void updateEmission();
+    void updateSinks();
+    void updateEmitters();
+
+    // Fluid particle buffer management
+    void reserveFluidParticles(size_t capacity);
+    void resizeFluidParticles(size_t count);
+    void placeFluidParticles();
+    void resetFluidParticle(size_t i, const Vector3f &p, const Vector3f &v);
+    void moveFluidParticle(size_t dst, size_t src);
+
+    void buildScene(const Scene &scene, bool staticBoundaries);
     void addFluidParticles(const ParticleGenerator::Volume &volume);
-    void addBoundaryParticles(const ParticleGenerator::Boundary &boundary);
+    void addBoundaryParticles(const ParticleGenerator::Boundary &boundary, const Scene::Motion &motion = Scene::Motion());
+    void cullBoundaryParticles(const Scene &scene);
+
+    // Checkpoint restore (replaces building the scene and the solver state of the first step)
+    void restoreScene(std::istream &is);
+    void restoreState(std::istream &is);
+
+    // Physics features the solver passes are specialized on, passes are instantiated for each feature set
+    // and dispatched at scene load, so disabled features cost nothing in the inner loops
+    enum Feature {
+        FeatureSurfaceTension = 1 << 0,
+        FeatureViscosity = 1 << 1,
+        FeatureBoundaries = 1 << 2,         ///< Boundary particles or analytic boundaries
+        FeatureReducedPrecision = 1 << 3,   ///< Neighbour attributes read from 16 bit storage (PCISPH only)
+    };
+    typedef void (SPH::*FeaturePass)();
 
     enum Method {
         WCSPH,
         PCISPH,
+        DFSPH,
+        PBF,
     };
 
     static std::string methodToString(Method method);
     static Method stringToMethod(const std::string &str);
 
     Method _method;
+    int _features = FeatureSurfaceTension | FeatureViscosity | FeatureBoundaries;
     float _particleRadius = 0.01f;
     float _particleRadius2;
     float _particleDiameter;
@@ -147,6 +355,7 @@ private:
     float _viscosity = 0.f;                 ///< Viscosity
     float _timeStep = 0.001f;
     float _compressionThreshold = 0.02f;
+    bool _deterministic = false;            ///< Results independent of the thread schedule (see DeterministicScope)
 
     float _particleMass;                    ///< Particle mass
     float _particleMass2;                   ///< Squared particle mass
@@ -173,7 +382,180 @@ private:
         float dt;
     } wcsph;
 
+    struct {
+        float cflFactor = 0.4f;             ///< CFL factor for adaptive time stepping
+        float minTimeStep = 0.00001f;
+        float maxTimeStep = 0.005f;
+        float maxDensityError = 0.001f;     ///< Max. average density error (relative to rest density)
+        float maxDivergenceError = 0.1f;    ///< Max. average divergence error (relative to rest density per second)
+        int minIterations = 2;
+        int maxIterations = 100;
+        bool warmStart = true;              ///< Use pressure values of last time step as initial guess
+        float avgDensityError;
+        float avgDivergenceError;
+    } dfsph;
+
+    struct {
+        bool analytic = false;              ///< Model the world box by analytic planes instead of boundary particles
+        BoundaryPlanes planes;
+    } worldBoundary;
+
+    struct {
+        bool enabled = false;               ///< Use density maps instead of boundary particles for mesh boundaries
+        float cellSize;                     ///< Cell size of density maps (defaults to the particle radius)
+    } densityMaps;
+
+    struct {
+        std::vector<KinematicBoundary> objects;
+    } kinematics;
+
+    struct {
+        bool enabled = true;                ///< Remove boundary particles that cannot interact with fluid
+    } boundaryCulling;
+
+    struct {
+        bool enabled = true;                ///< Only apply surface tension to particles near the free surface (normals also for their neighbours)
+        float threshold = 0.95f;            ///< Max. fluid density of surface particles (relative to rest density)
+    } surface;
+
+    struct {
+        bool enabled = false;               ///< Solve viscosity implicitly instead of using explicit viscosity forces
+        int maxIterations = 100;
+        float tolerance = 0.0001f;          ///< Relative residual tolerance
+        int iterations = 0;                 ///< Iterations of the last solve (reported by the update functions)
+        std::vector<float> diagonal;
+        std::vector<Vector3f> b;
+        std::vector<Vector3f> r;
+        std::vector<Vector3f> z;
+        std::vector<Vector3f> p;
+        std::vector<Vector3f> Ap;
+    } implicitViscosity;
+
+    struct {
+        bool enabled = false;               ///< Deactivate resting particles (PCISPH only)
+        float distance = 1.f;               ///< Max. distance of resting particles from where they came to rest (relative to particle radius)
+        float densityError = 0.05f;         ///< Max. density error of resting particles (relative to rest density)
+        int steps = 20;                     ///< Number of steps a particle has to be at rest before going to sleep
+        float fraction = 0.f;
+    } sleeping;
+
+    struct {
+        int rollbackSteps = 2;              ///< Number of time steps to go back when a shock is detected (PCISPH only)
+        bool compressSnapshots = false;     ///< Quantize snapshots to 16 bit (less memory, rollback requires a copy)
+    } shock;
+
+    struct {
+        bool enabled = false;               ///< Store densities, pressures and normals read by neighbour sums as 16 bit floats (PCISPH only)
+        HalfFormat format = Float16;
+        float densityError = 0.f;           ///< Max. conversion errors of the last step (relative to the max. absolute value)
+        float pressureError = 0.f;
+        float normalError = 0.f;
+        HalfBuffer densities;
+        HalfBuffer pressures;
+        HalfBuffer normals;
+    } precision;
+
+    struct {
+        bool enabled = false;               ///< Run independent phases of a step concurrently as a task graph (PCISPH only, opt-in)
+        std::unique_ptr<tbb::flow::graph> graph;
+        std::unique_ptr<tbb::flow::broadcast_node<tbb::flow::continue_msg>> start;
+        std::vector<std::unique_ptr<tbb::flow::continue_node<tbb::flow::continue_msg>>> nodes;
+    } taskGraph;
+
+    struct {
+        int count = 0;                      ///< Number of slabs of the domain decomposition (0 = disabled, -1 = one per NUMA node)
+        int axis = 2;                       ///< Slab axis (longest axis of the bounds)
+        std::unique_ptr<DomainArenas> arenas;
+    } domains;
+
+    struct {
+        bool enabled = false;               ///< Update particles with individual power-of-two multiples of the time step (PCISPH only, approximate, see pcisphUpdateActiveParticles)
+        int maxLevel = 3;                   ///< Max. time step level (particles are updated every 2^level steps)
+        int step = 0;                       ///< Current step within the block of 2^maxLevel steps
+        float activeFraction = 1.f;
+        std::vector<int> levelsNew;
+    } multiRate;
+
+    struct {
+        bool enabled = false;               ///< Merge interior particles into larger ones (DFSPH only)
+        int maxLevel = 3;                   ///< Max. resolution level (particle mass is 2^level times the base mass)
+        int interval = 10;                  ///< Number of steps between resampling
+        int bandWidth = 2;                  ///< Number of neighbourhood layers per resolution level
+        float surfaceThreshold = 0.5f;      ///< Min. normal length of surface particles
+        int steps = 0;
+        int merged = 0;
+        int split = 0;
+        size_t capacity = 0;                ///< Max. number of particles (all particles split to the base level)
+        pcg32 rng;
+        std::vector<int> distances;
+        std::vector<int> distancesNew;
+    } adaptive;
+
+    struct {
+        float timeStep = 0.005f;            ///< Fixed time step
+        int iterations = 4;                 ///< Number of constraint projection iterations
+        float relaxation = 1e-6f;           ///< Constraint force mixing (regularizes the constraint solve)
+        float tensileStrength = 0.1f;       ///< Artificial pressure against particle clustering, as a fraction of the rest density (0 disables)
+        float tensileDistance = 0.2f;       ///< Distance of the reference artificial pressure (relative to kernel radius)
+        float tensilePressure = 0.f;        ///< s_corr at tensileDistance (see pbfInit())
+        float avgDensityError;
+    } pbf;
+
+    struct {
+        float scale = 1.f;                  ///< Particle size factor of coarse previews (other parameters are rescaled to match)
+    } preview;
+
+    enum InitialRelaxation {
+        RelaxNone,                          ///< Start from the generated particle lattice
+        RelaxFast,                          ///< Project positions onto the density constraint (a few cheap iterations)
+        RelaxSolver,                        ///< One PCISPH step with up to 10000 pressure iterations
+    };
+
+    struct {
+        InitialRelaxation relaxation = RelaxFast;
+        bool resumed = false;               ///< State is restored from a checkpoint (no scene build or relaxation)
+        bool sharedBoundary = false;        ///< Static boundary data is shared with another instance (not built)
+        int maxIterations = 50;             ///< Max. iterations of the fast relaxation
+        int iterations = 0;
+        double buildTime = 0.0;             ///< Time to build the scene (ms)
+        double relaxationTime = 0.0;        ///< Time to relax the initial state (ms)
+    } startup;
+
+    // Emitter with a precomputed layer of particles on its upstream face
+    struct Emitter {
+        Scene::Emitter shape;
+        std::vector<Vector3f> layer;        ///< Particle positions of a layer
+        Vector3f direction;                 ///< Unit normal of the upstream face (pointing downstream)
+        float distance = 0.f;               ///< Distance travelled since the last layer was emitted
+        Emitter(const Scene::Emitter &shape) : shape(shape) {}
+    };
+
+    struct {
+        bool enabled = false;               ///< Scene contains emitters or sinks
+        int sinkInterval = 10;              ///< Number of steps between removing particles in sinks (and compacting the pool)
+        int steps = 0;
+        float time = 0.f;                   ///< Time of the last emitter update
+        bool poolFull = false;
+        size_t emitted = 0;
+        size_t removed = 0;
+        std::vector<Emitter> emitters;
+        std::vector<Box3f> sinks;
+        ParticlePool pool;                  ///< Slots of the fluid particle buffers
+        std::vector<size_t> slots;          ///< Slots of the particles emitted in the current step
+        std::vector<Vector3f> positions;
+        std::vector<Vector3f> velocities;
+    } emission;
+
+    static const size_t ParticleGrainSize = 64;  ///< Min. number of particles per parallel task
+
+    // Parallel loops over fluid and boundary particles replay their thread mapping between loops
+    // (separate partitioners as boundary and fluid phases run concurrently in the task graph)
+    Partitioner _fluidPartitioner{Partitioner::Affinity};
+    Partitioner _boundaryPartitioner{Partitioner::Affinity};
+    ParallelBusyTime _busyTime;             ///< Thread time spent in loops of this instance (idle times of profiler items)
+
     Kernel _kernel;
+    std::vector<Kernel> _levelKernels;      ///< Kernels for each resolution level (level 0 equals _kernel)
 
     Box3f _bounds;
 
@@ -182,28 +564,64 @@ private:
     std::vector<Vector3f> _fluidVelocities;
     std::vector<Vector3f> _fluidPositionsNew;
     std::vector<Vector3f> _fluidVelocitiesNew;
-    std::vector<Vector3f> _fluidPositionsPreShock;
-    std::vector<Vector3f> _fluidVelocitiesPreShock;
     std::vector<Vector3f> _fluidNormals;
     std::vector<Vector3f> _fluidForces;
     std::vector<Vector3f> _fluidPressureForces;
     std::vector<float> _fluidDensities;
     std::vector<float> _fluidPressures;
+    std::vector<float> _fluidFactors;
+    std::vector<float> _fluidDensityChanges;
+    std::vector<float> _fluidKappa;
+    std::vector<float> _fluidKappaV;
+    std::vector<float> _fluidKappaIteration;
+    std::vector<int> _fluidNeighbourCounts;
+    std::vector<float> _fluidLambdas;
+    std::vector<Vector3f> _fluidPositionCorrections;
+    std::vector<int> _fluidRestingSteps;
+    std::vector<Vector3f> _fluidRestPositions;
+    std::vector<int> _fluidSleeping;
+    std::vector<int> _fluidActive;
+    std::vector<int> _fluidSurface;
+    std::vector<int> _fluidTimeStepLevels;
+    std::vector<float> _fluidMasses;
+    std::vector<int> _fluidLevels;
     Grid _fluidGrid;
 
-    // Boundary particle buffers
-    std::vector<Vector3f> _boundaryPositions;
-    std::vector<Vector3f> _boundaryNormals;
+    std::shared_ptr<Boundary> _boundary;
+
+    // Boundary particle buffers (positions, normals, masses and grid refer to the possibly shared boundary data)
+    std::vector<Vector3f> &_boundaryPositions;
+    std::vector<Vector3f> &_boundaryNormals;
     std::vector<float> _boundaryDensities;
     std::vector<float> _boundaryPressures;
-    std::vector<float> _boundaryMasses;
+    std::vector<float> &_boundaryMasses;
     std::vector<int> _boundaryActive;
-    Grid _boundaryGrid;
+    Grid &_boundaryGrid;
+
+    std::vector<Mesh> &_boundaryMeshes;
 
-    std::vector<Mesh> _boundaryMeshes;
+    SnapshotRing _snapshots;
+
+    // Scratch data that is reused between steps, so that steps do not allocate memory after warm-up
+    struct {
+        tbb::enumerable_thread_specific<size_t> counts;
+        tbb::enumerable_thread_specific<float> maximum;
+        tbb::enumerable_thread_specific<Vector2f> maxima;
+        std::vector<Vector3f> positions;
+        std::vector<Vector3f> velocities;
+        std::vector<float> masses;
+        std::vector<int> levels;
+        std::vector<float> kappa;
+        std::vector<float> kappaV;
+        std::vector<int> flags;
+        std::vector<size_t> indices;
+        std::vector<size_t> offsets;
+    } _scratch;
+
+    static const int WarmupSteps = 10;      ///< Number of steps before allocations are reported as errors (debug builds)
+    int _steps = 0;
 
     float _time = 0.f;
-    float _timePreShock;
 };
 
 } // namespace pbs
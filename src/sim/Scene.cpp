@@ -56,27 +56,67 @@ std::string Scene::World::toString() const {
     );
 }
 
+Scene::Motion::Keyframe::Keyframe(const Properties &props) {
+    time = props.getFloat("time");
+    translation = props.getVector3("translation", translation);
+    rotation = props.getVector3("rotation", rotation);
+}
+
+Scene::Motion::Motion(const Properties &props, const Vector3f &defaultPivot) {
+    pivot = props.getVector3("pivot", defaultPivot);
+    loop = props.getBool("loop", loop);
+    for (auto jsonKeyframe : props.json()["keyframes"].array_items()) {
+        keyframes.emplace_back(Keyframe(Properties(jsonKeyframe)));
+    }
+    std::sort(keyframes.begin(), keyframes.end(), [] (const Keyframe &a, const Keyframe &b) {
+        return a.time < b.time;
+    });
+}
+
+std::string Scene::Motion::toString() const {
+    return tfm::format(
+        "Motion[\n"
+        "  pivot = %s,\n"
+        "  loop = %s,\n"
+        "  keyframes = %d\n"
+        "]",
+        pivot, loop, keyframes.size()
+    );
+}
+
 Scene::Shape::Shape(const Properties &props) {
     type = typeFromString(props.getString("type", "fluid"));
 }
 
+void Scene::Shape::loadMotion(const Properties &props, const Vector3f &defaultPivot) {
+    if (props.hasObject("motion")) {
+        if (type != Boundary) {
+            throw Exception("Only boundary shapes can have a motion");
+        }
+        motion = Motion(props.getObject("motion"), defaultPivot);
+    }
+}
+
 Scene::Box::Box(const Properties &props) : Shape(props) {
     bounds = props.getBox3("bounds");
+    loadMotion(props, bounds.center());
 }
 
 std::string Scene::Box::toString() const {
     return tfm::format(
         "Box[\n"
         "  type = %s,\n"
-        "  bounds = %s\n"
+        "  bounds = %s,\n"
+        "  motion = %s\n"
         "]",
-        typeToString(type), bounds
+        typeToString(type), bounds, motion.empty() ? "none" : indent(motion.toString())
     );
 }
 
 Scene::Sphere::Sphere(const Properties &props) : Shape(props) {
     position = props.getVector3("position");
     radius = props.getFloat("radius");
+    loadMotion(props, position);
 }
 
 std::string Scene::Sphere::toString() const {
@@ -84,23 +124,58 @@ std::string Scene::Sphere::toString() const {
         "Sphere[\n"
         "  type = %s,\n"
         "  position = %s,\n"
-        "  radius = %f\n"
+        "  radius = %f,\n"
+        "  motion = %s\n"
         "]",
-        typeToString(type), position, radius
+        typeToString(type), position, radius, motion.empty() ? "none" : indent(motion.toString())
     );
 }
 
 Scene::Mesh::Mesh(const Properties &props) : Shape(props) {
     filename = resolvePath(props.getString("filename"));
+    loadMotion(props, Vector3f(0.f));
 }
 
 std::string Scene::Mesh::toString() const {
     return tfm::format(
         "Mesh[\n"
         "  type = %s,\n"
-        "  filename = %s\n"
+        "  filename = %s,\n"
+        "  motion = %s\n"
         "]",
-        typeToString(type), filename
+        typeToString(type), filename, motion.empty() ? "none" : indent(motion.toString())
+    );
+}
+
+Scene::Emitter::Emitter(const Properties &props) {
+    bounds = props.getBox3("bounds");
+    velocity = props.getVector3("velocity");
+    start = props.getFloat("start", start);
+    end = props.getFloat("end", end);
+}
+
+std::string Scene::Emitter::toString() const {
+    return tfm::format(
+        "Emitter[\n"
+        "  bounds = %s,\n"
+        "  velocity = %s,\n"
+        "  start = %f,\n"
+        "  end = %f\n"
+        "]",
+        bounds, velocity, start, end
+    );
+}
+
+Scene::Sink::Sink(const Properties &props) {
+    bounds = props.getBox3("bounds");
+}
+
+std::string Scene::Sink::toString() const {
+    return tfm::format(
+        "Sink[\n"
+        "  bounds = %s\n"
+        "]",
+        bounds
     );
 }
 
@@ -149,6 +224,12 @@ Scene Scene::load(const std::string &filename, const json11::Json &settings) {
         for (auto jsonMesh : jsonScene["meshes"].array_items()) {
             scene.meshes.emplace_back(Mesh(Properties(jsonMesh)));
         }
+        for (auto jsonEmitter : jsonScene["emitters"].array_items()) {
+            scene.emitters.emplace_back(Emitter(Properties(jsonEmitter)));
+        }
+        for (auto jsonSink : jsonScene["sinks"].array_items()) {
+            scene.sinks.emplace_back(Sink(Properties(jsonSink)));
+        }
         for (auto jsonCameraKeyframe : jsonScene["cameraKeyframes"].array_items()) {
             scene.cameraKeyframes.emplace_back(Camera(Properties(jsonCameraKeyframe)));
         }
@@ -182,6 +263,8 @@ std::string Scene::toString() const {
         "  boxes = %s,\n"
         "  spheres = %s,\n"
         "  meshes = %s\n,"
+        "  emitters = %s,\n"
+        "  sinks = %s,\n"
         "  cameraKeyframes = %s\n"
         "]",
         indent(settings.json().dump()),
@@ -190,6 +273,8 @@ std::string Scene::toString() const {
         indent(vectorToString(boxes)),
         indent(vectorToString(spheres)),
         indent(vectorToString(meshes)),
+        indent(vectorToString(emitters)),
+        indent(vectorToString(sinks)),
         indent(vectorToString(cameraKeyframes))
     );
 }
@@ -10,6 +10,7 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <limits>
 
 namespace pbs {
 
@@ -40,9 +41,29 @@ public:
         std::string toString() const;
     };
 
+    // Rigid motion of a kinematic boundary shape (keyframes are interpolated linearly)
+    struct Motion {
+        struct Keyframe {
+            float time = 0.f;
+            Vector3f translation;
+            Vector3f rotation;              ///< Euler angles in degrees (rotating about x, y and z in that order)
+            Keyframe() = default;
+            Keyframe(const Properties &props);
+        };
+        Vector3f pivot;                     ///< Center of rotation (defaults to the center of the shape)
+        bool loop = false;                  ///< Repeat keyframes after the last one
+        std::vector<Keyframe> keyframes;
+        Motion() = default;
+        Motion(const Properties &props, const Vector3f &defaultPivot);
+        bool empty() const { return keyframes.empty(); }
+        std::string toString() const;
+    };
+
     struct Shape {
         Type type;
+        Motion motion;                      ///< Boundaries with a motion are kinematic
         Shape(const Properties &props);
+        void loadMotion(const Properties &props, const Vector3f &defaultPivot);
     };
 
     struct Box : public Shape {
@@ -64,6 +85,23 @@ public:
         std::string toString() const;
     };
 
+    // Box emitting layers of fluid particles on its upstream face
+    struct Emitter {
+        Box3f bounds;
+        Vector3f velocity;
+        float start = 0.f;                  ///< Time emission starts
+        float end = std::numeric_limits<float>::infinity();
+        Emitter(const Properties &props);
+        std::string toString() const;
+    };
+
+    // Box removing all fluid particles that enter it
+    struct Sink {
+        Box3f bounds;
+        Sink(const Properties &props);
+        std::string toString() const;
+    };
+
     Properties settings;
 
     Camera camera;
@@ -71,6 +109,8 @@ public:
     std::vector<Box> boxes;
     std::vector<Sphere> spheres;
     std::vector<Mesh> meshes;
+    std::vector<Emitter> emitters;
+    std::vector<Sink> sinks;
     std::vector<Camera> cameraKeyframes;
 
     static Scene load(const std::string &filename, const json11::Json &settings = json11::Json());
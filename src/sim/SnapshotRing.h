@@ -0,0 +1,241 @@
+#pragma once
+
+#include "core/Common.h"
+#include "core/Vector.h"
+#include "core/Box.h"
+#include "core/Serialize.h"
+
+#include <vector>
+#include <cstdint>
+
+namespace pbs {
+
+// Ring of particle state snapshots used to roll back the simulation.
+// Uncompressed snapshots are taken and restored by swapping buffers with the simulation,
+// which makes both operations O(1). The buffers passed to push() receive the storage of the
+// oldest snapshot and are therefore undefined afterwards. Compressed snapshots quantize
+// positions (relative to the given bounds) and velocities to 16 bit, which trades a copy for
+// a quarter of the memory per snapshot. Buffers are reserved for maxCount particles, snapshots
+// of a changing particle count do not allocate (the ring has to be cleared when the count changes).
+class SnapshotRing {
+public:
+    void init(size_t capacity, size_t count, size_t maxCount, const Box3f &bounds, bool compressed) {
+        _capacity = std::max(size_t(1), capacity);
+        _count = std::max(count, maxCount);
+        _bounds = bounds;
+        _compressed = compressed;
+        _slots.resize(_capacity);
+        for (auto &slot : _slots) {
+            if (_compressed) {
+                slot.positionsCompressed.reserve(3 * maxCount);
+                slot.velocitiesCompressed.reserve(3 * maxCount);
+                slot.positionsCompressed.resize(3 * count);
+                slot.velocitiesCompressed.resize(3 * count);
+            } else {
+                slot.positions.reserve(maxCount);
+                slot.velocities.reserve(maxCount);
+                slot.positions.resize(count);
+                slot.velocities.resize(count);
+            }
+        }
+        clear();
+
+        DBG("Initialized snapshot ring: capacity = %d, compressed = %d, memory = %.1f MB", _capacity, _compressed, memoryUsage() / (1024.f * 1024.f));
+    }
+
+    void clear() {
+        _head = 0;
+        _size = 0;
+    }
+
+    size_t size() const { return _size; }
+    size_t capacity() const { return _capacity; }
+
+    size_t memoryUsage() const {
+        return _capacity * _count * (_compressed ? 6 * sizeof(uint16_t) : 2 * sizeof(Vector3f));
+    }
+
+    // Store a snapshot, overwriting the oldest one if the ring is full
+    void push(float time, std::vector<Vector3f> &positions, std::vector<Vector3f> &velocities) {
+        Slot &slot = _slots[_head];
+        slot.time = time;
+        if (_compressed) {
+            compressPositions(positions, slot.positionsCompressed);
+            slot.velocityScale = compressVelocities(velocities, slot.velocitiesCompressed);
+        } else {
+            std::swap(slot.positions, positions);
+            std::swap(slot.velocities, velocities);
+            // Storage of the oldest snapshot may be sized for a different particle count
+            positions.resize(slot.positions.size());
+            velocities.resize(slot.velocities.size());
+        }
+        _head = (_head + 1) % _capacity;
+        _size = std::min(_size + 1, _capacity);
+    }
+
+    // Restore the snapshot taken age pushes ago (0 = latest) and discard it and all newer ones
+    bool restore(size_t age, float &time, std::vector<Vector3f> &positions, std::vector<Vector3f> &velocities) {
+        if (age >= _size) {
+            return false;
+        }
+        size_t index = (_head + _capacity - 1 - age) % _capacity;
+        Slot &slot = _slots[index];
+        time = slot.time;
+        if (_compressed) {
+            decompressPositions(slot.positionsCompressed, positions);
+            decompressVelocities(slot.velocitiesCompressed, slot.velocityScale, velocities);
+        } else {
+            std::swap(slot.positions, positions);
+            std::swap(slot.velocities, velocities);
+        }
+        _head = index;
+        _size -= age + 1;
+        return true;
+    }
+
+    // Restore the oldest snapshot
+    bool restoreOldest(float &time, std::vector<Vector3f> &positions, std::vector<Vector3f> &velocities) {
+        return _size > 0 && restore(_size - 1, time, positions, velocities);
+    }
+
+    // Write the snapshots from oldest to newest (raw or compressed, as stored)
+    void write(std::ostream &os) const {
+        Serialize::write(os, _capacity);
+        Serialize::write(os, _bounds);
+        Serialize::write(os, _compressed);
+        Serialize::write(os, _size);
+        for (size_t age = _size; age-- > 0;) {
+            const Slot &slot = _slots[(_head + _capacity - 1 - age) % _capacity];
+            Serialize::write(os, slot.time);
+            if (_compressed) {
+                Serialize::write(os, slot.velocityScale);
+                Serialize::writeVector(os, slot.positionsCompressed);
+                Serialize::writeVector(os, slot.velocitiesCompressed);
+            } else {
+                Serialize::writeVector(os, slot.positions);
+                Serialize::writeVector(os, slot.velocities);
+            }
+        }
+    }
+
+    // Read snapshots written by write(), buffers are reserved for maxCount particles
+    void read(std::istream &is, size_t maxCount) {
+        Serialize::read(is, _capacity);
+        Serialize::read(is, _bounds);
+        Serialize::read(is, _compressed);
+        Serialize::read(is, _size);
+        _capacity = std::max(size_t(1), _capacity);
+        _size = std::min(_size, _capacity);
+        _count = maxCount;
+        _slots.clear();
+        _slots.resize(_capacity);
+        for (size_t i = 0; i < _size; ++i) {
+            Slot &slot = _slots[i];
+            Serialize::read(is, slot.time);
+            if (_compressed) {
+                Serialize::read(is, slot.velocityScale);
+                Serialize::readVector(is, slot.positionsCompressed);
+                Serialize::readVector(is, slot.velocitiesCompressed);
+                _count = std::max(_count, slot.positionsCompressed.size() / 3);
+            } else {
+                Serialize::readVector(is, slot.positions);
+                Serialize::readVector(is, slot.velocities);
+                _count = std::max(_count, slot.positions.size());
+            }
+        }
+        for (auto &slot : _slots) {
+            if (_compressed) {
+                slot.positionsCompressed.reserve(3 * _count);
+                slot.velocitiesCompressed.reserve(3 * _count);
+            } else {
+                slot.positions.reserve(_count);
+                slot.velocities.reserve(_count);
+            }
+        }
+        _head = _size % _capacity;
+    }
+
+    // Returns true if the ring was set up with the given capacity and compression (see init())
+    bool matches(size_t capacity, bool compressed) const {
+        return _capacity == std::max(size_t(1), capacity) && _compressed == compressed && !_slots.empty();
+    }
+
+private:
+    static inline uint16_t quantize(float x) {
+        return uint16_t(clamp(x, 0.f, 1.f) * 65535.f + 0.5f);
+    }
+
+    static inline float dequantize(uint16_t x) {
+        return x * (1.f / 65535.f);
+    }
+
+    void compressPositions(const std::vector<Vector3f> &positions, std::vector<uint16_t> &result) const {
+        result.resize(3 * positions.size());
+        Vector3f invExtents = Vector3f(1.f).cwiseQuotient(_bounds.extents());
+        parallelForRange(0, positions.size(), 1024, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                Vector3f p = (positions[i] - _bounds.min).cwiseProduct(invExtents);
+                for (int k = 0; k < 3; ++k) {
+                    result[3 * i + k] = quantize(p[k]);
+                }
+            }
+        }, Partitioner::Static);
+    }
+
+    void decompressPositions(const std::vector<uint16_t> &data, std::vector<Vector3f> &positions) const {
+        Vector3f extents = _bounds.extents();
+        parallelForRange(0, positions.size(), 1024, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                Vector3f p(dequantize(data[3 * i]), dequantize(data[3 * i + 1]), dequantize(data[3 * i + 2]));
+                positions[i] = _bounds.min + p.cwiseProduct(extents);
+            }
+        }, Partitioner::Static);
+    }
+
+    // Returns the scale used for quantization (max. absolute velocity component)
+    float compressVelocities(const std::vector<Vector3f> &velocities, std::vector<uint16_t> &result) const {
+        float scale = 1e-8f;
+        for (const auto &v : velocities) {
+            scale = std::max(scale, v.cwiseAbs().maxCoeff());
+        }
+        float invScale = 0.5f / scale;
+        result.resize(3 * velocities.size());
+        parallelForRange(0, velocities.size(), 1024, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                for (int k = 0; k < 3; ++k) {
+                    result[3 * i + k] = quantize(velocities[i][k] * invScale + 0.5f);
+                }
+            }
+        }, Partitioner::Static);
+        return scale;
+    }
+
+    void decompressVelocities(const std::vector<uint16_t> &data, float scale, std::vector<Vector3f> &velocities) const {
+        parallelForRange(0, velocities.size(), 1024, [&] (const ParallelRange &range) {
+            for (size_t i = range.begin(); i < range.end(); ++i) {
+                for (int k = 0; k < 3; ++k) {
+                    velocities[i][k] = (dequantize(data[3 * i + k]) - 0.5f) * 2.f * scale;
+                }
+            }
+        }, Partitioner::Static);
+    }
+
+    struct Slot {
+        float time;
+        std::vector<Vector3f> positions;
+        std::vector<Vector3f> velocities;
+        std::vector<uint16_t> positionsCompressed;
+        std::vector<uint16_t> velocitiesCompressed;
+        float velocityScale;
+    };
+
+    size_t _capacity = 1;
+    size_t _count = 0;
+    Box3f _bounds;
+    bool _compressed = false;
+    std::vector<Slot> _slots;
+    size_t _head = 0;
+    size_t _size = 0;
+};
+
+} // namespace pbs
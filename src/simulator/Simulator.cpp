@@ -1,12 +1,15 @@
 #include "Simulator.h"
 
 #include "core/FileUtils.h"
+#include "core/Serialize.h"
 #include "sim/Scene.h"
 #include "sim/SPH.h"
 
 #include <exec-stream.h>
 #include <tinydir.h>
 
+#include <fstream>
+
 namespace pbs {
 
 Simulator::Simulator(const SimulatorSettings &settings) :
@@ -16,19 +19,35 @@ Simulator::Simulator(const SimulatorSettings &settings) :
 {
     setVisible(true);
 
-    _engine.loadScene(settings.filename, settings.sceneSettings);
-    _engine.viewOptions().showDebug = false;
-
     _basename = FileUtils::splitExtension(_settings.filename).first;
     if (!_settings.tag.empty()) {
         _basename += "-" + _settings.tag;
     }
+    _checkpointPath = _basename + ".checkpoint";
+    _imageDir = _settings.tag.empty() ? "images" : "images-" + _settings.tag;
+
+    if (_settings.resume) {
+        // Continue with the next frame, images and cache frames written so far are kept
+        std::ifstream is(_checkpointPath, std::ios::binary);
+        if (!is.good()) {
+            throw Exception("Cannot open checkpoint '%s'", _checkpointPath);
+        }
+        Serialize::read(is, _frameIndex);
+        Serialize::read(is, _frameTime);
+        _engine.loadScene(settings.filename, settings.sceneSettings, &is, _basename);
+        FileUtils::createDir(_imageDir);
+        std::cout << tfm::format("Resuming from '%s' at frame %d (time = %.3f s)", _checkpointPath, _frameIndex, _engine.time()) << std::endl;
+    } else {
+        _engine.loadScene(settings.filename, settings.sceneSettings, nullptr, _basename);
+        setupEmptyDirectory(_imageDir);
+    }
+    _engine.viewOptions().showDebug = false;
 
     _frameInterval = _settings.timescale / _settings.framerate;
-
-    setupEmptyDirectory("images");
+    _startTime = _engine.time();
 
     _timer.reset();
+    _checkpointTimer.reset();
 }
 
 Simulator::~Simulator() {
@@ -65,7 +84,7 @@ void Simulator::drawContents() {
 
         }
 
-        _engine.renderToPNG(tfm::format("images/frame%04d.png", _frameIndex));
+        _engine.renderToPNG(tfm::format("%s/frame%04d.png", _imageDir, _frameIndex));
         if (_settings.cacheParticles || _settings.cacheMesh) {
             _engine.writeCache(_frameIndex, _settings.cacheParticles, _settings.cacheMesh);
         }
@@ -73,6 +92,11 @@ void Simulator::drawContents() {
         _frameTime += _frameInterval;
         ++_frameIndex;
 
+        if ((_settings.checkpointFrames > 0 && _frameIndex % _settings.checkpointFrames == 0) ||
+            (_settings.checkpointMinutes > 0.f && _checkpointTimer.elapsed() >= _settings.checkpointMinutes * 60000.0)) {
+            writeCheckpoint();
+        }
+
         _engine.viewOptions().showDebug = true;
         _engine.viewOptions().showFluidParticles = true;
         _engine.viewOptions().showFluidMesh = false;
@@ -85,7 +109,8 @@ void Simulator::drawContents() {
     // Show time estimate
     float elapsed = _timer.elapsed();
     float progress = _engine.time() / _settings.duration;
-    float eta = progress != 0.f ? elapsed / progress - elapsed : 0.f;
+    float startProgress = _startTime / _settings.duration;
+    float eta = progress > startProgress ? elapsed * (1.f - progress) / (progress - startProgress) : 0.f;
     std::cout << tfm::format("\rProgress %.1f%% (Elapsed: %s ETA: %s)", progress * 100.f, timeString(elapsed), timeString(eta)) << std::flush;
 
     _engine.updateStep();
@@ -105,6 +130,29 @@ void Simulator::terminate() {
     setVisible(false);
 }
 
+// Checkpoints are written at frame boundaries and store the next frame index and time along with
+// the simulation state. The file is replaced atomically, so a crash while writing keeps the last one.
+void Simulator::writeCheckpoint() {
+    Timer timer;
+    std::string tmpPath = _checkpointPath + ".tmp";
+    {
+        std::ofstream os(tmpPath, std::ios::binary);
+        Serialize::write(os, _frameIndex);
+        Serialize::write(os, _frameTime);
+        _engine.writeCheckpoint(os);
+        if (!os.good()) {
+            std::cerr << tfm::format("Failed to write checkpoint '%s'", tmpPath) << std::endl;
+            return;
+        }
+    }
+    if (!FileUtils::replaceFile(tmpPath, _checkpointPath)) {
+        std::cerr << tfm::format("Failed to replace checkpoint '%s' with '%s'", _checkpointPath, tmpPath) << std::endl;
+        return;
+    }
+    _checkpointTimer.reset();
+    DBG("Wrote checkpoint '%s' at frame %d, took %s", _checkpointPath, _frameIndex, timer.elapsedString());
+}
+
 void Simulator::createVideo() {
     // FFMPEG candidate locations
     std::vector<std::string> candidates = {
@@ -130,7 +178,7 @@ void Simulator::createVideo() {
     std::cout << tfm::format("Encoding video '%s' ...", filename) << std::endl;
 
     try {
-        std::string arguments = tfm::format("-y -framerate %d -i images/frame%%04d.png -pix_fmt yuv420p -vcodec libx264 -r %d -preset slow -crf 10 %s", _settings.framerate, _settings.framerate, filename);
+        std::string arguments = tfm::format("-y -framerate %d -i %s/frame%%04d.png -pix_fmt yuv420p -vcodec libx264 -r %d -preset slow -crf 10 %s", _settings.framerate, _imageDir, _settings.framerate, filename);
         exec_stream_t es;
         // Set 5 minutes timeout
         es.set_wait_timeout(exec_stream_t::s_out | exec_stream_t::s_err | exec_stream_t::s_child, 300*1000);
@@ -24,6 +24,10 @@ struct SimulatorSettings {
     RenderMode renderMode;
     bool cacheParticles = false;
     bool cacheMesh = false;
+    int checkpointFrames = 0;               ///< Write a checkpoint every N frames (0 = off)
+    float checkpointMinutes = 0.f;          ///< Write a checkpoint at the next frame after N minutes (0 = off)
+    bool resume = false;                    ///< Resume from the last checkpoint
+    float preview = 1.f;                    ///< Particle size factor of a coarse preview (1 = full resolution)
     json11::Json sceneSettings;
 
     static std::string renderModeToString(RenderMode renderMode) {
@@ -54,18 +58,24 @@ private:
     void initialize();
     void terminate();
     void createVideo();
+    void writeCheckpoint();
 
     void setupEmptyDirectory(const filesystem::path &path);
 
     SimulatorSettings _settings;
     Engine _engine;
 
-    std::string _basename;
+    std::string _basename;                  ///< Scene path without extension and with the tag (outputs of tagged runs don't mix)
+    std::string _checkpointPath;
+    std::string _imageDir;
     int _frameIndex = 0;
     float _frameTime = 0.f;
     float _frameInterval;
 
+    float _startTime = 0.f;                 ///< Simulation time at startup (non-zero when resuming)
+
     Timer _timer;
+    Timer _checkpointTimer;
 };
 
 } // namespace pbs
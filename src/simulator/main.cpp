@@ -21,6 +21,10 @@ int main(int argc, char *argv[]) {
     ("renderMode", tfm::format("Render Mode (default: %s)", renderMode), cxxopts::value<std::string>(renderMode), "[particles|mesh]")
     ("cacheParticles", tfm::format("Write particle cache (default: %d)", settings.cacheParticles), cxxopts::value<bool>(settings.cacheParticles), "")
     ("cacheMesh", tfm::format("Write mesh cache (default: %d)", settings.cacheMesh), cxxopts::value<bool>(settings.cacheMesh), "")
+    ("checkpointFrames", tfm::format("Write a checkpoint every N frames (default: %d, 0 = off)", settings.checkpointFrames), cxxopts::value<int>(settings.checkpointFrames), "N")
+    ("checkpointMinutes", tfm::format("Write a checkpoint every N minutes (default: %.1f, 0 = off)", settings.checkpointMinutes), cxxopts::value<float>(settings.checkpointMinutes), "min")
+    ("resume", "Resume from the last checkpoint (<scene>[-<tag>].checkpoint)", cxxopts::value<bool>(settings.resume), "")
+    ("preview", "Coarse preview with N times larger particles (parameters are rescaled, outputs incl. cache and images are tagged 'previewN')", cxxopts::value<float>(settings.preview), "N")
     ("D,define", "Parameter definition", cxxopts::value<std::vector<std::string>>(), "name=value")
     ("tag", "Tag to append to output files", cxxopts::value<std::string>(settings.tag), "")
     ("input", "Input files", cxxopts::value<std::vector<std::string>>())
@@ -67,6 +71,12 @@ int main(int argc, char *argv[]) {
             }
         }
     }
+    if (settings.preview != 1.f) {
+        definitionValues["previewScale"] = settings.preview;
+        if (settings.tag.empty()) {
+            settings.tag = tfm::format("preview%g", settings.preview);
+        }
+    }
     settings.sceneSettings = json11::Json(definitionValues);
 
     if (options.count("input") != 1) {
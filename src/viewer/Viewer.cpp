@@ -36,7 +36,7 @@ Viewer::Viewer(const ViewerSettings &settings) :
     initializeGUI();
     refreshGUI();
 
-    loadScene(settings.filename);
+    loadScene(settings.filename, settings.sceneSettings);
 }
 
 Viewer::~Viewer() {
@@ -211,8 +211,8 @@ void Viewer::createCameraJson() {
     DBG("%s", str);
 }
 
-void Viewer::loadScene(const filesystem::path &path) {
-    _engine.loadScene(path);
+void Viewer::loadScene(const filesystem::path &path, const json11::Json &settings) {
+    _engine.loadScene(path, settings);
 }
 
 } // namespace pbs
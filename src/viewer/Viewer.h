@@ -13,6 +13,7 @@
 #include <nanogui/window.h>
 
 #include <filesystem/path.h>
+#include <json11.h>
 
 #include <memory>
 
@@ -20,6 +21,7 @@ namespace pbs {
 
 struct ViewerSettings {
     std::string filename;
+    json11::Json sceneSettings;
 };
 
 // Viewer screen.
@@ -45,7 +47,7 @@ private:
 
     void createCameraJson();
 
-    void loadScene(const filesystem::path &path);
+    void loadScene(const filesystem::path &path, const json11::Json &settings);
 
     nanogui::Window *_window;
 
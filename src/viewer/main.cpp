@@ -7,9 +7,11 @@ int main(int argc, char *argv[]) {
     cxxopts::Options options(argv[0], " - Fluid Simulator Viewer");
 
     pbs::ViewerSettings settings;
+    float preview = 1.f;
 
     options.add_options()
     ("h,help", "Print help")
+    ("preview", "Coarse preview with N times larger particles (parameters are rescaled)", cxxopts::value<float>(preview), "N")
     ("input", "Input files", cxxopts::value<std::vector<std::string>>())
     ;
 
@@ -38,6 +40,9 @@ int main(int argc, char *argv[]) {
         std::cout << options.help() << std::endl;
     }
     settings.filename = options["input"].as<std::vector<std::string>>().front();
+    if (preview != 1.f) {
+        settings.sceneSettings = json11::Json::object { { "previewScale", preview } };
+    }
 
     try {
         nanogui::init();